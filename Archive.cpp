@@ -0,0 +1,445 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#include "Archive.h"
+#include "MTP.h"
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <string_view>
+#include <thread>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace
+{
+	constexpr size_t BLOCK_SIZE = 512;
+	constexpr size_t NAME_LENGTH = 100;
+	constexpr uint64_t MAX_USTAR_SIZE = 077777777777;
+
+	// The last bytes of the archive: where the index starts, and a marker
+	constexpr char TRAILER_MAGIC[8] = { 'R', 'A', 'I', 'N', 'D', 'E', 'X', '1' };
+	constexpr size_t TRAILER_SIZE = 8 + sizeof(TRAILER_MAGIC);
+	constexpr char INDEX_MAGIC[4] = { 'R', 'A', 'I', 'X' };
+	constexpr uint32_t INDEX_VERSION = 1;
+
+	// Frames of uncompressed blocks need no library to write or read back
+	constexpr uint32_t ZSTD_FRAME_MAGIC = 0xFD2FB528;
+	constexpr uint32_t ZSTD_SKIPPABLE_FRAME_MAGIC = 0x184D2A5E;
+	constexpr size_t ZSTD_MAX_BLOCK_SIZE = 128 * 1024;
+	constexpr unsigned char ZSTD_WINDOW_128K = 7 << 3; // 2^(10 + 7) bytes
+
+	// All integers are stored little-endian, regardless of the host
+	template<typename T> void AppendInt(std::string& s, T value)
+	{
+		for (size_t n = 0; n < sizeof(T); ++n)
+			s.push_back(static_cast<char>(static_cast<uint64_t>(value) >> (8 * n)));
+	}
+
+	template<typename T> bool ReadInt(std::string_view& s, T& value)
+	{
+		if (s.size() < sizeof(T)) return false;
+		uint64_t v{};
+		for (size_t n = 0; n < sizeof(T); ++n)
+			v |= static_cast<uint64_t>(static_cast<unsigned char>(s[n])) << (8 * n);
+		value = static_cast<T>(v);
+		s.remove_prefix(sizeof(T));
+		return true;
+	}
+
+	// Zero-padded and terminated; values that do not fit are cut off
+	void SetOctal(char* field, size_t width, uint64_t value)
+	{
+		field[width - 1] = '\0';
+		for (size_t n = width - 1; n > 0; --n, value /= 8)
+			field[n - 1] = static_cast<char>('0' + value % 8);
+	}
+
+	uint64_t GetOctal(const char* field, size_t width)
+	{
+		uint64_t value{};
+		for (size_t n = 0; n < width && field[n] >= '0' && field[n] <= '7'; ++n)
+			value = value * 8 + (field[n] - '0');
+		return value;
+	}
+
+	using Block = std::array<char, BLOCK_SIZE>;
+
+	Block MakeHeader(std::string_view name, uint64_t size, int64_t modified, char type)
+	{
+		Block header{};
+		std::memcpy(&header[0], name.data(), std::min(name.size(), NAME_LENGTH));
+		SetOctal(&header[100], 8, 0644);
+		SetOctal(&header[108], 8, 0);
+		SetOctal(&header[116], 8, 0);
+		SetOctal(&header[124], 12, size);
+		SetOctal(&header[136], 12, static_cast<uint64_t>(std::max<int64_t>(modified, 0)));
+		header[156] = type;
+		std::memcpy(&header[257], "ustar", 6);
+		std::memcpy(&header[263], "00", 2);
+
+		// The checksum is computed as if its own field were spaces
+		std::memset(&header[148], ' ', 8);
+		unsigned int checksum{};
+		for (const auto ch : header) checksum += static_cast<unsigned char>(ch);
+		SetOctal(&header[148], 7, checksum);
+		return header;
+	}
+
+	// "<length> <key>=<value>\n", where the length includes itself
+	std::string MakePaxRecord(const std::string& key, const std::string& value)
+	{
+		const auto length = key.size() + value.size() + 3;
+		auto total = length + std::to_string(length).size();
+		if (std::to_string(total).size() != std::to_string(length).size()) ++total;
+		return std::to_string(total) + ' ' + key + '=' + value + '\n';
+	}
+
+	size_t GetPadding(uint64_t size)
+	{
+		return static_cast<size_t>((BLOCK_SIZE - size % BLOCK_SIZE) % BLOCK_SIZE);
+	}
+}
+
+struct Archive::Compressor
+{
+#ifdef HAVE_ZSTD
+	ZSTD_CCtx* context{};
+	std::vector<char> output;
+
+	Compressor()
+		: context(ZSTD_createCCtx())
+		, output(ZSTD_CStreamOutSize())
+	{
+		// Leave some of the processor to the rest of the backup; this fails
+		// harmlessly if zstd was built without threads
+		const auto numWorkers = std::max(1u, std::thread::hardware_concurrency() / 2);
+		ZSTD_CCtx_setParameter(context, ZSTD_c_compressionLevel, ZSTD_CLEVEL_DEFAULT);
+		ZSTD_CCtx_setParameter(context, ZSTD_c_nbWorkers, static_cast<int>(numWorkers));
+	}
+
+	~Compressor()
+	{
+		ZSTD_freeCCtx(context);
+	}
+#endif
+	// Data of an uncompressed frame that has not been written yet
+	std::vector<char> block;
+	bool frameStarted{};
+};
+
+bool Archive::IsCompressionSupported()
+{
+#ifdef HAVE_ZSTD
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool Archive::IsCompressedFormat(const std::optional<GUID>& format)
+{
+	constexpr std::uint16_t compressedFormats[] = {
+		0x3009, 0x300A, 0x300B, 0x300C, // MP3, AVI, MPEG, ASF
+		0x3801, 0x3807, 0x3808, 0x380B, 0x380F, 0x3810, // JPEG, GIF, JFIF, PNG, JPEG 2000
+		0xB883, // HEIF
+		0xB901, 0xB902, 0xB903, 0xB904, 0xB906, // WMA, OGG, AAC, Audible, FLAC
+		0xB981, 0xB982, 0xB983, 0xB984, // WMV, MP4, MP2, 3GP
+	};
+	if (!format) return false;
+	return std::any_of(std::begin(compressedFormats), std::end(compressedFormats), [&](const auto code) {
+		return *format == mtp::MakeFormat(code);
+	});
+}
+
+Archive::Archive(WriteBudget* budget, bool directIo, bool compress)
+	: compress(compress && IsCompressionSupported())
+	, writer(budget, directIo)
+	, compressor(std::make_unique<Compressor>())
+{
+}
+
+Archive::~Archive()
+{
+	if (opened) Close();
+}
+
+bool Archive::Open(const std::filesystem::path& where)
+{
+	path = where / (compress ? COMPRESSED_FILE_NAME : FILE_NAME);
+	index.clear();
+	position = 0;
+	std::error_code ec;
+	if (LoadIndex()) {
+		// The old index is overwritten by the new entries
+		std::filesystem::resize_file(path, position, ec);
+	} else {
+		index.clear();
+		if (std::filesystem::exists(path, ec)) {
+			// Probably interrupted before the index was written; keep it
+			// around rather than overwriting what it holds
+			auto oldPath = path;
+			oldPath += ".old";
+			std::filesystem::rename(path, oldPath, ec);
+		}
+	}
+	if (ec) return false;
+	opened = writer.Open(path, position > 0);
+	return opened;
+}
+
+const Archive::Entry* Archive::Find(const std::string& entryPath) const
+{
+	auto it = index.find(entryPath);
+	return it != index.end() ? &it->second : nullptr;
+}
+
+bool Archive::LoadIndex()
+{
+	std::ifstream ifs(path, std::ifstream::in | std::ifstream::binary);
+	if (!ifs) return false;
+
+	std::string trailer(TRAILER_SIZE, '\0');
+	if (!ifs.seekg(-static_cast<std::streamoff>(TRAILER_SIZE), std::ios::end)) return false;
+	const auto fileSize = static_cast<uint64_t>(ifs.tellg()) + TRAILER_SIZE;
+	if (!ifs.read(trailer.data(), trailer.size())) return false;
+	std::string_view trailerView(trailer);
+	uint64_t indexOffset;
+	if (!ReadInt(trailerView, indexOffset) || trailerView != std::string_view(TRAILER_MAGIC, sizeof(TRAILER_MAGIC))) return false;
+	if (indexOffset > fileSize) return false;
+	if (!ifs.seekg(static_cast<std::streamoff>(indexOffset))) return false;
+
+	// The index is written uncompressed, so its frame only holds raw blocks
+	std::string member;
+	if (compress) {
+		std::string header(6, '\0');
+		std::string_view headerView(header);
+		uint32_t magic;
+		if (!ifs.read(header.data(), header.size()) || !ReadInt(headerView, magic) || magic != ZSTD_FRAME_MAGIC) return false;
+		if (headerView[0] != 0 || static_cast<unsigned char>(headerView[1]) != ZSTD_WINDOW_128K) return false;
+		while (true) {
+			unsigned char blockHeader[3];
+			if (!ifs.read(reinterpret_cast<char*>(blockHeader), sizeof(blockHeader))) return false;
+			const auto value = blockHeader[0] | blockHeader[1] << 8 | blockHeader[2] << 16;
+			const auto blockSize = static_cast<size_t>(value >> 3);
+			if ((value >> 1 & 3) != 0 || blockSize > ZSTD_MAX_BLOCK_SIZE) return false;
+			const auto offset = member.size();
+			member.resize(offset + blockSize);
+			if (!ifs.read(&member[offset], blockSize)) return false;
+			if (value & 1) break;
+		}
+	} else {
+		member.resize(BLOCK_SIZE);
+		if (!ifs.read(member.data(), member.size())) return false;
+		// Damaged headers must not make us allocate more than the file holds
+		const auto size = GetOctal(&member[124], 12);
+		if (size > fileSize - indexOffset - BLOCK_SIZE) return false;
+		member.resize(BLOCK_SIZE + size);
+		if (!ifs.read(&member[BLOCK_SIZE], size)) return false;
+	}
+	if (member.size() < BLOCK_SIZE || member.compare(0, std::strlen(INDEX_NAME) + 1, INDEX_NAME, std::strlen(INDEX_NAME) + 1) != 0) return false;
+	const auto size = GetOctal(&member[124], 12);
+	if (member.size() < BLOCK_SIZE + size) return false;
+
+	std::string_view data(&member[BLOCK_SIZE], size);
+	if (data.substr(0, sizeof(INDEX_MAGIC)) != std::string_view(INDEX_MAGIC, sizeof(INDEX_MAGIC))) return false;
+	data.remove_prefix(sizeof(INDEX_MAGIC));
+	uint32_t version;
+	uint64_t numEntries;
+	if (!ReadInt(data, version) || version != INDEX_VERSION || !ReadInt(data, numEntries)) return false;
+	for (uint64_t n = 0; n < numEntries; ++n) {
+		uint32_t length;
+		Entry e;
+		if (!ReadInt(data, length) || data.size() < length) return false;
+		std::string entryPath(data.substr(0, length));
+		data.remove_prefix(length);
+		if (!ReadInt(data, e.offset) || !ReadInt(data, e.size) || !ReadInt(data, e.modified)) return false;
+		index[std::move(entryPath)] = e;
+	}
+	position = indexOffset;
+	return true;
+}
+
+bool Archive::BeginEntry(const std::string& path, uint64_t size, int64_t modified, bool compressible)
+{
+	if (!opened) return false;
+	entryPath = path;
+	entry = { position, size, modified };
+	entryBytes = 0;
+	entryFailed = false;
+	entryCompressed = compress && compressible;
+	return WriteHeader(path, size, modified);
+}
+
+bool Archive::Write(const void* data, size_t length)
+{
+	entryBytes += length;
+	if (entryBytes > entry.size || !Put(data, length)) entryFailed = true;
+	return !entryFailed;
+}
+
+bool Archive::EndEntry()
+{
+	const Block padding{};
+	if (entryFailed || entryBytes != entry.size ||
+		!Put(padding.data(), GetPadding(entry.size)) || !FinishFrame()) {
+		DiscardEntry();
+		return false;
+	}
+	index[entryPath] = entry;
+	return true;
+}
+
+void Archive::DiscardEntry()
+{
+	// Rarely needed, so simply cut the file back to where the entry started
+	writer.Close();
+	std::error_code ec;
+	std::filesystem::resize_file(path, entry.offset, ec);
+	position = entry.offset;
+	opened = !ec && writer.Open(path, true);
+	compressor->block.clear();
+	compressor->frameStarted = false;
+#ifdef HAVE_ZSTD
+	ZSTD_CCtx_reset(compressor->context, ZSTD_reset_session_only);
+#endif
+}
+
+bool Archive::Close()
+{
+	if (!opened) return false;
+	opened = false;
+
+	std::string data(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+	AppendInt<uint32_t>(data, INDEX_VERSION);
+	AppendInt<uint64_t>(data, index.size());
+	for (const auto& [entryPath, e] : index) {
+		AppendInt<uint32_t>(data, static_cast<uint32_t>(entryPath.size()));
+		data += entryPath;
+		AppendInt<uint64_t>(data, e.offset);
+		AppendInt<uint64_t>(data, e.size);
+		AppendInt<int64_t>(data, e.modified);
+	}
+
+	// The index is an ordinary file in the archive, followed by the end of
+	// archive marker and the trailer that points at the index. Compressed
+	// archives keep the trailer in a frame that decompressors skip
+	const auto indexOffset = position;
+	entryCompressed = false;
+	const Block zeroes{};
+	bool ok = WriteHeader(INDEX_NAME, data.size(), std::time(nullptr)) &&
+		Put(data.data(), data.size()) && Put(zeroes.data(), GetPadding(data.size())) && FinishFrame();
+	ok = ok && Put(zeroes.data(), zeroes.size()) && Put(zeroes.data(), zeroes.size()) && FinishFrame();
+
+	std::string trailer;
+	if (compress) {
+		AppendInt<uint32_t>(trailer, ZSTD_SKIPPABLE_FRAME_MAGIC);
+		AppendInt<uint32_t>(trailer, static_cast<uint32_t>(TRAILER_SIZE));
+	} else {
+		// Tar readers stop at the end of archive marker, but expect whole blocks
+		trailer.resize(BLOCK_SIZE - TRAILER_SIZE);
+	}
+	AppendInt<uint64_t>(trailer, indexOffset);
+	trailer.append(TRAILER_MAGIC, sizeof(TRAILER_MAGIC));
+	ok = ok && writer.Write(trailer.data(), trailer.size());
+	return writer.Close() && ok;
+}
+
+bool Archive::WriteHeader(const std::string& entryPath, uint64_t size, int64_t modified)
+{
+	// Long names and huge files need a pax header in front
+	std::string records;
+	if (entryPath.size() > NAME_LENGTH) records += MakePaxRecord("path", entryPath);
+	if (size > MAX_USTAR_SIZE) records += MakePaxRecord("size", std::to_string(size));
+	if (!records.empty()) {
+		const auto paxHeader = MakeHeader("././@PaxHeader", records.size(), modified, 'x');
+		const Block padding{};
+		if (!Put(paxHeader.data(), paxHeader.size()) || !Put(records.data(), records.size()) ||
+			!Put(padding.data(), GetPadding(records.size())))
+			return false;
+	}
+	const auto header = MakeHeader(entryPath, std::min(size, MAX_USTAR_SIZE), modified, '0');
+	return Put(header.data(), header.size());
+}
+
+bool Archive::Put(const void* data, size_t length)
+{
+	if (!compress) return Emit(data, length);
+
+#ifdef HAVE_ZSTD
+	if (entryCompressed) {
+		ZSTD_inBuffer in{ data, length, 0 };
+		while (in.pos < in.size) {
+			ZSTD_outBuffer out{ compressor->output.data(), compressor->output.size(), 0 };
+			if (ZSTD_isError(ZSTD_compressStream2(compressor->context, &out, &in, ZSTD_e_continue))) return false;
+			if (out.pos > 0 && !Emit(out.dst, out.pos)) return false;
+		}
+		return true;
+	}
+#endif
+
+	auto& block = compressor->block;
+	auto p = static_cast<const char*>(data);
+	while (length > 0) {
+		// A block is only written once more data follows, as the last one
+		// must be marked as such
+		if (block.size() == ZSTD_MAX_BLOCK_SIZE && !EmitBlock(false)) return false;
+		const auto n = std::min(length, ZSTD_MAX_BLOCK_SIZE - block.size());
+		block.insert(block.end(), p, p + n);
+		p += n;
+		length -= n;
+	}
+	return true;
+}
+
+bool Archive::FinishFrame()
+{
+	if (!compress) return true;
+
+#ifdef HAVE_ZSTD
+	if (entryCompressed) {
+		ZSTD_inBuffer in{ nullptr, 0, 0 };
+		size_t remaining;
+		do {
+			ZSTD_outBuffer out{ compressor->output.data(), compressor->output.size(), 0 };
+			remaining = ZSTD_compressStream2(compressor->context, &out, &in, ZSTD_e_end);
+			if (ZSTD_isError(remaining)) return false;
+			if (out.pos > 0 && !Emit(out.dst, out.pos)) return false;
+		} while (remaining > 0);
+		return true;
+	}
+#endif
+	return EmitBlock(true);
+}
+
+bool Archive::EmitBlock(bool last)
+{
+	auto& block = compressor->block;
+	if (!compressor->frameStarted) {
+		std::string header;
+		AppendInt<uint32_t>(header, ZSTD_FRAME_MAGIC);
+		header.push_back(0); // no content size, checksum or dictionary
+		header.push_back(static_cast<char>(ZSTD_WINDOW_128K));
+		if (!Emit(header.data(), header.size())) return false;
+		compressor->frameStarted = true;
+	}
+
+	const auto value = static_cast<uint32_t>(block.size() << 3 | (last ? 1 : 0)); // raw block
+	const char blockHeader[3] = { static_cast<char>(value), static_cast<char>(value >> 8), static_cast<char>(value >> 16) };
+	const auto ok = Emit(blockHeader, sizeof(blockHeader)) && Emit(block.data(), block.size());
+	block.clear();
+	if (last) compressor->frameStarted = false;
+	return ok;
+}
+
+bool Archive::Emit(const void* data, size_t length)
+{
+	position += length;
+	return writer.Write(data, length);
+}
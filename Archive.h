@@ -0,0 +1,94 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "FileWriter.h"
+#include "Platform.h"
+
+class WriteBudget;
+
+// Stores the files of a backup location in a single tar archive, rather
+// than creating a file and directory entry for each of them, which is what
+// takes most of the time for phones with lots of small files. Every run
+// appends what changed; the index at the end of the archive tells where
+// the latest version of each file is, so that files can be extracted
+// without reading everything before them.
+//
+// When compressed, every file becomes a zstd frame of its own, so the whole
+// archive still decompresses to a tar stream while the index points at the
+// frames. Formats that are compressed already are stored as they are
+class Archive
+{
+public:
+	static constexpr auto FILE_NAME = "backup.tar";
+	static constexpr auto COMPRESSED_FILE_NAME = "backup.tar.zst";
+	static constexpr auto INDEX_NAME = ".replicandroid-index";
+
+	struct Entry
+	{
+		uint64_t offset{}; // of the tar header, or of the zstd frame holding it
+		uint64_t size{};
+		int64_t modified{};
+	};
+
+	// Compression requires building with HAVE_ZSTD and linking against zstd
+	static bool IsCompressionSupported();
+	// Whether the format is compressed already, so compressing it again
+	// would only cost time
+	static bool IsCompressedFormat(const std::optional<GUID>& format);
+
+	Archive(WriteBudget* budget, bool directIo, bool compress);
+	~Archive();
+
+	// Continues the archive in the given directory if there is one with an
+	// intact index, otherwise starts a new one
+	bool Open(const std::filesystem::path& where);
+	size_t GetNumEntries() const { return index.size(); }
+	const Entry* Find(const std::string& path) const;
+
+	bool BeginEntry(const std::string& path, uint64_t size, int64_t modified, bool compressible);
+	bool Write(const void* data, size_t length);
+	// Fails, and removes the entry again, unless exactly the announced size
+	// was written
+	bool EndEntry();
+	void DiscardEntry();
+	// Appends the index; until then, the new entries cannot be found
+	bool Close();
+
+private:
+	struct Compressor;
+
+	const bool compress;
+	FileWriter writer;
+	std::unique_ptr<Compressor> compressor;
+	std::filesystem::path path;
+	std::unordered_map<std::string, Entry> index;
+	bool opened{};
+	uint64_t position{}; // where the next entry starts
+
+	// The entry being written
+	std::string entryPath;
+	Entry entry;
+	uint64_t entryBytes{};
+	bool entryCompressed{};
+	bool entryFailed{};
+
+	bool LoadIndex();
+	// Adds to the current entry, compressing it if needed
+	bool Put(const void* data, size_t length);
+	bool FinishFrame();
+	bool EmitBlock(bool last);
+	bool Emit(const void* data, size_t length);
+	bool WriteHeader(const std::string& entryPath, uint64_t size, int64_t modified);
+};
@@ -0,0 +1,684 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#include "Backup.h"
+#include "Archive.h"
+#include "Checksums.h"
+#include "FileWriter.h"
+#include "Hash.h"
+#include "Manifest.h"
+#include "ObjectStore.h"
+#include "PartialFile.h"
+#include "ScanTree.h"
+#include "ScheduledQueue.h"
+#include "Trace.h"
+#include "WorkStealingQueue.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+// The name, path and key of the object are in its node of the scan tree
+struct WorkItem
+{
+	mtp::ObjectID objectID;
+	ScanTree::NodeID node;
+	size_t location;
+	// Also in the node, but scheduling looks at them a lot
+	uint64_t size;
+	int64_t modified;
+	bool unchanged{}; // according to the manifest, no need to look at it
+	bool compressed{}; // already, so not worth compressing again
+};
+using WorkQueue = ScheduledQueue<WorkItem>;
+
+struct PendingItem
+{
+	mtp::ObjectID objectID;
+	ScanTree::NodeID node;
+	size_t location;
+};
+
+// A folder that is being listed by one of the scan workers
+struct ScanFolder
+{
+	PendingItem item;
+	// The rest is guarded by the scan mutex
+	std::vector<mtp::ObjectInfo> objects{}; // found, but not handled yet
+	bool listed{}; // nothing more is to be found
+};
+using ScanFolderPtr = std::shared_ptr<ScanFolder>;
+
+namespace
+{
+	constexpr std::string_view PATH_KEY_PREFIX = "path:";
+
+	// Objects are identified by their persistent ID where the device has one;
+	// otherwise the best we can do is the path
+	std::string GetManifestKey(const mtp::ObjectProperties& props, const std::string& relativePath)
+	{
+		if (props.persistentId) return *props.persistentId;
+		return std::string(PATH_KEY_PREFIX) + relativePath;
+	}
+
+	bool IsPersistentIdKey(std::string_view key)
+	{
+		return key.compare(0, PATH_KEY_PREFIX.size(), PATH_KEY_PREFIX) != 0;
+	}
+
+	bool IsUnchanged(const ManifestEntry* previous, const ScanTree& tree, ScanTree::NodeID id)
+	{
+		const auto& node = tree.Get(id);
+		return previous && node.modified != 0 &&
+			previous->isFolder == node.isFolder &&
+			previous->size == node.size &&
+			previous->modified == node.modified &&
+			tree.HasPath(id, previous->path);
+	}
+
+	// Devices hand out object handles in the order the objects were
+	// created, which tends to follow where they are stored. Handles are
+	// numbers, which are ordered by their length before their digits
+	bool IsStoredBefore(const mtp::ObjectID& a, const mtp::ObjectID& b)
+	{
+		const auto& aId = a.Native();
+		const auto& bId = b.Native();
+		if (aId.size() != bId.size()) return aId.size() < bId.size();
+		return aId < bId;
+	}
+
+	WorkQueue::CompareFn GetScheduleCompare(SchedulePolicy policy)
+	{
+		using Compare = bool (*)(const WorkItem&, const WorkItem&);
+		Compare compare{};
+		switch (policy) {
+			case SchedulePolicy::Discovery:
+				return {};
+			case SchedulePolicy::SmallestFirst:
+				compare = [](const WorkItem& a, const WorkItem& b) { return a.size < b.size; };
+				break;
+			case SchedulePolicy::LargestFirst:
+				compare = [](const WorkItem& a, const WorkItem& b) { return a.size > b.size; };
+				break;
+			case SchedulePolicy::StorageOrder:
+				compare = [](const WorkItem& a, const WorkItem& b) { return IsStoredBefore(a.objectID, b.objectID); };
+				break;
+			case SchedulePolicy::NewestFirst:
+				compare = [](const WorkItem& a, const WorkItem& b) { return a.modified > b.modified; };
+				break;
+		}
+		// Unchanged files take no time at all and make room for the others
+		return [compare](const WorkItem& a, const WorkItem& b) {
+			if (a.unchanged != b.unchanged) return a.unchanged;
+			return compare(a, b);
+		};
+	}
+}
+
+struct Backup::Impl
+{
+	// Number of discovered files the scanner may run ahead of the transfers
+	static constexpr size_t MAX_QUEUED_ITEMS = 1024;
+	// When the files are reordered, it pays to look further ahead
+	static constexpr size_t MAX_SCHEDULED_ITEMS = 16 * 1024;
+	// Transfers that fail for a reason that may go away are tried this many
+	// times in total, waiting twice as long before every next attempt
+	static constexpr unsigned int MAX_ATTEMPTS = 4;
+	static constexpr std::chrono::seconds FIRST_RETRY_DELAY{ 2 };
+	// How often to look for an abort while waiting for a retry or a folder
+	static constexpr std::chrono::milliseconds ABORT_POLL_INTERVAL{ 100 };
+	// Number of folders the scan workers may list before their contents are
+	// handled; what they find is kept in memory until then
+	static constexpr size_t MAX_FOLDERS_AHEAD = 256;
+
+	using Clock = std::chrono::steady_clock;
+
+	struct RetryItem
+	{
+		WorkItem item;
+		unsigned int attempts{}; // made so far
+		unsigned int reopens{}; // of the device, as of the last attempt
+	};
+	// Ordered by when they are due
+	using RetryQueue = std::multimap<Clock::time_point, RetryItem>;
+
+	mtp::SessionPtr activeDevice;
+	BackupLocations locations;
+	BackupOptions options;
+	std::atomic<bool> aborted{};
+
+	Progress progress;
+	trace::Statistics statistics;
+	// Everything found by Scan(); only it adds to this
+	ScanTree tree;
+	// Between Scan() and the workers listing folders for it
+	std::mutex scanMutex;
+	std::condition_variable folderListed;
+	float scanSeconds{};
+	std::chrono::steady_clock::time_point started;
+	std::vector<float> completedAt;
+	unsigned int itemsRetried{};
+	// Only used by Transfer()
+	unsigned int numReopens{};
+	Clock::time_point lastReopen;
+
+	// One manifest per location; the previous ones are only read
+	std::vector<Manifest> previousManifests;
+	std::mutex manifestMutex;
+	std::vector<Manifest> manifests;
+	// One per location, if storing to archives; only used by Transfer()
+	std::vector<std::unique_ptr<Archive>> archives;
+	// One per location, if recording checksums; likewise
+	std::vector<ChecksumFile> checksums;
+
+	bool Enqueue(WorkQueue& queue, WorkItem item)
+	{
+		Progress::Add(progress.totalNumberOfItems);
+		Progress::Add(progress.totalNumberOfBytes, item.size);
+		return queue.Push(std::move(item));
+	}
+
+	void AddToManifest(size_t location, std::string_view key, ManifestEntry entry)
+	{
+		std::lock_guard lock(manifestMutex);
+		manifests[location].Add(std::string(key), std::move(entry));
+	}
+
+	// Puts together the path of the node, which is why it is only done
+	// once it is needed
+	ManifestEntry GetManifestEntry(ScanTree::NodeID id) const
+	{
+		const auto& node = tree.Get(id);
+		return { tree.GetPath(id), node.size, node.modified, node.isFolder };
+	}
+
+	std::string GetDestPath(size_t location, const std::string& relativePath) const
+	{
+		return locations[location].where + '/' + relativePath; // XXX remove illegal stuff
+	}
+
+	// Handles an object found on the device; folders are added to the
+	// pending items, files to the queue, unless the filter of the location
+	// leaves them out. Returns false if the scan must stop
+	bool AddObject(WorkQueue& queue, const PendingItem& parent, const mtp::ObjectID& id, const mtp::ObjectProperties& props, std::vector<PendingItem>& pendingItems)
+	{
+		if (!props.name) return true;
+
+		const auto isFolder = props.contentType == WPD_CONTENT_TYPE_FOLDER;
+		const auto& filter = locations[parent.location].filter;
+		// Most devices have persistent IDs and most backups no filter, so
+		// this can usually do without the path
+		std::string relativePath;
+		if (!filter.IsEmpty() || !props.persistentId) {
+			relativePath = tree.GetPath(parent.node);
+			if (!relativePath.empty()) relativePath += '/';
+			relativePath += *props.name;
+		}
+		if (!filter.IsIncluded(props, isFolder, relativePath)) return true;
+
+		const auto size = props.size.value_or(0);
+		const auto modified = props.modified.value_or(0);
+		const auto key = GetManifestKey(props, relativePath);
+		const auto node = tree.Add(parent.node, *props.name, key, size, modified, isFolder);
+		if (node == ScanTree::NO_NODE) return false;
+		if (isFolder)
+		{
+			auto entry = GetManifestEntry(node);
+			// Archives do without directories
+			if (archives.empty()) std::filesystem::create_directory(GetDestPath(parent.location, entry.path));
+			AddToManifest(parent.location, key, std::move(entry));
+			pendingItems.push_back({ id, node, parent.location });
+			return true;
+		}
+
+		// Folders are always listed: their modification date does not change
+		// when a file in them is rewritten
+		const auto unchanged = IsUnchanged(previousManifests[parent.location].Find(key), tree, node);
+		if (unchanged) AddToManifest(parent.location, key, GetManifestEntry(node));
+		return Enqueue(queue, { id, node, parent.location, size, modified, unchanged, Archive::IsCompressedFormat(props.format) });
+	}
+
+	// Lists the folders handed out by Scan(), using a session of its own
+	// where the device allows
+	void ListFolders(WorkStealingQueue<ScanFolderPtr>& folders, size_t worker, mtp::Session& session)
+	{
+		while (auto next = folders.Pop(worker)) {
+			auto& folder = **next;
+			// Handed over a batch at a time, so that a large folder does not
+			// hold up the transfers
+			session.EnumerateContentsOnce(folder.item.objectID, [&](auto& batch) {
+				if (aborted) return false;
+				std::lock_guard lock(scanMutex);
+				std::move(batch.begin(), batch.end(), std::back_inserter(folder.objects));
+				folderListed.notify_one();
+				return true;
+			});
+			std::lock_guard lock(scanMutex);
+			folder.listed = true;
+			folderListed.notify_one();
+		}
+	}
+
+	// Handles what the workers found, one folder at a time and in the order
+	// they were found, so that the outcome does not depend on which worker
+	// was the quickest. Returns true if the entire tree was walked
+	bool AddListedFolders(WorkQueue& queue, WorkStealingQueue<ScanFolderPtr>& folders, std::deque<ScanFolderPtr>& order)
+	{
+		size_t numHandedOut = 0;
+		while (!order.empty()) {
+			// Keep the workers busy, without running far ahead of the
+			// transfers in doing so
+			while (numHandedOut < order.size() && numHandedOut < MAX_FOLDERS_AHEAD)
+				folders.Push(order[numHandedOut++]);
+
+			auto& folder = *order.front();
+			std::vector<mtp::ObjectInfo> objects;
+			bool listed;
+			{
+				std::unique_lock lock(scanMutex);
+				while (!aborted && !folder.listed && folder.objects.empty())
+					folderListed.wait_for(lock, ABORT_POLL_INTERVAL);
+				if (aborted) return false;
+				objects.swap(folder.objects);
+				listed = folder.listed;
+			}
+
+			std::vector<PendingItem> subfolders;
+			for (const auto& object : objects) {
+				if (aborted) return false;
+				if (!AddObject(queue, folder.item, object.id, object.properties, subfolders)) return false;
+			}
+			for (auto& subfolder : subfolders)
+				order.push_back(std::make_shared<ScanFolder>(ScanFolder{ std::move(subfolder) }));
+			if (!listed) continue;
+
+			if (aborted || tree.IsFull()) return false;
+			order.pop_front();
+			--numHandedOut;
+		}
+		return true;
+	}
+
+	// Walks the device tree, feeding every file found to the transfer stage.
+	// Folders are listed by a number of workers at once. Returns true if the
+	// entire tree was walked
+	bool Scan(WorkQueue& queue)
+	{
+		std::deque<ScanFolderPtr> order;
+		for (size_t n = 0; n < locations.size(); ++n) {
+			const auto& location = locations[n];
+			// Remember the location itself too, as the parent of what is in it
+			auto props = activeDevice->ReadProperties(location.objectId);
+			const auto key = props ? GetManifestKey(*props, {}) : std::string();
+			const auto root = tree.Add(ScanTree::NO_NODE, {}, key, 0, props ? props->modified.value_or(0) : 0, true);
+			if (props) AddToManifest(n, key, GetManifestEntry(root));
+			order.push_back(std::make_shared<ScanFolder>(ScanFolder{ { location.objectId, root, n } }));
+			std::filesystem::create_directory(location.where);
+		}
+
+		// A single worker shares the session with the transfers, like it
+		// always did; more get sessions of their own if possible
+		const auto numWorkers = std::max(options.scanThreads, 1u);
+		std::vector<mtp::SessionPtr> sessions;
+		for (unsigned int n = 0; n < numWorkers; ++n) {
+			auto session = numWorkers > 1 ? activeDevice->OpenAnother() : mtp::ExpectedOrHResult<mtp::SessionPtr>{ E_NOTIMPL };
+			sessions.push_back(session ? *session : activeDevice);
+		}
+
+		WorkStealingQueue<ScanFolderPtr> folders(numWorkers);
+		std::vector<std::thread> workers;
+		for (unsigned int n = 0; n < numWorkers; ++n) {
+			workers.emplace_back([&, n] {
+				trace::StatisticsScope statisticsScope(statistics);
+				ListFolders(folders, n, *sessions[n]);
+			});
+		}
+		const auto complete = AddListedFolders(queue, folders, order);
+		folders.Close();
+		for (auto& worker : workers)
+			worker.join();
+
+		scanSeconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - started).count();
+		if (complete) progress.scanComplete = true;
+		return complete;
+	}
+
+	struct TransferResult
+	{
+		bool complete{};
+		uint64_t bytesResumed{}; // kept from an earlier attempt
+		uint64_t bytesRead{};
+		HRESULT error{ S_OK }; // if the device failed
+		bool writeFailed{};
+		std::optional<uint64_t> hash{}; // of the entire content, if asked for
+	};
+
+	// Copies a single object by way of a partial file, resuming an earlier
+	// attempt where the device allows. Whatever was received is kept for the
+	// next run if the transfer is not completed
+	TransferResult TransferItem(FileWriter& writer, ObjectStore* store, const WorkItem& item, const std::string& destPath)
+	{
+		// How often the progress of a large transfer is recorded, in case we
+		// do not get the chance to do so once it is interrupted
+		constexpr uint64_t CHECKPOINT_INTERVAL = 32 * 1024 * 1024;
+
+		PartialFile partial(destPath, std::string(tree.Get(item.node).key), item.size, item.modified);
+		auto offset = partial.Resume();
+		// The content hash must cover the data we already have. The rest is
+		// hashed by the writer, so that reading from the device goes on
+		const auto hashing = store || options.checksums;
+		Hash64 hash;
+		if (hashing && offset > 0 && !HashFile(partial.GetPath(), hash)) {
+			hash = Hash64{};
+			offset = 0;
+		}
+
+		bool cancelled{};
+		auto nextCheckpoint = offset + CHECKPOINT_INTERVAL;
+		mtp::ExpectedOrHResult<uint64_t> result{ E_FAIL };
+		bool written{};
+		while (writer.Open(partial.GetPath(), offset > 0, hashing ? &hash : nullptr, item.size)) {
+			result = activeDevice->ReadDataFrom(item.objectID, offset, [&](const void* data, size_t length) {
+				if (aborted) {
+					cancelled = true;
+					return false;
+				}
+				if (!writer.Write(data, length)) return false;
+				Progress::Add(progress.bytesInProgress, length);
+				if (const auto bytesWritten = offset + writer.GetBytesWritten(); bytesWritten >= nextCheckpoint) {
+					partial.SaveCheckpoint(bytesWritten);
+					nextCheckpoint = bytesWritten + CHECKPOINT_INTERVAL;
+				}
+				return true;
+			});
+			written = writer.Close();
+
+			// Not every device can start halfway an object; start over then
+			if (offset == 0 || result.GetResult() != E_NOTIMPL) break;
+			offset = 0;
+			hash = Hash64{};
+			nextCheckpoint = CHECKPOINT_INTERVAL;
+		}
+
+		if (!result || !written || cancelled) {
+			// A resume the device keeps refusing would otherwise be tried
+			// again on every run
+			const auto resumeFailed = !result && offset > 0 && mtp::ClassifyError(result.GetResult()) == mtp::ErrorClass::Permanent;
+			std::error_code ec;
+			const auto bytesWritten = std::filesystem::file_size(partial.GetPath(), ec);
+			if (!ec && bytesWritten > 0 && !resumeFailed)
+				partial.SaveCheckpoint(bytesWritten);
+			else
+				partial.Discard();
+			return { false, 0, 0, result.GetResult(), !written };
+		}
+
+		bool committed;
+		if (store) {
+			committed = store->Add(partial.GetPath(), hash.Finish(), offset + *result, destPath);
+			partial.Discard();
+		} else {
+			committed = partial.Commit(destPath);
+		}
+		std::optional<uint64_t> contentHash;
+		if (hashing) contentHash = hash.Finish();
+		return { committed, offset, *result, S_OK, !committed, contentHash };
+	}
+
+	// Appends a single object to the archive of its location. Unlike with
+	// partial files, nothing of an interrupted transfer is kept
+	TransferResult TransferToArchive(Archive& archive, const WorkItem& item, const std::string& relativePath)
+	{
+		if (!archive.BeginEntry(relativePath, item.size, item.modified, !item.compressed)) return { false, 0, 0, S_OK, true };
+
+		bool cancelled{}, writeFailed{};
+		auto result = activeDevice->ReadData(item.objectID, [&](const void* data, size_t length) {
+			if (aborted) {
+				cancelled = true;
+				return false;
+			}
+			if (!archive.Write(data, length)) {
+				writeFailed = true;
+				return false;
+			}
+			Progress::Add(progress.bytesInProgress, length);
+			return true;
+		});
+		if (!result || cancelled || writeFailed) {
+			archive.DiscardEntry();
+			return { false, 0, 0, result.GetResult(), writeFailed };
+		}
+		if (!archive.EndEntry()) return { false, 0, 0, S_OK, true };
+		return { true, 0, *result };
+	}
+
+	// Whether an earlier run stored the item already, even though the
+	// manifest does not know about it. If it does, the item changed since;
+	// the size may well have stayed the same
+	bool IsPresent(const WorkItem& item, std::string_view key, const std::string& relativePath)
+	{
+		if (const auto previous = previousManifests[item.location].Find(std::string(key)); previous && previous->path == relativePath) return false;
+		if (!archives.empty()) {
+			const auto entry = archives[item.location]->Find(relativePath);
+			return entry && entry->size == item.size && entry->modified == item.modified;
+		}
+		std::error_code ec{};
+		const auto size = std::filesystem::file_size(GetDestPath(item.location, relativePath), ec);
+		return !ec && size == item.size;
+	}
+
+	// A reset makes every following call fail until the device is opened
+	// again. Failures right after reopening it are most likely caused by
+	// the same reset, so give the device a moment before trying once more
+	void ReopenDevice()
+	{
+		const auto now = Clock::now();
+		if (numReopens > 0 && now - lastReopen < FIRST_RETRY_DELAY) return;
+		lastReopen = now;
+		if (SUCCEEDED(activeDevice->Reopen())) ++numReopens;
+	}
+
+	// Retries that are due go before anything else. Otherwise this waits for
+	// the scan to come up with the next item, but only until the first retry
+	// is due, so that neither holds up the other. Yields nothing once every
+	// item was handled or the backup is aborted
+	std::optional<RetryItem> NextItem(WorkQueue& queue, RetryQueue& retries)
+	{
+		while (!aborted) {
+			if (!retries.empty() && retries.begin()->first <= Clock::now()) {
+				auto retry = std::move(retries.begin()->second);
+				retries.erase(retries.begin());
+				// Object IDs need not survive reopening the device, but
+				// persistent IDs do
+				if (const auto& key = tree.Get(retry.item.node).key; retry.reopens != numReopens && IsPersistentIdKey(key)) {
+					if (auto id = activeDevice->FindByPersistentId(std::string(key)); id) retry.item.objectID = *id;
+				}
+				return retry;
+			}
+
+			std::optional<WorkItem> item;
+			if (retries.empty()) {
+				item = queue.Pop();
+				if (!item) return {};
+			} else if (queue.IsDrained()) {
+				std::this_thread::sleep_until(std::min(retries.begin()->first, Clock::now() + ABORT_POLL_INTERVAL));
+			} else {
+				item = queue.PopUntil(retries.begin()->first);
+			}
+			if (item) return RetryItem{ std::move(*item), 0, numReopens };
+		}
+		return {};
+	}
+
+	// Copies the files found by Scan() while the scan is still in progress.
+	// Returns true if every item was handled
+	bool Transfer(WorkQueue& queue, std::vector<FailedItem>& failedItems)
+	{
+		std::optional<FileWriter> writer;
+		if (archives.empty()) writer.emplace(options.writeBudget.get(), options.directIo);
+		std::optional<ObjectStore> store;
+		if (!options.objectStore.empty() && archives.empty()) store.emplace(options.objectStore);
+		RetryQueue retries;
+		while (auto next = NextItem(queue, retries)) {
+			auto& item = next->item;
+
+			if (item.unchanged) {
+				Progress::Add(progress.itemsTransferredSkipped);
+				Progress::Add(progress.bytesSkipped, item.size);
+				continue;
+			}
+
+			// This is where the path is first needed
+			const auto& key = tree.Get(item.node).key;
+			auto entry = GetManifestEntry(item.node);
+			if (IsPresent(item, key, entry.path)) {
+				AddToManifest(item.location, key, std::move(entry));
+				Progress::Add(progress.itemsTransferredSkipped);
+				Progress::Add(progress.bytesSkipped, item.size);
+				continue;
+			}
+
+			const auto destPath = GetDestPath(item.location, entry.path);
+			const auto result = writer ?
+				TransferItem(*writer, store ? &*store : nullptr, item, destPath) :
+				TransferToArchive(*archives[item.location], item, entry.path);
+			progress.bytesInProgress.store(0, std::memory_order_relaxed);
+			// An interrupted transfer is resumed by the next run, so it did not fail
+			if (!result.complete && aborted) return false;
+			if (!result.complete)
+			{
+				const auto errorClass = result.writeFailed ? mtp::ErrorClass::Permanent : mtp::ClassifyError(result.error);
+				if (errorClass != mtp::ErrorClass::Permanent && next->attempts + 1 < MAX_ATTEMPTS) {
+					if (errorClass == mtp::ErrorClass::DeviceReset) ReopenDevice();
+					const auto delay = FIRST_RETRY_DELAY * (1 << next->attempts);
+					++next->attempts;
+					next->reopens = numReopens;
+					retries.emplace(Clock::now() + delay, std::move(*next));
+					++itemsRetried;
+					continue;
+				}
+
+				const auto error = result.writeFailed ? std::string("cannot write the destination") : mtp::DescribeError(result.error);
+				failedItems.push_back({ destPath, errorClass, error });
+				Progress::Add(progress.bytesSkipped, item.size);
+				Progress::Add(progress.itemsTransferredFailures);
+			}
+			else
+			{
+				if (result.hash && !checksums.empty()) checksums[item.location].Set(entry.path, *result.hash);
+				AddToManifest(item.location, key, std::move(entry));
+				Progress::Add(progress.bytesSkipped, result.bytesResumed);
+				Progress::Add(progress.bytesRead, result.bytesRead);
+				Progress::Add(progress.itemsTransferredSuccessfully);
+				completedAt.push_back(std::chrono::duration<float>(std::chrono::steady_clock::now() - started).count());
+			}
+		}
+		return !aborted;
+	}
+
+	void SaveManifests(bool complete)
+	{
+		for (size_t n = 0; n < locations.size(); ++n) {
+			auto& manifest = manifests[n];
+			// We must not lose track of what was backed up before
+			if (!complete) manifest.Merge(previousManifests[n]);
+			manifest.Save(locations[n].where);
+		}
+	}
+
+	Result Run()
+	{
+		trace::StatisticsScope statisticsScope(statistics);
+		started = std::chrono::steady_clock::now();
+		// Whatever was cached while browsing may be outdated by now
+		activeDevice->InvalidateAll();
+		for (const auto& location : locations) {
+			previousManifests.push_back(Manifest::Load(location.where));
+			manifests.emplace_back();
+		}
+		if (options.archive) {
+			for (size_t n = 0; n < locations.size(); ++n) {
+				std::filesystem::create_directory(locations[n].where);
+				auto archive = std::make_unique<Archive>(options.writeBudget.get(), options.directIo, options.compress);
+				// Failing to open it fails every transfer, which is reported as such
+				archive->Open(locations[n].where);
+				// The files the manifest knows of are not in there, such
+				// as when the archive was lost or switching from files
+				if (archive->GetNumEntries() == 0) previousManifests[n] = Manifest{};
+				archives.push_back(std::move(archive));
+			}
+		}
+
+		if (options.checksums && archives.empty()) {
+			// Files that are skipped keep the hash they got before
+			for (const auto& location : locations)
+				checksums.push_back(ChecksumFile::Load(location.where));
+		}
+
+		const auto capacity = options.schedule == SchedulePolicy::Discovery ? MAX_QUEUED_ITEMS : MAX_SCHEDULED_ITEMS;
+		WorkQueue queue(capacity, GetScheduleCompare(options.schedule));
+		bool scanComplete{};
+		std::thread scanner([&] {
+			trace::StatisticsScope statisticsScope(statistics);
+			scanComplete = Scan(queue);
+			queue.Close();
+		});
+		std::vector<FailedItem> failedItems;
+		const auto transferComplete = Transfer(queue, failedItems);
+
+		// Unblocks the scanner if we stopped early
+		queue.Close();
+		scanner.join();
+
+		// Without its index, nothing added to an archive can be found
+		bool archivesClosed = true;
+		for (auto& archive : archives) {
+			if (!archive->Close()) archivesClosed = false;
+		}
+
+		const auto complete = scanComplete && transferComplete && archivesClosed;
+		SaveManifests(complete);
+		// Every file listed is complete, even if the backup is not
+		for (size_t n = 0; n < checksums.size(); ++n)
+			checksums[n].Save(locations[n].where);
+		trace::WriteTraceFile();
+		return { progress.GetItems(), std::move(failedItems), complete, std::move(completedAt), itemsRetried, scanSeconds };
+	}
+};
+
+Backup::Backup(mtp::SessionPtr activeDevice, BackupLocations locations, BackupOptions options)
+	: impl(std::make_unique<Impl>(activeDevice, std::move(locations), std::move(options)))
+{
+}
+
+Backup::~Backup() = default;
+
+Backup::Result Backup::Run()
+{
+	return impl->Run();
+}
+
+void Backup::Abort()
+{
+	impl->aborted = true;
+}
+
+const Progress& Backup::GetProgress() const
+{
+	return impl->progress;
+}
+
+const trace::Statistics& Backup::GetStatistics() const
+{
+	return impl->statistics;
+}
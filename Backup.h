@@ -0,0 +1,86 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "MTP.h"
+#include "Config.h"
+#include "Filter.h"
+#include "Progress.h"
+#include "Trace.h"
+#include "WriteBudget.h"
+
+struct BackupLocation
+{
+	mtp::ObjectID objectId;
+	std::string where;
+	Filter filter;
+};
+using BackupLocations = std::vector<BackupLocation>;
+
+struct BackupOptions
+{
+	// If set, file contents are stored once in this content-addressed
+	// directory and the backed up files are links to it
+	std::string objectStore;
+	// Shared by the backups of all devices that run at the same time
+	std::shared_ptr<WriteBudget> writeBudget;
+	// Write files without going through the OS cache, see OutputFile
+	bool directIo{};
+	SchedulePolicy schedule{ SchedulePolicy::Discovery };
+	// Store the files of every location in a single archive, see Archive.
+	// The object store is not used then
+	bool archive{};
+	bool compress{}; // the archive, where supported
+	// Record the hash of every file copied in a ChecksumFile per location.
+	// Not done for archives
+	bool checksums{};
+	// Number of threads listing folders at the same time; each gets a
+	// session of its own where the device allows
+	unsigned int scanThreads{ 1 };
+};
+
+// Copies a number of locations from a device. This does not depend on Qt,
+// so that it can be driven by the user interface as well as from the
+// command line
+class Backup
+{
+public:
+	struct Result
+	{
+		ItemsUpdate items;
+		std::vector<FailedItem> failedItems;
+		bool complete{}; // false if aborted or the device could not be walked entirely
+		// Seconds since the start at which each copied file was done, in
+		// order; shows how soon files are safe with the chosen schedule
+		std::vector<float> completedAt;
+		// Number of times a transfer was tried again after it failed
+		unsigned int itemsRetried{};
+		// Until the device was walked entirely, or the scan stopped
+		float scanSeconds{};
+	};
+
+	Backup(mtp::SessionPtr activeDevice, BackupLocations locations, BackupOptions options);
+	~Backup();
+
+	// Blocks until the backup is done or aborted
+	Result Run();
+	// Makes Run() stop as soon as possible; may be called from any thread
+	void Abort();
+
+	// May be sampled at any time, from any thread
+	const Progress& GetProgress() const;
+	// Device and disk operations of this backup, for diagnosing slow ones
+	const trace::Statistics& GetStatistics() const;
+
+	struct Impl;
+
+private:
+	std::unique_ptr<Impl> impl;
+};
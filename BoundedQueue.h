@@ -0,0 +1,57 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+
+// Blocking FIFO connecting a producer to a consumer thread. Push() blocks
+// while the queue is full; once closed, pushes fail and Pop() drains the
+// remaining items before returning nothing
+template<typename T> class BoundedQueue
+{
+	const size_t capacity;
+	std::mutex mutex;
+	std::condition_variable notFull;
+	std::condition_variable notEmpty;
+	std::deque<T> items;
+	bool closed{};
+
+public:
+	explicit BoundedQueue(size_t capacity) : capacity(capacity) { }
+
+	bool Push(T item)
+	{
+		std::unique_lock lock(mutex);
+		notFull.wait(lock, [&] { return closed || items.size() < capacity; });
+		if (closed) return false;
+		items.push_back(std::move(item));
+		notEmpty.notify_one();
+		return true;
+	}
+
+	std::optional<T> Pop()
+	{
+		std::unique_lock lock(mutex);
+		notEmpty.wait(lock, [&] { return closed || !items.empty(); });
+		if (items.empty()) return {};
+		auto item = std::move(items.front());
+		items.pop_front();
+		notFull.notify_one();
+		return item;
+	}
+
+	void Close()
+	{
+		std::lock_guard lock(mutex);
+		closed = true;
+		notFull.notify_all();
+		notEmpty.notify_all();
+	}
+};
@@ -6,9 +6,10 @@
  */
 #include "BrowseDialog.h"
 #include "MTP.h"
-#include <QStandardItemModel>
+#include "BrowseModel.h"
+#include <QShortcut>
 
-BrowseDialog::BrowseDialog(CComPtr<IPortableDevice>& activeDevice, QWidget* parent)
+BrowseDialog::BrowseDialog(mtp::SessionPtr& activeDevice, QWidget* parent)
     : QDialog(parent)
     , activeDevice(activeDevice)
 {
@@ -16,9 +17,10 @@ BrowseDialog::BrowseDialog(CComPtr<IPortableDevice>& activeDevice, QWidget* pare
     connect(ui.okButton, &QPushButton::clicked, this, &BrowseDialog::OnOkClicked);
     connect(ui.cancelButton, &QPushButton::clicked, this, &BrowseDialog::OnCancelClicked);
     connect(ui.lvItems, &QListView::doubleClicked, this, &BrowseDialog::OnListViewDoubleClicked);
+    connect(new QShortcut(QKeySequence::Refresh, this), &QShortcut::activated, this, &BrowseDialog::OnRefresh);
 
     ui.lvItems->setEditTriggers(QAbstractItemView::NoEditTriggers);
-    model = std::make_unique<QStandardItemModel>(this);
+    model = std::make_unique<BrowseModel>(activeDevice, this);
     ui.lvItems->setModel(model.get());
 
     UpdateModel();
@@ -26,42 +28,26 @@ BrowseDialog::BrowseDialog(CComPtr<IPortableDevice>& activeDevice, QWidget* pare
 
 BrowseDialog::~BrowseDialog() = default;
 
-void BrowseDialog::UpdateModel()
+mtp::ObjectID BrowseDialog::GetCurrentObjectID() const
 {
-    const auto objectId = [&]() -> std::string {
-        if (path.empty()) return "DEVICE";
-        return path.back().id;
-    }();
-    auto contents = mtp::EnumerateContents(activeDevice, objectId);
-    if (!contents) return;
-
-    auto dirIcon = style()->standardIcon(QStyle::SP_DirIcon);
-    auto parentIcon = style()->standardIcon(QStyle::SP_FileDialogToParent);
-
-    model->clear();
-    if (!path.empty()) {
-        model->appendRow(new QStandardItem(parentIcon, "<back>"));
-    }
-    for (const auto& id : *contents)
-    {
-       auto props = mtp::ReadProperties(activeDevice, id);
-       if (!props) continue;
-       if (!props->name) continue;
+    if (path.empty()) return mtp::RootObjectID;
+    return path.back().id;
+}
 
-       auto item = new QStandardItem(dirIcon, QString(props->name.value().c_str()));
-       item->setData(QString(id.c_str()), Qt::UserRole);
-       model->appendRow(item);
-    }
+// The model lists the folder in the background, so the dialog stays usable
+// while a large folder is loading
+void BrowseDialog::UpdateModel()
+{
+    model->SetFolder(GetCurrentObjectID(), !path.empty());
 }
 
 void BrowseDialog::OnListViewDoubleClicked()
 {
     auto index = ui.lvItems->currentIndex();
-    auto userData = model->data(index, Qt::UserRole);
-    if (!userData.isNull())
+    auto id = model->GetObjectID(index);
+    if (!id.empty())
     {
         auto name = model->data(index, Qt::DisplayRole).toString().toStdString();
-        auto id = userData.toString().toStdString();
         path.push_back({ id, name });
     }
     else {
@@ -70,6 +56,12 @@ void BrowseDialog::OnListViewDoubleClicked()
     UpdateModel();
 }
 
+void BrowseDialog::OnRefresh()
+{
+    activeDevice->Invalidate(GetCurrentObjectID());
+    UpdateModel();
+}
+
 void BrowseDialog::OnOkClicked()
 {
     accept();
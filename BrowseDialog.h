@@ -11,7 +11,7 @@
 #include "ui_Browse.h"
 #include "MTP.h"
 
-class QStandardItemModel;
+class BrowseModel;
 
 class BrowseDialog : public QDialog
 {
@@ -25,19 +25,21 @@ public:
 
 private:
     Ui::Browse ui;
-    CComPtr<IPortableDevice> activeDevice;
+    mtp::SessionPtr activeDevice;
     std::vector<PathItem> path;
-    std::unique_ptr<QStandardItemModel> model;
+    std::unique_ptr<BrowseModel> model;
 
+    mtp::ObjectID GetCurrentObjectID() const;
     void UpdateModel();
 
 private slots:
     void OnOkClicked();
     void OnCancelClicked();
     void OnListViewDoubleClicked();
+    void OnRefresh();
 
 public:
-    BrowseDialog(CComPtr<IPortableDevice>&, QWidget *parent = Q_NULLPTR);
+    BrowseDialog(mtp::SessionPtr&, QWidget *parent = Q_NULLPTR);
     virtual ~BrowseDialog();
 
     const auto& GetPath() const { return path;  }
@@ -0,0 +1,180 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#include "BrowseModel.h"
+#include <QApplication>
+#include <QStyle>
+#include <atomic>
+#include <deque>
+#include <mutex>
+
+// Shared between the model and the worker thread listing a folder
+struct BrowseModel::Job
+{
+    std::mutex mutex;
+    BrowseModel* model{}; // cleared once the model loses interest
+    std::deque<mtp::ObjectInfo> pending;
+    bool loading{ true };
+    std::atomic<bool> finished{};
+
+    bool IsCancelled()
+    {
+        std::lock_guard lock(mutex);
+        return model == nullptr;
+    }
+
+    // Must be called with the mutex held
+    void Notify(const std::shared_ptr<Job>& self)
+    {
+        if (!model) return;
+        QMetaObject::invokeMethod(model, [model = model, self] { model->OnDataAvailable(self); }, Qt::QueuedConnection);
+    }
+};
+
+BrowseModel::BrowseModel(mtp::SessionPtr activeDevice, QObject* parent)
+    : QAbstractListModel(parent)
+    , activeDevice(std::move(activeDevice))
+{
+    auto style = QApplication::style();
+    dirIcon = style->standardIcon(QStyle::SP_DirIcon);
+    fileIcon = style->standardIcon(QStyle::SP_FileIcon);
+    parentIcon = style->standardIcon(QStyle::SP_FileDialogToParent);
+}
+
+BrowseModel::~BrowseModel()
+{
+    if (job) {
+        std::lock_guard lock(job->mutex);
+        job->model = nullptr;
+    }
+    JoinFinishedWorkers(true);
+}
+
+void BrowseModel::SetFolder(const mtp::ObjectID& id, bool hasParent)
+{
+    if (job) {
+        std::lock_guard lock(job->mutex);
+        job->model = nullptr;
+    }
+    JoinFinishedWorkers(false);
+
+    beginResetModel();
+    rows.clear();
+    this->hasParent = hasParent;
+    waitingForData = true;
+    job = std::make_shared<Job>();
+    job->model = this;
+    endResetModel();
+
+    std::thread worker([job = job, activeDevice = activeDevice, id] {
+        activeDevice->EnumerateContentsWithProperties(id, [&](auto& batch) {
+            std::lock_guard lock(job->mutex);
+            if (!job->model) return false;
+            const auto notify = job->pending.empty();
+            std::move(batch.begin(), batch.end(), std::back_inserter(job->pending));
+            if (notify) job->Notify(job);
+            return true;
+        });
+        {
+            std::lock_guard lock(job->mutex);
+            job->loading = false;
+            job->Notify(job);
+        }
+        job->finished = true;
+    });
+    workers.emplace_back(job, std::move(worker));
+}
+
+mtp::ObjectID BrowseModel::GetObjectID(const QModelIndex& index) const
+{
+    const auto row = index.row() - (hasParent ? 1 : 0);
+    if (row < 0 || row >= static_cast<int>(rows.size())) return {};
+    return rows[row].id;
+}
+
+bool BrowseModel::IsLoading() const
+{
+    if (!job) return false;
+    std::lock_guard lock(job->mutex);
+    return job->loading || !job->pending.empty();
+}
+
+int BrowseModel::rowCount(const QModelIndex& parent) const
+{
+    if (parent.isValid()) return 0;
+    return static_cast<int>(rows.size()) + (hasParent ? 1 : 0);
+}
+
+QVariant BrowseModel::data(const QModelIndex& index, int role) const
+{
+    if (!index.isValid()) return {};
+    if (hasParent && index.row() == 0) {
+        if (role == Qt::DisplayRole) return QString("<back>");
+        if (role == Qt::DecorationRole) return parentIcon;
+        return {};
+    }
+
+    const auto row = index.row() - (hasParent ? 1 : 0);
+    if (row < 0 || row >= static_cast<int>(rows.size())) return {};
+    const auto& item = rows[row];
+    switch (role) {
+        case Qt::DisplayRole:
+            return item.name;
+        case Qt::DecorationRole:
+            return item.isFolder ? dirIcon : fileIcon;
+    }
+    return {};
+}
+
+bool BrowseModel::canFetchMore(const QModelIndex& parent) const
+{
+    return !parent.isValid() && IsLoading();
+}
+
+void BrowseModel::fetchMore(const QModelIndex& parent)
+{
+    if (parent.isValid() || !job) return;
+
+    std::vector<Row> newRows;
+    {
+        std::lock_guard lock(job->mutex);
+        while (!job->pending.empty() && newRows.size() < FETCH_BATCH_SIZE) {
+            auto& object = job->pending.front();
+            if (object.properties.name) {
+                const auto& contentType = object.properties.contentType;
+                const auto isFolder = contentType == WPD_CONTENT_TYPE_FOLDER || contentType == WPD_CONTENT_TYPE_FUNCTIONAL_OBJECT;
+                newRows.push_back({ std::move(object.id), QString::fromStdString(*object.properties.name), isFolder });
+            }
+            job->pending.pop_front();
+        }
+    }
+    // The view asked for more than we have; hand it over once it arrives
+    waitingForData = newRows.empty();
+    if (newRows.empty()) return;
+
+    const auto first = rowCount();
+    beginInsertRows({}, first, first + static_cast<int>(newRows.size()) - 1);
+    std::move(newRows.begin(), newRows.end(), std::back_inserter(rows));
+    endInsertRows();
+}
+
+void BrowseModel::OnDataAvailable(const std::shared_ptr<Job>& from)
+{
+    if (from != job) return;
+    if (waitingForData) fetchMore({});
+}
+
+void BrowseModel::JoinFinishedWorkers(bool all)
+{
+    for (auto it = workers.begin(); it != workers.end(); ) {
+        if (all || it->first->finished) {
+            it->second.join();
+            it = workers.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
@@ -0,0 +1,62 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#pragma once
+
+#include <QAbstractListModel>
+#include <QIcon>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "MTP.h"
+
+// Lists the contents of a device folder. The folder is enumerated on a
+// worker thread; rows are handed to the view through canFetchMore() and
+// fetchMore() as they arrive, so large folders do not block the GUI
+class BrowseModel : public QAbstractListModel
+{
+    Q_OBJECT
+
+public:
+    // Rows are added to the view at most this many at a time
+    static constexpr int FETCH_BATCH_SIZE = 256;
+
+    BrowseModel(mtp::SessionPtr activeDevice, QObject* parent = nullptr);
+    virtual ~BrowseModel();
+
+    // Starts listing a folder, abandoning the one being listed. If hasParent
+    // is set, the first row is an entry to go back up
+    void SetFolder(const mtp::ObjectID& id, bool hasParent);
+    // Yields an empty ObjectID for the entry to go back up
+    mtp::ObjectID GetObjectID(const QModelIndex& index) const;
+    bool IsLoading() const;
+
+    int rowCount(const QModelIndex& parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex& index, int role = Qt::DisplayRole) const override;
+    bool canFetchMore(const QModelIndex& parent) const override;
+    void fetchMore(const QModelIndex& parent) override;
+
+private:
+    struct Job;
+    struct Row {
+        mtp::ObjectID id;
+        QString name;
+        bool isFolder{};
+    };
+
+    mtp::SessionPtr activeDevice;
+    std::shared_ptr<Job> job;
+    std::vector<std::pair<std::shared_ptr<Job>, std::thread>> workers;
+    std::vector<Row> rows;
+    bool hasParent{};
+    bool waitingForData{};
+    QIcon dirIcon;
+    QIcon fileIcon;
+    QIcon parentIcon;
+
+    void OnDataAvailable(const std::shared_ptr<Job>& from);
+    void JoinFinishedWorkers(bool all);
+};
@@ -0,0 +1,65 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#include "BufferPool.h"
+#include <new>
+
+namespace
+{
+	char* Allocate(size_t size)
+	{
+		return static_cast<char*>(::operator new(size, std::align_val_t{ BufferPool::ALIGNMENT }));
+	}
+
+	void Free(char* data)
+	{
+		::operator delete(data, std::align_val_t{ BufferPool::ALIGNMENT });
+	}
+}
+
+BufferPool::~BufferPool()
+{
+	for (auto& [size, buffers] : freeBuffers) {
+		for (auto data : buffers) Free(data);
+	}
+}
+
+BufferPool::Buffer BufferPool::Acquire(size_t size)
+{
+	size = (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+	{
+		std::lock_guard lock(mutex);
+		if (auto it = freeBuffers.find(size); it != freeBuffers.end() && !it->second.empty()) {
+			auto data = it->second.back();
+			it->second.pop_back();
+			cachedBytes -= size;
+			return Buffer(data, Deleter(this, size));
+		}
+	}
+	return Buffer(Allocate(size), Deleter(this, size));
+}
+
+void BufferPool::Release(char* data, size_t size)
+{
+	if (!data) return;
+	{
+		std::lock_guard lock(mutex);
+		if (cachedBytes + size <= MAX_CACHED_BYTES) {
+			freeBuffers[size].push_back(data);
+			cachedBytes += size;
+			return;
+		}
+	}
+	Free(data);
+}
+
+BufferPool& BufferPool::Get()
+{
+	// Never destroyed, so that buffers may still be released while the
+	// program shuts down
+	static auto pool = new BufferPool;
+	return *pool;
+}
@@ -0,0 +1,57 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Hands out page-aligned buffers and keeps them for reuse once they are
+// released, so that transferring thousands of small files does not allocate
+// a buffer for every one of them. The alignment allows them to be used for
+// direct I/O
+class BufferPool
+{
+public:
+	static constexpr size_t ALIGNMENT = 4096;
+	// Released buffers beyond this are freed rather than kept
+	static constexpr size_t MAX_CACHED_BYTES = 64 * 1024 * 1024;
+
+	class Deleter
+	{
+		BufferPool* pool{};
+		size_t size{};
+
+	public:
+		Deleter() = default;
+		Deleter(BufferPool* pool, size_t size) : pool(pool), size(size) { }
+		void operator()(char* data) const { pool->Release(data, size); }
+		size_t GetSize() const { return size; }
+	};
+	using Buffer = std::unique_ptr<char[], Deleter>;
+
+	BufferPool() = default;
+	BufferPool(const BufferPool&) = delete;
+	BufferPool& operator=(const BufferPool&) = delete;
+	~BufferPool();
+
+	// The size is rounded up to a multiple of ALIGNMENT; the buffer's
+	// get_deleter().GetSize() tells the actual size
+	Buffer Acquire(size_t size);
+
+	// Shared by all devices and backups
+	static BufferPool& Get();
+
+private:
+	std::mutex mutex;
+	std::map<size_t, std::vector<char*>> freeBuffers;
+	size_t cachedBytes{};
+
+	void Release(char* data, size_t size);
+};
@@ -0,0 +1,106 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#include "Checksums.h"
+#include "Hash.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <fstream>
+#include <mutex>
+#include <thread>
+
+namespace
+{
+	struct Job
+	{
+		std::filesystem::path path;
+		uint64_t hash;
+	};
+}
+
+ChecksumFile ChecksumFile::Load(const std::filesystem::path& where)
+{
+	ChecksumFile checksums;
+	std::ifstream ifs(where / FILE_NAME);
+	std::string line;
+	while (std::getline(ifs, line)) {
+		// "<16 hex digits>  <path>"
+		constexpr size_t HASH_LENGTH = 16;
+		if (line.size() <= HASH_LENGTH + 2 || line.compare(HASH_LENGTH, 2, "  ") != 0) continue;
+		const auto hex = line.substr(0, HASH_LENGTH);
+		char* end;
+		const auto hash = std::strtoull(hex.c_str(), &end, 16);
+		if (*end != '\0') continue;
+		checksums.hashes[line.substr(HASH_LENGTH + 2)] = hash;
+	}
+	return checksums;
+}
+
+bool ChecksumFile::Save(const std::filesystem::path& where) const
+{
+	// Replaced in one go, like the manifest
+	const auto path = where / FILE_NAME;
+	auto tempPath = path;
+	tempPath += ".new";
+	{
+		std::ofstream ofs(tempPath, std::ofstream::out | std::ofstream::trunc | std::ofstream::binary);
+		for (const auto& [file, hash] : hashes)
+			ofs << Hash64::ToString(hash) << "  " << file << '\n';
+		if (!ofs.flush()) return false;
+	}
+
+	std::error_code ec;
+	std::filesystem::rename(tempPath, path, ec);
+	return !ec;
+}
+
+VerifyResult VerifyChecksums(const std::filesystem::path& where, unsigned int numThreads)
+{
+	std::vector<Job> jobs;
+	std::error_code ec;
+	for (auto it = std::filesystem::recursive_directory_iterator(where, ec); !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+		if (it->path().filename() != ChecksumFile::FILE_NAME) continue;
+		const auto location = it->path().parent_path();
+		const auto checksums = ChecksumFile::Load(location);
+		for (const auto& [file, hash] : checksums.GetHashes())
+			jobs.push_back({ location / file, hash });
+	}
+
+	VerifyResult result;
+	std::mutex mutex;
+	std::atomic<size_t> nextJob{};
+	auto verify = [&] {
+		for (auto n = nextJob++; n < jobs.size(); n = nextJob++) {
+			const auto& job = jobs[n];
+			Hash64 hash;
+			std::error_code ec;
+			const auto size = std::filesystem::file_size(job.path, ec);
+			const auto readable = !ec && HashFile(job.path, hash);
+
+			std::lock_guard lock(mutex);
+			if (!readable) {
+				result.missing.push_back(job.path.generic_string());
+				continue;
+			}
+			++result.filesVerified;
+			result.bytesVerified += size;
+			if (hash.Finish() != job.hash) result.mismatched.push_back(job.path.generic_string());
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (unsigned int n = 1; n < std::max(numThreads, 1u); ++n)
+		threads.emplace_back(verify);
+	verify();
+	for (auto& thread : threads)
+		thread.join();
+
+	// The threads finish in any order
+	std::sort(result.mismatched.begin(), result.mismatched.end());
+	std::sort(result.missing.begin(), result.missing.end());
+	return result;
+}
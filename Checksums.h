@@ -0,0 +1,46 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <string>
+#include <vector>
+
+// The content hashes of the files backed up to a location, see Hash64. They
+// are stored next to the files in the format of xxhsum, so that 'xxhsum -c'
+// can check a backup as well
+class ChecksumFile
+{
+public:
+	static constexpr auto FILE_NAME = ".replicandroid-checksums";
+
+	// Yields an empty list if there is none; lines that cannot be parsed
+	// are left out
+	static ChecksumFile Load(const std::filesystem::path& where);
+	bool Save(const std::filesystem::path& where) const;
+
+	// Paths are relative to the location and use '/'
+	void Set(const std::string& path, uint64_t hash) { hashes[path] = hash; }
+	const std::map<std::string, uint64_t>& GetHashes() const { return hashes; }
+
+private:
+	std::map<std::string, uint64_t> hashes;
+};
+
+struct VerifyResult
+{
+	size_t filesVerified{};
+	uint64_t bytesVerified{};
+	std::vector<std::string> mismatched;
+	std::vector<std::string> missing; // or unreadable
+};
+
+// Hashes every file listed in the checksum files found below a directory
+// again and compares the results, using a number of threads at once
+VerifyResult VerifyChecksums(const std::filesystem::path& where, unsigned int numThreads);
@@ -0,0 +1,190 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#include "Config.h"
+#include "Hash.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <utility>
+
+namespace
+{
+	std::string Trim(const std::string& s)
+	{
+		const auto isSpace = [](const auto v) { return std::isspace(static_cast<unsigned char>(v)); };
+		auto first = std::find_if_not(s.begin(), s.end(), isSpace);
+		auto last = std::find_if_not(s.rbegin(), s.rend(), isSpace).base();
+		return first < last ? std::string(first, last) : std::string{};
+	}
+
+	// Only keeps characters that are safe in a file name on any platform
+	std::string MakeDirectoryName(const std::string& s)
+	{
+		std::string name(s);
+		name.erase(std::remove_if(name.begin(), name.end(), [](const auto v) {
+			const auto ch = static_cast<unsigned char>(v);
+			return !std::isalnum(ch);
+		}), name.end());
+		return name;
+	}
+
+	bool ParseBool(const std::string& s, bool& value)
+	{
+		if (s == "1" || s == "true" || s == "yes") value = true;
+		else if (s == "0" || s == "false" || s == "no") value = false;
+		else return false;
+		return true;
+	}
+
+	constexpr std::pair<SchedulePolicy, const char*> schedulePolicyNames[] = {
+		{ SchedulePolicy::Discovery, "discovery" },
+		{ SchedulePolicy::SmallestFirst, "smallest-first" },
+		{ SchedulePolicy::LargestFirst, "largest-first" },
+		{ SchedulePolicy::StorageOrder, "storage-order" },
+		{ SchedulePolicy::NewestFirst, "newest-first" },
+	};
+}
+
+WhatItem ParseWhatItem(const std::string& path)
+{
+	WhatItem wi;
+	size_t start = 0;
+	while (start <= path.size()) {
+		auto end = path.find('/', start);
+		if (end == std::string::npos) end = path.size();
+		if (end > start) wi.path.push_back(path.substr(start, end - start));
+		start = end + 1;
+	}
+	return wi;
+}
+
+std::string GetDestinationPath(const Configuration& config, const WhatItem& what)
+{
+	std::string destLocation;
+	for (const auto& piece : what.path) {
+		destLocation += piece;
+	}
+	return config.where + '/' + MakeDirectoryName(destLocation);
+}
+
+std::string GetDeviceDirectory(const std::string& where, const std::string& deviceId, const std::string& deviceName)
+{
+	Hash64 hash;
+	hash.Update(deviceId.data(), deviceId.size());
+	return where + '/' + MakeDirectoryName(deviceName) + '-' + Hash64::ToString(hash.Finish()).substr(0, 8);
+}
+
+bool ParseSchedulePolicy(const std::string& s, SchedulePolicy& policy)
+{
+	for (const auto& [value, name] : schedulePolicyNames) {
+		if (s != name) continue;
+		policy = value;
+		return true;
+	}
+	return false;
+}
+
+bool ParseScanThreads(const std::string& s, unsigned int& numThreads)
+{
+	char* end;
+	const auto n = std::strtoul(s.c_str(), &end, 10);
+	if (s.empty() || *end != '\0' || n < 1 || n > MAX_SCAN_THREADS) return false;
+	numThreads = static_cast<unsigned int>(n);
+	return true;
+}
+
+const char* GetSchedulePolicyName(SchedulePolicy policy)
+{
+	for (const auto& [value, name] : schedulePolicyNames) {
+		if (value == policy) return name;
+	}
+	return "unknown";
+}
+
+bool LoadConfiguration(const std::filesystem::path& path, Configuration& config, std::string& error)
+{
+	std::ifstream ifs(path);
+	if (!ifs) {
+		error = "cannot open " + path.string();
+		return false;
+	}
+
+	std::string line;
+	for (unsigned int lineNumber = 1; std::getline(ifs, line); ++lineNumber) {
+		line = Trim(line);
+		if (line.empty() || line[0] == '#') continue;
+
+		const auto separator = line.find('=');
+		const auto key = Trim(line.substr(0, separator));
+		const auto value = separator != std::string::npos ? Trim(line.substr(separator + 1)) : std::string{};
+		const auto location = path.string() + ':' + std::to_string(lineNumber) + ": ";
+		if (separator == std::string::npos || value.empty()) {
+			error = location + "expected key = value";
+			return false;
+		}
+
+		if (key == "device") {
+			config.devices.push_back(value);
+		} else if (key == "where") {
+			config.where = value;
+		} else if (key == "what") {
+			config.what.push_back(ParseWhatItem(value));
+		} else if (key == "include" || key == "exclude") {
+			if (config.what.empty()) {
+				error = location + key + " must follow a what";
+				return false;
+			}
+			FilterRule rule;
+			std::string ruleError;
+			if (!ParseFilterRule(key == "include" ? FilterAction::Include : FilterAction::Exclude, value, rule, ruleError)) {
+				error = location + ruleError;
+				return false;
+			}
+			config.what.back().filters.push_back(std::move(rule));
+		} else if (key == "deduplicate") {
+			if (!ParseBool(value, config.deduplicate)) {
+				error = location + "deduplicate must be true or false";
+				return false;
+			}
+		} else if (key == "direct-io") {
+			if (!ParseBool(value, config.directIo)) {
+				error = location + "direct-io must be true or false";
+				return false;
+			}
+		} else if (key == "archive") {
+			if (!ParseBool(value, config.archive)) {
+				error = location + "archive must be true or false";
+				return false;
+			}
+		} else if (key == "compress") {
+			if (!ParseBool(value, config.compress)) {
+				error = location + "compress must be true or false";
+				return false;
+			}
+		} else if (key == "checksums") {
+			if (!ParseBool(value, config.checksums)) {
+				error = location + "checksums must be true or false";
+				return false;
+			}
+		} else if (key == "schedule") {
+			if (!ParseSchedulePolicy(value, config.schedule)) {
+				error = location + "unknown schedule '" + value + "'";
+				return false;
+			}
+		} else if (key == "scan-threads") {
+			if (!ParseScanThreads(value, config.scanThreads)) {
+				error = location + "scan-threads must be a number from 1 to " + std::to_string(MAX_SCAN_THREADS);
+				return false;
+			}
+		} else {
+			error = location + "unknown key '" + key + "'";
+			return false;
+		}
+	}
+	return true;
+}
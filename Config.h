@@ -6,32 +6,75 @@
  */
 #pragma once
 
+#include <filesystem>
 #include <vector>
 #include <string>
+#include "Filter.h"
+#include "MTP.h"
 
 struct NumbersAvailable {
 	unsigned int totalNumberOfItems{};
-	size_t totalNumberOfBytes{};
+	uint64_t totalNumberOfBytes{};
 };
 
 struct ItemsUpdate {
 	unsigned int itemsTransferredSuccessfully{};
 	unsigned int itemsTransferredFailures{};
 	unsigned int itemsTransferredSkipped{};
-	size_t bytesRead{};
-	size_t bytesSkipped{};
+	uint64_t bytesRead{};
+	uint64_t bytesSkipped{};
 };
 
 struct FailedItem {
 	std::string destPath;
+	mtp::ErrorClass errorClass{ mtp::ErrorClass::Permanent }; // of the last attempt
+	std::string error;
 };
 
 struct WhatItem {
 	std::vector<std::string> path;
+	std::vector<FilterRule> filters; // in the order they are tried
+};
+
+// The order in which files found on the device are transferred
+enum class SchedulePolicy
+{
+	Discovery, // as they are found
+	SmallestFirst, // completes as many files as possible early on
+	LargestFirst, // keeps the connection busy with long transfers
+	StorageOrder, // by object handle, which tends to follow where they are stored
+	NewestFirst, // the most recently modified files are safe first
 };
 
 struct Configuration
 {
+	std::vector<std::string> devices; // device IDs or friendly names; only used from the command line
 	std::vector<WhatItem> what;
 	std::string where;
+	bool deduplicate{};
+	bool directIo{};
+	bool archive{};
+	bool compress{};
+	bool checksums{};
+	SchedulePolicy schedule{ SchedulePolicy::Discovery };
+	unsigned int scanThreads{ 1 };
 };
+
+// Parses a '/'-separated path on the device, such as "Internal storage/DCIM"
+WhatItem ParseWhatItem(const std::string& path);
+// Where the contents of a backed up location end up
+std::string GetDestinationPath(const Configuration& config, const WhatItem& what);
+// When backing up several devices at once, each gets a directory of its own
+// below where. It is named after the device, along with a bit of its ID to
+// tell identical phones apart
+std::string GetDeviceDirectory(const std::string& where, const std::string& deviceId, const std::string& deviceName);
+// Policies are named in lowercase with dashes, such as "smallest-first"
+bool ParseSchedulePolicy(const std::string& s, SchedulePolicy& policy);
+const char* GetSchedulePolicyName(SchedulePolicy policy);
+// Between 1 and MAX_SCAN_THREADS
+constexpr unsigned int MAX_SCAN_THREADS = 64;
+bool ParseScanThreads(const std::string& s, unsigned int& numThreads);
+// Reads "key = value" lines. Include and exclude rules belong to the what
+// that precedes them into the configuration; returns false and sets
+// error if the file cannot be read or contains something unexpected
+bool LoadConfiguration(const std::filesystem::path& path, Configuration& config, std::string& error);
@@ -0,0 +1,120 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#include "FileWriter.h"
+#include "Hash.h"
+#include "Trace.h"
+#include "WriteBudget.h"
+#include <algorithm>
+#include <cstring>
+#include <optional>
+#include <utility>
+
+FileWriter::FileWriter(WriteBudget* budget, bool directIo, size_t numBuffers, size_t bufferSize)
+	: budget(budget)
+	, directIo(directIo)
+	, bufferSize((bufferSize + OutputFile::ALIGNMENT - 1) / OutputFile::ALIGNMENT * OutputFile::ALIGNMENT)
+	, requests(numBuffers + 1)
+	, freeBuffers(numBuffers)
+{
+	for (size_t n = 0; n < numBuffers; ++n)
+		freeBuffers.Push(BufferPool::Get().Acquire(this->bufferSize));
+	// Disk writes count towards whatever the creating thread is working on
+	thread = std::thread([this, &statistics = trace::GetStatistics()] {
+		trace::StatisticsScope scope(statistics);
+		Run();
+	});
+}
+
+FileWriter::~FileWriter()
+{
+	if (opened) Close();
+	requests.Close();
+	thread.join();
+}
+
+bool FileWriter::Open(const std::filesystem::path& path, bool append, Hash64* hash, uint64_t expectedSize)
+{
+	// The writer thread is idle between Close() and the first Submit(), so
+	// the stream can safely be opened from here
+	bytesWritten = 0;
+	this->hash = hash;
+	failed = !file.Open(path, append, directIo, expectedSize);
+	opened = !failed;
+	return opened;
+}
+
+bool FileWriter::Write(const void* data, size_t length)
+{
+	auto ptr = static_cast<const char*>(data);
+	while (length > 0 && !failed) {
+		if (!current) {
+			trace::Span span(trace::Operation::WriterWait);
+			auto buffer = freeBuffers.Pop();
+			if (!buffer) return false;
+			current = std::move(*buffer);
+			currentLength = 0;
+		}
+
+		const auto chunkLength = std::min(length, bufferSize - currentLength);
+		std::memcpy(&current[currentLength], ptr, chunkLength);
+		currentLength += chunkLength;
+		ptr += chunkLength;
+		length -= chunkLength;
+		if (currentLength == bufferSize && !Submit()) return false;
+	}
+	return !failed;
+}
+
+bool FileWriter::Close()
+{
+	opened = false;
+	if (current) Submit();
+
+	std::promise<bool> closed;
+	auto result = closed.get_future();
+	if (!requests.Push({ {}, 0, &closed })) return false;
+	return result.get();
+}
+
+bool FileWriter::Submit()
+{
+	return requests.Push({ std::move(current), std::exchange(currentLength, 0) });
+}
+
+void FileWriter::Run()
+{
+	while (auto request = requests.Pop()) {
+		if (request->closed) {
+			const auto closed = file.Close();
+			request->closed->set_value(!failed && closed);
+			continue;
+		}
+
+		// Once a write has failed, just recycle the buffers until the file is closed
+		if (!failed) {
+			std::optional<WriteBudget::Slot> slot;
+			if (budget) {
+				trace::Span span(trace::Operation::WriteBudgetWait);
+				slot.emplace(*budget);
+			}
+			trace::Span span(trace::Operation::DiskWrite);
+			span.SetBytes(request->length);
+			if (file.Write(request->buffer.get(), request->length, bufferSize))
+				bytesWritten += request->length;
+			else
+				failed = true;
+		}
+		// The device is not kept waiting for this, and the data is still in
+		// the cache
+		if (!failed && hash) {
+			trace::Span span(trace::Operation::Hash);
+			span.SetBytes(request->length);
+			hash->Update(request->buffer.get(), request->length);
+		}
+		freeBuffers.Push(std::move(request->buffer));
+	}
+}
@@ -0,0 +1,72 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#pragma once
+
+#include <atomic>
+#include <filesystem>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include "BoundedQueue.h"
+#include "BufferPool.h"
+#include "OutputFile.h"
+
+class Hash64;
+class WriteBudget;
+
+// Writes files on a thread of its own, so that a slow destination does not
+// stall reading from the device. Data is gathered into a small ring of
+// buffers; Write() only blocks once all of them are waiting to be written.
+// The buffers are aligned, so that they can be written using direct I/O.
+// Data can be hashed on the same thread as it is written
+class FileWriter
+{
+public:
+	static constexpr size_t DEFAULT_NUM_BUFFERS = 4;
+	static constexpr size_t DEFAULT_BUFFER_SIZE = 1024 * 1024;
+
+	// Writes are only done when the budget allows, if one is given
+	FileWriter(WriteBudget* budget = nullptr, bool directIo = false, size_t numBuffers = DEFAULT_NUM_BUFFERS, size_t bufferSize = DEFAULT_BUFFER_SIZE);
+	~FileWriter();
+
+	// Appending keeps the existing contents of the file. If a hash is given,
+	// everything written is added to it; it must not be used until Close().
+	// The expected size, if known, is reserved up front
+	bool Open(const std::filesystem::path& path, bool append = false, Hash64* hash = nullptr, uint64_t expectedSize = 0);
+	// Returns false once any write to the current file has failed
+	bool Write(const void* data, size_t length);
+	// Number of bytes of the current file that have been handed to the OS
+	uint64_t GetBytesWritten() const { return bytesWritten; }
+	// Waits until everything is written; returns false if anything failed
+	bool Close();
+
+private:
+	struct Request
+	{
+		BufferPool::Buffer buffer;
+		size_t length{};
+		std::promise<bool>* closed{};
+	};
+
+	WriteBudget* const budget;
+	const bool directIo;
+	const size_t bufferSize;
+	BoundedQueue<Request> requests;
+	BoundedQueue<BufferPool::Buffer> freeBuffers;
+	BufferPool::Buffer current;
+	size_t currentLength{};
+	bool opened{};
+	OutputFile file; // only used by the writer thread while opened
+	Hash64* hash{}; // likewise
+	std::atomic<bool> failed{};
+	std::atomic<uint64_t> bytesWritten{};
+	std::thread thread;
+
+	bool Submit();
+	void Run();
+};
@@ -0,0 +1,320 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#include "Filter.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <sstream>
+#include <utility>
+
+namespace
+{
+	constexpr int64_t SECONDS_PER_DAY = 24 * 60 * 60;
+
+	char ToLower(char ch)
+	{
+		return static_cast<char>(std::tolower(static_cast<unsigned char>(ch)));
+	}
+
+	std::string ToLower(std::string s)
+	{
+		std::transform(s.begin(), s.end(), s.begin(), [](char ch) { return ToLower(ch); });
+		return s;
+	}
+
+	bool EqualsIgnoringCase(std::string_view a, std::string_view b)
+	{
+		return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) { return ToLower(x) == ToLower(y); });
+	}
+
+	// '*' and '?' do not match a '/', but "**" matches any number of folders
+	bool GlobMatch(std::string_view pattern, std::string_view s)
+	{
+		while (!pattern.empty()) {
+			if (pattern[0] == '*') {
+				const auto anyFolder = pattern.size() > 1 && pattern[1] == '*';
+				pattern.remove_prefix(anyFolder ? 2 : 1);
+				// "**/x" also matches "x" itself
+				if (anyFolder && !pattern.empty() && pattern[0] == '/' && GlobMatch(pattern.substr(1), s)) return true;
+				for (size_t n = 0; n <= s.size(); ++n) {
+					if (GlobMatch(pattern, s.substr(n))) return true;
+					if (n < s.size() && s[n] == '/' && !anyFolder) return false;
+				}
+				return false;
+			}
+			if (s.empty()) return false;
+			if (pattern[0] == '?' ? s[0] == '/' : pattern[0] != ToLower(s[0])) return false;
+			pattern.remove_prefix(1);
+			s.remove_prefix(1);
+		}
+		return s.empty();
+	}
+
+	constexpr std::pair<const char*, unsigned int> typeNames[] = {
+		{ "folder", FilterRule::FOLDER },
+		{ "file", FilterRule::FILE },
+		{ "image", FilterRule::IMAGE },
+		{ "video", FilterRule::VIDEO },
+		{ "audio", FilterRule::AUDIO },
+	};
+
+	constexpr std::pair<const char*, std::uint16_t> formatNames[] = {
+		{ "text", 0x3004 }, { "html", 0x3005 }, { "wav", 0x3008 }, { "mp3", 0x3009 },
+		{ "avi", 0x300A }, { "mpeg", 0x300B }, { "asf", 0x300C }, { "jpeg", 0x3801 },
+		{ "bmp", 0x3804 }, { "gif", 0x3807 }, { "jfif", 0x3808 }, { "png", 0x380B },
+		{ "tiff", 0x380D }, { "heif", 0xB883 }, { "wma", 0xB901 }, { "ogg", 0xB902 },
+		{ "aac", 0xB903 }, { "flac", 0xB906 }, { "wmv", 0xB981 }, { "mp4", 0xB982 },
+		{ "3gp", 0xB984 },
+	};
+
+	// MTP groups its object format codes by kind, which tells us what a file
+	// is when the backend only reports it as a generic file
+	unsigned int GetTypesOfFormat(const std::optional<GUID>& format)
+	{
+		if (!format) return 0;
+		const auto code = static_cast<std::uint16_t>(format->Data1 >> 16);
+		if (!(*format == mtp::MakeFormat(code))) return 0;
+		if ((code >= 0x3800 && code <= 0x38FF) || (code >= 0xB880 && code <= 0xB8FF)) return FilterRule::IMAGE;
+		if ((code >= 0x300A && code <= 0x300D) || (code >= 0xB980 && code <= 0xB9FF)) return FilterRule::VIDEO;
+		if ((code >= 0x3007 && code <= 0x3009) || (code >= 0xB900 && code <= 0xB97F)) return FilterRule::AUDIO;
+		return 0;
+	}
+
+	unsigned int GetTypes(const mtp::ObjectProperties& props, bool isFolder)
+	{
+		if (isFolder) return FilterRule::FOLDER;
+		auto types = FilterRule::FILE | GetTypesOfFormat(props.format);
+		if (props.contentType == WPD_CONTENT_TYPE_IMAGE) types |= FilterRule::IMAGE;
+		if (props.contentType == WPD_CONTENT_TYPE_VIDEO) types |= FilterRule::VIDEO;
+		if (props.contentType == WPD_CONTENT_TYPE_AUDIO) types |= FilterRule::AUDIO;
+		return types;
+	}
+
+	bool ParseTypes(std::string_view s, unsigned int& types)
+	{
+		while (!s.empty()) {
+			const auto end = std::min(s.find(','), s.size());
+			const auto name = s.substr(0, end);
+			auto it = std::find_if(std::begin(typeNames), std::end(typeNames), [&](const auto& t) { return EqualsIgnoringCase(name, t.first); });
+			if (it == std::end(typeNames)) return false;
+			types |= it->second;
+			s.remove_prefix(std::min(end + 1, s.size()));
+		}
+		return true;
+	}
+
+	// Formats are given by name or by their MTP format code, such as 0x3801
+	bool ParseFormats(std::string_view s, std::vector<GUID>& formats)
+	{
+		while (!s.empty()) {
+			const auto end = std::min(s.find(','), s.size());
+			const std::string name(s.substr(0, end));
+			auto it = std::find_if(std::begin(formatNames), std::end(formatNames), [&](const auto& f) { return EqualsIgnoringCase(name, f.first); });
+			if (it != std::end(formatNames)) {
+				formats.push_back(mtp::MakeFormat(it->second));
+			} else {
+				unsigned int code;
+				char trailing;
+				if (std::sscanf(name.c_str(), "0x%x%c", &code, &trailing) != 1 || code > 0xFFFF) return false;
+				formats.push_back(mtp::MakeFormat(static_cast<std::uint16_t>(code)));
+			}
+			s.remove_prefix(std::min(end + 1, s.size()));
+		}
+		return true;
+	}
+
+	// A number of bytes, optionally followed by K, M, G or T
+	bool ParseSize(const std::string& s, uint64_t& size)
+	{
+		// sscanf() would take a sign, and wrap a negative number around
+		if (s.empty() || !std::isdigit(static_cast<unsigned char>(s[0]))) return false;
+		unsigned long long value;
+		char unit = 0, trailing;
+		const auto n = std::sscanf(s.c_str(), "%llu%c%c", &value, &unit, &trailing);
+		if (n < 1 || n > 2) return false;
+		unsigned int shift = 0;
+		switch (std::toupper(static_cast<unsigned char>(unit))) {
+			case 0: break;
+			case 'K': shift = 10; break;
+			case 'M': shift = 20; break;
+			case 'G': shift = 30; break;
+			case 'T': shift = 40; break;
+			default: return false;
+		}
+		if (value > (UINT64_MAX >> shift)) return false;
+		size = static_cast<uint64_t>(value) << shift;
+		return true;
+	}
+
+	// Days since the epoch of a date in the proleptic Gregorian calendar
+	int64_t DaysFromCivil(int64_t y, unsigned int m, unsigned int d)
+	{
+		y -= m <= 2;
+		const auto era = (y >= 0 ? y : y - 399) / 400;
+		const auto yoe = static_cast<unsigned int>(y - era * 400);
+		const auto doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+		const auto doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+		return era * 146097 + static_cast<int64_t>(doe) - 719468;
+	}
+
+	// Either a date, YYYY-MM-DD in UTC, or a number of days ago such as 30d.
+	// The latter is counted from the start of today, so that it does not
+	// change while the day lasts
+	bool ParseDate(const std::string& s, int64_t& seconds)
+	{
+		int year;
+		unsigned int month, day;
+		char trailing;
+		if (std::sscanf(s.c_str(), "%4d-%2u-%2u%c", &year, &month, &day, &trailing) == 3) {
+			if (month < 1 || month > 12 || day < 1 || day > 31) return false;
+			seconds = DaysFromCivil(year, month, day) * SECONDS_PER_DAY;
+			return true;
+		}
+
+		unsigned int days;
+		char unit;
+		if (std::sscanf(s.c_str(), "%u%c%c", &days, &unit, &trailing) != 2 || unit != 'd') return false;
+		const auto now = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+		seconds = (now / SECONDS_PER_DAY - days) * SECONDS_PER_DAY;
+		return true;
+	}
+}
+
+bool ParseFilterRule(FilterAction action, const std::string& text, FilterRule& rule, std::string& error)
+{
+	rule = FilterRule{};
+	rule.action = action;
+	rule.text = text;
+
+	std::istringstream iss(text);
+	std::string condition;
+	while (iss >> condition) {
+		const auto separator = condition.find(':');
+		const auto key = condition.substr(0, separator);
+		const auto value = separator != std::string::npos ? condition.substr(separator + 1) : std::string{};
+		if (separator == std::string::npos || value.empty()) {
+			error = "expected key:value instead of '" + condition + "'";
+			return false;
+		}
+
+		bool valid;
+		if (key == "name") {
+			rule.name = value;
+			valid = true;
+		} else if (key == "type") {
+			valid = ParseTypes(value, rule.types);
+		} else if (key == "format") {
+			valid = ParseFormats(value, rule.formats);
+		} else if (key == "min-size") {
+			valid = ParseSize(value, rule.minSize.emplace());
+		} else if (key == "max-size") {
+			valid = ParseSize(value, rule.maxSize.emplace());
+		} else if (key == "after") {
+			valid = ParseDate(value, rule.modifiedAfter.emplace());
+		} else if (key == "before") {
+			valid = ParseDate(value, rule.modifiedBefore.emplace());
+		} else {
+			error = "unknown condition '" + key + "'";
+			return false;
+		}
+		if (!valid) {
+			error = "invalid " + key + " '" + value + "'";
+			return false;
+		}
+	}
+	if (rule.text.find_first_not_of(" \t") == std::string::npos) {
+		error = "rule without conditions";
+		return false;
+	}
+	return true;
+}
+
+Filter::Filter(const std::vector<FilterRule>& rules)
+{
+	for (const auto& rule : rules) {
+		CompiledRule compiled;
+		compiled.include = rule.action == FilterAction::Include;
+		compiled.name = CompilePattern(rule.name);
+		compiled.types = rule.types;
+		compiled.formats = rule.formats;
+		if (rule.minSize) compiled.minSize = *rule.minSize;
+		if (rule.maxSize) compiled.maxSize = *rule.maxSize;
+		if (rule.modifiedAfter) compiled.modifiedAfter = *rule.modifiedAfter;
+		if (rule.modifiedBefore) compiled.modifiedBefore = *rule.modifiedBefore;
+
+		const auto forFolders = (rule.types == 0 || (rule.types & FilterRule::FOLDER)) &&
+			rule.formats.empty() && !rule.minSize && !rule.maxSize && !rule.modifiedAfter && !rule.modifiedBefore;
+		const auto forFiles = rule.types != FilterRule::FOLDER;
+		if (forFolders) folderRules.push_back(compiled);
+		if (forFiles) fileRules.push_back(std::move(compiled));
+	}
+}
+
+Filter::Pattern Filter::CompilePattern(const std::string& glob)
+{
+	Pattern pattern;
+	if (glob.empty()) return pattern;
+
+	pattern.text = ToLower(glob);
+	pattern.matchPath = glob.find('/') != std::string::npos;
+	// Most patterns are a name, or a single '*' in front or at the end
+	const auto wildcards = std::count_if(glob.begin(), glob.end(), [](char ch) { return ch == '*' || ch == '?'; });
+	if (wildcards == 0) {
+		pattern.kind = Pattern::Kind::Literal;
+	} else if (wildcards == 1 && !pattern.matchPath && glob.front() == '*') {
+		pattern.kind = Pattern::Kind::Suffix;
+		pattern.text.erase(0, 1);
+	} else if (wildcards == 1 && !pattern.matchPath && glob.back() == '*') {
+		pattern.kind = Pattern::Kind::Prefix;
+		pattern.text.pop_back();
+	} else {
+		pattern.kind = Pattern::Kind::Glob;
+	}
+	return pattern;
+}
+
+bool Filter::Pattern::Matches(std::string_view name, std::string_view relativePath) const
+{
+	switch (kind) {
+		case Kind::Any:
+			return true;
+		case Kind::Literal:
+			return EqualsIgnoringCase(matchPath ? relativePath : name, text);
+		case Kind::Prefix:
+			return name.size() >= text.size() && EqualsIgnoringCase(name.substr(0, text.size()), text);
+		case Kind::Suffix:
+			return name.size() >= text.size() && EqualsIgnoringCase(name.substr(name.size() - text.size()), text);
+		case Kind::Glob:
+			return GlobMatch(text, matchPath ? relativePath : name);
+	}
+	return false;
+}
+
+bool Filter::Matches(const CompiledRule& rule, const mtp::ObjectProperties& props, unsigned int types, std::string_view relativePath)
+{
+	if (rule.types != 0 && (rule.types & types) == 0) return false;
+	if (!rule.formats.empty() && (!props.format || std::find(rule.formats.begin(), rule.formats.end(), *props.format) == rule.formats.end())) return false;
+	const uint64_t size = props.size.value_or(0);
+	if (size < rule.minSize || size > rule.maxSize) return false;
+	// Without a date, a file is not known to be after or before anything
+	if (rule.modifiedAfter != INT64_MIN && (!props.modified || *props.modified < rule.modifiedAfter)) return false;
+	if (rule.modifiedBefore != INT64_MAX && (!props.modified || *props.modified >= rule.modifiedBefore)) return false;
+	return rule.name.Matches(props.name ? std::string_view(*props.name) : std::string_view{}, relativePath);
+}
+
+bool Filter::IsIncluded(const mtp::ObjectProperties& props, bool isFolder, std::string_view relativePath) const
+{
+	const auto& rules = isFolder ? folderRules : fileRules;
+	if (rules.empty()) return true;
+
+	const auto types = GetTypes(props, isFolder);
+	for (const auto& rule : rules) {
+		if (Matches(rule, props, types, relativePath)) return rule.include;
+	}
+	return true;
+}
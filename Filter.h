@@ -0,0 +1,94 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "MTP.h"
+
+enum class FilterAction
+{
+	Include,
+	Exclude,
+};
+
+// Decides whether objects below a backup location are backed up. A rule
+// matches an object if all of its conditions hold; conditions that are
+// left out always do
+struct FilterRule
+{
+	// Kinds of objects, for types
+	static constexpr unsigned int FOLDER = 1 << 0;
+	static constexpr unsigned int FILE = 1 << 1;
+	static constexpr unsigned int IMAGE = 1 << 2;
+	static constexpr unsigned int VIDEO = 1 << 3;
+	static constexpr unsigned int AUDIO = 1 << 4;
+
+	FilterAction action{};
+	std::string text; // as written
+	// Matched against the name, or against the path below the location if
+	// it contains a '/'
+	std::string name;
+	unsigned int types{}; // any of these; 0 for all
+	std::vector<GUID> formats; // any of these
+	std::optional<uint64_t> minSize;
+	std::optional<uint64_t> maxSize;
+	std::optional<int64_t> modifiedAfter; // seconds since the epoch
+	std::optional<int64_t> modifiedBefore;
+};
+
+// Rules are written as conditions separated by spaces, such as
+// "name:*.mp4 min-size:1G"; see README.md for all of them
+bool ParseFilterRule(FilterAction action, const std::string& text, FilterRule& rule, std::string& error);
+
+// The rules of a location, compiled so that they are cheap to evaluate for
+// every object found. The first rule that matches an object decides whether
+// it is backed up; objects that no rule matches are. Only rules that look at
+// the name and type alone apply to folders, and excluding a folder skips
+// everything below it without listing it
+class Filter
+{
+public:
+	Filter() = default;
+	explicit Filter(const std::vector<FilterRule>& rules);
+
+	bool IsEmpty() const { return fileRules.empty() && folderRules.empty(); }
+	// The relative path is that of the object below the backup location
+	bool IsIncluded(const mtp::ObjectProperties& props, bool isFolder, std::string_view relativePath) const;
+
+private:
+	struct Pattern
+	{
+		enum class Kind { Any, Literal, Prefix, Suffix, Glob };
+		Kind kind{ Kind::Any };
+		std::string text; // lowercase, without the '*' for prefixes and suffixes
+		bool matchPath{};
+
+		bool Matches(std::string_view name, std::string_view relativePath) const;
+	};
+
+	struct CompiledRule
+	{
+		bool include{};
+		Pattern name;
+		unsigned int types{};
+		std::vector<GUID> formats;
+		uint64_t minSize{};
+		uint64_t maxSize{ UINT64_MAX };
+		int64_t modifiedAfter{ INT64_MIN };
+		int64_t modifiedBefore{ INT64_MAX };
+	};
+
+	static Pattern CompilePattern(const std::string& glob);
+	static bool Matches(const CompiledRule& rule, const mtp::ObjectProperties& props, unsigned int types, std::string_view relativePath);
+
+	std::vector<CompiledRule> fileRules;
+	std::vector<CompiledRule> folderRules;
+};
@@ -0,0 +1,145 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#include "Hash.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+
+namespace
+{
+	constexpr uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+	constexpr uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+	constexpr uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+	constexpr uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+	constexpr uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+	constexpr uint64_t RotateLeft(uint64_t v, int n)
+	{
+		return (v << n) | (v >> (64 - n));
+	}
+
+	// xxHash is defined on little-endian input
+	template<typename T> T ReadLE(const unsigned char* p)
+	{
+		T v{};
+		for (size_t n = 0; n < sizeof(T); ++n)
+			v |= static_cast<T>(p[n]) << (8 * n);
+		return v;
+	}
+
+	constexpr uint64_t Round(uint64_t acc, uint64_t input)
+	{
+		acc += input * PRIME64_2;
+		acc = RotateLeft(acc, 31);
+		return acc * PRIME64_1;
+	}
+
+	constexpr uint64_t MergeRound(uint64_t acc, uint64_t v)
+	{
+		acc ^= Round(0, v);
+		return acc * PRIME64_1 + PRIME64_4;
+	}
+
+	// Consumes as many 32 byte stripes as possible; the four lanes are
+	// independent, which lets the compiler and CPU process them in parallel
+	const unsigned char* ProcessStripes(uint64_t (&v)[4], const unsigned char* p, const unsigned char* end)
+	{
+		auto v1 = v[0], v2 = v[1], v3 = v[2], v4 = v[3];
+		for (; end - p >= 32; p += 32) {
+			v1 = Round(v1, ReadLE<uint64_t>(p));
+			v2 = Round(v2, ReadLE<uint64_t>(p + 8));
+			v3 = Round(v3, ReadLE<uint64_t>(p + 16));
+			v4 = Round(v4, ReadLE<uint64_t>(p + 24));
+		}
+		v[0] = v1; v[1] = v2; v[2] = v3; v[3] = v4;
+		return p;
+	}
+}
+
+Hash64::Hash64(uint64_t seed)
+	: seed(seed)
+	, v{ seed + PRIME64_1 + PRIME64_2, seed + PRIME64_2, seed, seed - PRIME64_1 }
+{
+}
+
+void Hash64::Update(const void* data, size_t length)
+{
+	auto p = static_cast<const unsigned char*>(data);
+	const auto end = p + length;
+	totalLength += length;
+
+	if (pendingLength > 0) {
+		const auto n = std::min(length, sizeof(pending) - pendingLength);
+		std::memcpy(pending + pendingLength, p, n);
+		pendingLength += n;
+		p += n;
+		if (pendingLength < sizeof(pending)) return;
+		ProcessStripes(v, pending, pending + sizeof(pending));
+		pendingLength = 0;
+	}
+
+	p = ProcessStripes(v, p, end);
+	pendingLength = end - p;
+	std::memcpy(pending, p, pendingLength);
+}
+
+uint64_t Hash64::Finish() const
+{
+	uint64_t h;
+	if (totalLength >= 32) {
+		h = RotateLeft(v[0], 1) + RotateLeft(v[1], 7) + RotateLeft(v[2], 12) + RotateLeft(v[3], 18);
+		for (const auto lane : v)
+			h = MergeRound(h, lane);
+	} else {
+		h = seed + PRIME64_5;
+	}
+	h += totalLength;
+
+	auto p = pending;
+	const auto end = pending + pendingLength;
+	for (; end - p >= 8; p += 8) {
+		h ^= Round(0, ReadLE<uint64_t>(p));
+		h = RotateLeft(h, 27) * PRIME64_1 + PRIME64_4;
+	}
+	if (end - p >= 4) {
+		h ^= ReadLE<uint32_t>(p) * PRIME64_1;
+		h = RotateLeft(h, 23) * PRIME64_2 + PRIME64_3;
+		p += 4;
+	}
+	for (; p != end; ++p) {
+		h ^= *p * PRIME64_5;
+		h = RotateLeft(h, 11) * PRIME64_1;
+	}
+
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+std::string Hash64::ToString(uint64_t hash)
+{
+	char s[17];
+	std::snprintf(s, sizeof(s), "%016llx", static_cast<unsigned long long>(hash));
+	return s;
+}
+
+bool HashFile(const std::filesystem::path& path, Hash64& hash)
+{
+	constexpr size_t BUFFER_SIZE = 1024 * 1024;
+	std::ifstream ifs(path, std::ifstream::in | std::ifstream::binary);
+	if (!ifs) return false;
+
+	auto buffer = std::make_unique<char[]>(BUFFER_SIZE);
+	while (ifs.read(buffer.get(), BUFFER_SIZE) || ifs.gcount() > 0)
+		hash.Update(buffer.get(), static_cast<size_t>(ifs.gcount()));
+	return !ifs.bad();
+}
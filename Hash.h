@@ -0,0 +1,35 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+
+// Streaming implementation of the 64-bit xxHash. This keeps up with memory
+// bandwidth, so data can be hashed as it arrives from the device
+class Hash64
+{
+public:
+	explicit Hash64(uint64_t seed = 0);
+
+	void Update(const void* data, size_t length);
+	uint64_t Finish() const;
+
+	static std::string ToString(uint64_t hash);
+
+private:
+	uint64_t seed;
+	uint64_t v[4];
+	uint64_t totalLength{};
+	unsigned char pending[32];
+	size_t pendingLength{};
+};
+
+// Feeds the contents of a file to the hash
+bool HashFile(const std::filesystem::path& path, Hash64& hash);
@@ -5,223 +5,426 @@
  * For conditions of distribution and use, see LICENSE file
  */
 #include "MTP.h"
-
-#include <codecvt>
-#include <locale>
-#include "portabledeviceapi.h"
-#include "portabledevice.h"
+#include "MTPBackend.h"
+#include "Unicode.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_set>
+#ifdef _WIN32
+#include <atlbase.h>
+#include <comdef.h>
+#endif
 
 namespace mtp
 {
-	namespace
+	struct ObjectID::Interned
 	{
-		constexpr auto CLIENT_NAME = L"ReplicAndroid";
-		constexpr auto CLIENT_MAJOR_VER = 1;
-		constexpr auto CLIENT_MINOR_VER = 0;
-		constexpr auto CLIENT_REVISION = 0;
+		const NativeString value;
+		const size_t hash;
+		std::atomic<uint32_t> refs;
+	};
 
-		// https://stackoverflow.com/questions/4358870/convert-wstring-to-string-encoded-in-utf-8
-		std::string wstring_to_utf8(const std::wstring& str)
+	namespace
+	{
+		std::vector<std::unique_ptr<Backend>>& GetBackends()
 		{
-			std::wstring_convert<std::codecvt_utf8<wchar_t>> myconv;
-			return myconv.to_bytes(str);
+			static std::once_flag initialized;
+			static std::vector<std::unique_ptr<Backend>> backends;
+			std::call_once(initialized, [] {
+#ifdef _WIN32
+				backends.push_back(CreateWpdBackend());
+#endif
+#ifdef HAVE_LIBMTP
+				backends.push_back(CreateLibMtpBackend());
+#endif
+				backends.push_back(CreateSimulatedBackend());
+			});
+			return backends;
 		}
 
-		std::wstring utf8_to_wstring(const std::string& str)
+		// Scanning interns IDs from several threads at once, so the table is
+		// split up to keep them from waiting for each other
+		class ObjectIDTable
+		{
+			static constexpr size_t NUM_SHARDS = 16;
+
+			// Allows looking up views without making a string of them first
+			struct Hash
+			{
+				using is_transparent = void;
+				size_t operator()(NativeStringView id) const { return std::hash<NativeStringView>{}(id); }
+				size_t operator()(const ObjectID::Interned* id) const { return id->hash; }
+			};
+
+			struct Equal
+			{
+				using is_transparent = void;
+				bool operator()(const ObjectID::Interned* a, const ObjectID::Interned* b) const { return a == b; }
+				bool operator()(NativeStringView a, const ObjectID::Interned* b) const { return a == b->value; }
+				bool operator()(const ObjectID::Interned* a, NativeStringView b) const { return a->value == b; }
+			};
+
+			struct Shard
+			{
+				std::mutex mutex;
+				std::unordered_set<ObjectID::Interned*, Hash, Equal> ids;
+			};
+			std::array<Shard, NUM_SHARDS> shards;
+
+		public:
+			ObjectID::Interned* Intern(NativeStringView id)
+			{
+				const auto hash = Hash{}(id);
+				auto& shard = shards[hash % NUM_SHARDS];
+				std::lock_guard lock(shard.mutex);
+				if (auto it = shard.ids.find(id); it != shard.ids.end()) {
+					++(*it)->refs;
+					return *it;
+				}
+				auto interned = new ObjectID::Interned{ NativeString(id), hash, 1 };
+				shard.ids.insert(interned);
+				return interned;
+			}
+
+			void Release(ObjectID::Interned* id)
+			{
+				// Only dropping the last reference needs the lock, which keeps
+				// Intern() from handing out the ID again meanwhile
+				for (auto refs = id->refs.load(); refs > 1; ) {
+					if (id->refs.compare_exchange_weak(refs, refs - 1)) return;
+				}
+				auto& shard = shards[id->hash % NUM_SHARDS];
+				std::lock_guard lock(shard.mutex);
+				if (--id->refs > 0) return;
+				shard.ids.erase(id);
+				delete id;
+			}
+		};
+
+		ObjectIDTable& GetObjectIDTable()
 		{
-			std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>> myconv;
-			return myconv.from_bytes(str);
+			// Never destroyed, as IDs with static storage may outlive it
+			static auto table = new ObjectIDTable;
+			return *table;
 		}
 
-		ExpectedOrHResult<CComPtr<IPortableDeviceValues>> GetClientInformation()
+		// Reopens a session by asking the backend for a new one for the same
+		// device, so that backends need not know how to recover themselves.
+		// Reopening waits for the calls in progress; callbacks must not call
+		// into the same session
+		class ReopenableSession : public Session
 		{
-			CComPtr<IPortableDeviceValues> clientInformation;
+			Backend& backend;
+			const DeviceID deviceId;
+			// Held shared by calls for as long as they take
+			std::shared_mutex mutex;
+			SessionPtr session; // empty if reopening failed
+
+			template<typename Fn> auto Call(Fn fn) -> decltype(fn(std::declval<Session&>()))
+			{
+				std::shared_lock lock(mutex);
+				if (!session) return HRESULT_FROM_WIN32(ERROR_DEVICE_NOT_CONNECTED);
+				return fn(*session);
+			}
 
-			if (const auto hr = clientInformation.CoCreateInstance(CLSID_PortableDeviceValues, NULL, CLSCTX_INPROC_SERVER); FAILED(hr)) return hr;
-			if (const auto hr = clientInformation->SetStringValue(WPD_CLIENT_NAME, CLIENT_NAME); FAILED(hr)) return hr;
-			if (const auto hr = clientInformation->SetUnsignedIntegerValue(WPD_CLIENT_MAJOR_VERSION, CLIENT_MAJOR_VER); FAILED(hr)) return hr;
-			if (const auto hr = clientInformation->SetUnsignedIntegerValue(WPD_CLIENT_MINOR_VERSION, CLIENT_MINOR_VER); FAILED(hr)) return hr;
-			if (const auto hr = clientInformation->SetUnsignedIntegerValue(WPD_CLIENT_REVISION, CLIENT_REVISION); FAILED(hr)) return hr;
-			if (const auto hr = clientInformation->SetUnsignedIntegerValue(WPD_CLIENT_SECURITY_QUALITY_OF_SERVICE, SECURITY_IMPERSONATION); FAILED(hr)) return hr;
+		public:
+			ReopenableSession(Backend& backend, DeviceID deviceId, SessionPtr session)
+				: backend(backend), deviceId(std::move(deviceId)), session(std::move(session)) { }
 
-			return clientInformation;
-		}
-	}
+			ExpectedOrHResult<ObjectProperties> ReadProperties(const ObjectID& id) override
+			{
+				return Call([&](Session& s) { return s.ReadProperties(id); });
+			}
 
-	ExpectedOrHResult<std::vector<PortableDevice>> EnumeratePortableDevices()
-	{
-		CComPtr<IPortableDeviceManager> portableDeviceManager;
-		if (const auto hr = CoCreateInstance(CLSID_PortableDeviceManager, NULL, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&portableDeviceManager)); FAILED(hr)) return hr;
+			ExpectedOrHResult<std::vector<ObjectID>> EnumerateContents(const ObjectID& id) override
+			{
+				return Call([&](Session& s) { return s.EnumerateContents(id); });
+			}
 
-		DWORD deviceCount{};
-		if (const auto hr = portableDeviceManager->GetDevices(NULL, &deviceCount); FAILED(hr)) return hr;
+			ExpectedOrHResult<uint64_t> ReadData(const ObjectID& id, ReadCallbackFn callback) override
+			{
+				return Call([&](Session& s) { return s.ReadData(id, std::move(callback)); });
+			}
 
-		std::vector<PortableDevice> devices;
-		if (deviceCount > 0)
-		{
-			auto deviceIDs = std::make_unique<PWSTR[]>(deviceCount);
-			if (const auto hr = portableDeviceManager->GetDevices(deviceIDs.get(), &deviceCount); FAILED(hr)) return hr;
-
-			for (int n = 0; n < deviceCount; ++n) {
-				const auto id = deviceIDs[n];
-
-				auto getString = [&](auto func) -> std::optional<std::string> {
-					DWORD size{};
-					if (const auto hr = func(nullptr, &size); SUCCEEDED(hr)) {
-						if (size == 0) return "";
-						auto str = std::make_unique<WCHAR[]>(size);
-						if (const auto hr = func(str.get(), &size); SUCCEEDED(hr))
-							return wstring_to_utf8(str.get());
-					}
-					return {};
-				};
-
-				auto name = getString([&](auto str, auto size) { return portableDeviceManager->GetDeviceFriendlyName(id, str, size); });
-				auto manufacturer = getString([&](auto str, auto size) { return portableDeviceManager->GetDeviceManufacturer(id, str, size); });
-				auto descr = getString([&](auto str, auto size) { return portableDeviceManager->GetDeviceDescription(id, str, size); });
-				devices.push_back({ wstring_to_utf8(id), std::move(name), std::move(manufacturer), std::move(descr) });
-				CoTaskMemFree(id);
+			ExpectedOrHResult<uint64_t> ReadDataFrom(const ObjectID& id, uint64_t offset, ReadCallbackFn callback) override
+			{
+				return Call([&](Session& s) { return s.ReadDataFrom(id, offset, std::move(callback)); });
 			}
-		}
-		return devices;
-	}
 
-	ExpectedOrHResult<CComPtr<IPortableDevice>> OpenDevice(const DeviceID& deviceId)
-	{
-		CComPtr<IPortableDevice> device;
-		if (const auto hr = device.CoCreateInstance(CLSID_PortableDeviceFTM, NULL, CLSCTX_INPROC_SERVER); FAILED(hr)) return hr;
+			ExpectedOrHResult<size_t> EnumerateContentsWithProperties(const ObjectID& id, ObjectInfoCallbackFn callback) override
+			{
+				return Call([&](Session& s) { return s.EnumerateContentsWithProperties(id, std::move(callback)); });
+			}
+
+			ExpectedOrHResult<ObjectID> FindByPersistentId(const std::string& persistentId) override
+			{
+				return Call([&](Session& s) { return s.FindByPersistentId(persistentId); });
+			}
+
+			ExpectedOrHResult<ObjectID> FindChild(const ObjectID& parent, const std::string& name) override
+			{
+				return Call([&](Session& s) { return s.FindChild(parent, name); });
+			}
 
-		auto clientInformation = GetClientInformation();
-		if (!clientInformation) return clientInformation.GetResult();
+			void Invalidate(const ObjectID& id) override
+			{
+				std::shared_lock lock(mutex);
+				if (session) session->Invalidate(id);
+			}
+
+			void InvalidateAll() override
+			{
+				std::shared_lock lock(mutex);
+				if (session) session->InvalidateAll();
+			}
 
-		clientInformation->SetUnsignedIntegerValue(WPD_CLIENT_DESIRED_ACCESS, GENERIC_READ);
-		auto id = utf8_to_wstring(deviceId);
-		if (const auto hr = device->Open(id.data(), *clientInformation); FAILED(hr)) return hr;
+			HRESULT Reopen() override
+			{
+				// Once the calls in progress are done, the old session is let go
+				// of first; some backends cannot open a device that is still
+				// open. Calls made meanwhile wait for the new session
+				std::unique_lock lock(mutex);
+				session.reset();
+				auto newSession = backend.OpenDevice(deviceId);
+				if (!newSession) return newSession.GetResult();
+				session = std::move(*newSession);
+				return S_OK;
+			}
 
-		return device;
+			// Some backends can only have a device open once; this fails then
+			ExpectedOrHResult<SessionPtr> OpenAnother() override
+			{
+				auto newSession = backend.OpenDevice(deviceId);
+				if (!newSession) return newSession.GetResult();
+				return SessionPtr(std::make_shared<ReopenableSession>(backend, deviceId, std::move(*newSession)));
+			}
+		};
 	}
 
-	ExpectedOrHResult<ObjectProperties> ReadProperties(CComPtr<IPortableDevice>& device, const ObjectID& id)
+	ObjectID::ObjectID(NativeStringView id)
+		: id(id.empty() ? nullptr : GetObjectIDTable().Intern(id))
 	{
-		CComPtr<IPortableDeviceContent> content;
-		if (const auto hr = device->Content(&content); FAILED(hr)) return hr;
+	}
 
-		CComPtr<IPortableDeviceProperties> props;
-		if (const auto hr = content->Properties(&props); FAILED(hr)) return hr;
+	ObjectID::ObjectID(const ObjectID& other) noexcept
+		: id(other.id)
+	{
+		// Whoever copies holds a reference already, so the ID cannot go away
+		if (id) id->refs.fetch_add(1, std::memory_order_relaxed);
+	}
 
-		CComPtr<IPortableDeviceKeyCollection> propsToRead;
-		if (const auto hr = propsToRead.CoCreateInstance(CLSID_PortableDeviceKeyCollection, NULL, CLSCTX_INPROC_SERVER); FAILED(hr)) return hr;
+	ObjectID::~ObjectID()
+	{
+		if (id) GetObjectIDTable().Release(id);
+	}
 
-		if (const auto hr = propsToRead->Add(WPD_OBJECT_PARENT_ID); FAILED(hr)) return hr;
-		if (const auto hr = propsToRead->Add(WPD_OBJECT_NAME); FAILED(hr)) return hr;
-		if (const auto hr = propsToRead->Add(WPD_OBJECT_PERSISTENT_UNIQUE_ID); FAILED(hr)) return hr;
-		if (const auto hr = propsToRead->Add(WPD_OBJECT_FORMAT); FAILED(hr)) return hr;
-		if (const auto hr = propsToRead->Add(WPD_OBJECT_CONTENT_TYPE); FAILED(hr)) return hr;
-		if (const auto hr = propsToRead->Add(WPD_OBJECT_ORIGINAL_FILE_NAME); FAILED(hr)) return hr;
-		if (const auto hr = propsToRead->Add(WPD_OBJECT_SIZE); FAILED(hr)) return hr;
+	ObjectID ObjectID::FromUtf8(std::string_view id)
+	{
+#ifdef _WIN32
+		return ObjectID(unicode::ToWide(id));
+#else
+		return ObjectID(id);
+#endif
+	}
 
-		auto wId = utf8_to_wstring(id);
-		CComPtr<IPortableDeviceValues> objectProperties;
-		if (const auto hr = props->GetValues(wId.data(), propsToRead, &objectProperties); FAILED(hr)) return hr;
+	std::string ObjectID::ToUtf8() const
+	{
+#ifdef _WIN32
+		return unicode::ToUtf8(Native());
+#else
+		return Native();
+#endif
+	}
 
-		auto getString = [&](const PROPERTYKEY& key, auto& result) {
-			PWSTR strValue;
-			if (const auto hr = objectProperties->GetStringValue(key, &strValue); SUCCEEDED(hr)) {
-				result = wstring_to_utf8(strValue);
-			}
-		};
+	const NativeString& ObjectID::Native() const
+	{
+		static const NativeString empty;
+		return id ? id->value : empty;
+	}
 
-		auto getLong = [&](const PROPERTYKEY& key, auto& result) {
-			ULONG value;
-			if (const auto hr = objectProperties->GetUnsignedIntegerValue(key, &value); SUCCEEDED(hr)) {
-				result = value;
-			}
-		};
+	const ObjectID& GetRootObjectID()
+	{
+#ifdef _WIN32
+		static const ObjectID root(L"DEVICE");
+#else
+		static const ObjectID root("DEVICE");
+#endif
+		return root;
+	}
 
-		auto getGuid = [&](const PROPERTYKEY& key, auto& result) {
-			GUID guid;
-			if (const auto hr = objectProperties->GetGuidValue(key, &guid); SUCCEEDED(hr)) {
-				result = guid;
+	ExpectedOrHResult<std::vector<PortableDevice>> EnumeratePortableDevices()
+	{
+		std::vector<PortableDevice> devices;
+		HRESULT lastError{ S_OK };
+		for (auto& backend : GetBackends()) {
+			auto backendDevices = backend->EnumeratePortableDevices();
+			if (!backendDevices) {
+				lastError = backendDevices.GetResult();
+				continue;
 			}
-		};
-
-		ObjectProperties result;
-		getString(WPD_OBJECT_NAME, result.name);
-		getString(WPD_OBJECT_ORIGINAL_FILE_NAME, result.fileName);
-		getGuid(WPD_OBJECT_CONTENT_TYPE, result.contentType);
-		getGuid(WPD_OBJECT_FORMAT, result.format);
-		getLong(WPD_OBJECT_SIZE, result.size);
-		return result;
+			for (auto& device : *backendDevices) {
+				devices.push_back(std::move(device));
+			}
+		}
+		// Only fail if no backend could be queried at all
+		if (devices.empty() && FAILED(lastError)) return lastError;
+		return devices;
 	}
 
-	ExpectedOrHResult<std::vector<ObjectID>> EnumerateContents(CComPtr<IPortableDevice>& device, const ObjectID& id)
+	ExpectedOrHResult<SessionPtr> OpenDevice(const DeviceID& deviceId)
 	{
-		CComPtr<IPortableDeviceContent> content;
-		if (const auto hr = device->Content(&content); FAILED(hr)) return hr;
+		for (auto& backend : GetBackends()) {
+			const std::string prefix = std::string(backend->GetName()) + ':';
+			if (deviceId.compare(0, prefix.size(), prefix) != 0) continue;
+
+			auto session = backend->OpenDevice(deviceId);
+			if (!session) return session.GetResult();
+			auto reopenable = std::make_shared<ReopenableSession>(*backend, deviceId, std::move(*session));
+			return CreateCachedSession(CreateInstrumentedSession(std::move(reopenable)));
+		}
+		return E_INVALIDARG;
+	}
 
-		auto wId = utf8_to_wstring(id);
-		CComPtr<IEnumPortableDeviceObjectIDs> enumObjectIDs;
-		auto hr = content->EnumObjects(0, wId.data(), nullptr, &enumObjectIDs);
-		if (FAILED(hr)) return hr;
+	ExpectedOrHResult<uint64_t> Session::ReadDataFrom(const ObjectID& id, uint64_t offset, ReadCallbackFn callback)
+	{
+		if (offset == 0) return ReadData(id, std::move(callback));
+		return E_NOTIMPL;
+	}
 
-		std::vector<ObjectID> results;
-		while (hr == S_OK) {
-			constexpr auto NUM_OBJECTS_TO_REQUEST = 10;
-			PWSTR objectIDs[NUM_OBJECTS_TO_REQUEST];
-			DWORD numIds{};
-			hr = enumObjectIDs->Next(NUM_OBJECTS_TO_REQUEST, objectIDs, &numIds);
-			if (FAILED(hr)) break;
+	ExpectedOrHResult<ObjectID> Session::FindByPersistentId(const std::string&)
+	{
+		return E_NOTIMPL;
+	}
 
-			for (DWORD n = 0; n < numIds; ++n) {
-				auto id = objectIDs[n];
-				results.push_back(wstring_to_utf8(id));
-				CoTaskMemFree(id);
+	ExpectedOrHResult<size_t> Session::EnumerateContentsWithProperties(const ObjectID& id, ObjectInfoCallbackFn callback)
+	{
+		auto contents = EnumerateContents(id);
+		if (!contents) return contents.GetResult();
+
+		constexpr size_t BATCH_SIZE = 64;
+		size_t numObjects{};
+		std::vector<ObjectInfo> batch;
+		for (const auto& objectId : *contents) {
+			auto props = ReadProperties(objectId);
+			if (!props) continue;
+			batch.push_back({ objectId, std::move(*props) });
+			++numObjects;
+			if (batch.size() == BATCH_SIZE) {
+				if (!std::invoke(callback, batch)) return numObjects;
+				batch.clear();
 			}
 		}
-		return results;
+		if (!batch.empty()) std::invoke(callback, batch);
+		return numObjects;
 	}
 
-	ExpectedOrHResult<size_t> ReadData(CComPtr<IPortableDevice>& device, const ObjectID& id, ReadCallbackFn callback)
+	ExpectedOrHResult<size_t> Session::EnumerateContentsOnce(const ObjectID& id, ObjectInfoCallbackFn callback)
 	{
-		CComPtr<IPortableDeviceContent> content;
-		if (const auto hr = device->Content(&content); FAILED(hr)) return hr;
+		return EnumerateContentsWithProperties(id, std::move(callback));
+	}
 
-		CComPtr<IPortableDeviceResources> resources;
-		if (const auto hr = content->Transfer(&resources); FAILED(hr)) return hr;
+	ExpectedOrHResult<ObjectID> Session::FindChild(const ObjectID& parent, const std::string& name)
+	{
+		ObjectID childObjectID;
+		auto result = EnumerateContentsWithProperties(parent, [&](auto& batch) {
+			auto it = std::find_if(batch.begin(), batch.end(), [&](const auto& object) {
+				return object.properties.name == name;
+			});
+			if (it == batch.end()) return true;
+			childObjectID = std::move(it->id);
+			return false;
+		});
+		if (!result) return result.GetResult();
+		return childObjectID;
+	}
 
-		auto wId = utf8_to_wstring(id);
-		DWORD optimalTransferSize;
-		CComPtr<IStream> stream;
-		if (const auto hr = resources->GetStream(wId.data(), WPD_RESOURCE_DEFAULT, STGM_READ, &optimalTransferSize, &stream); FAILED(hr)) return hr;
+	void Session::Invalidate(const ObjectID&)
+	{
+	}
 
-		size_t totalBytesRead{};
-		auto buffer = std::make_unique<char[]>(optimalTransferSize);
-		while (true) {
-			DWORD bytesRead;
-			if (const auto hr = stream->Read(buffer.get(), optimalTransferSize, &bytesRead); FAILED(hr)) return hr;
-			if (bytesRead == 0) break;
+	void Session::InvalidateAll()
+	{
+	}
 
-			totalBytesRead += bytesRead;
-			if (!std::invoke(callback, buffer.get(), bytesRead)) break;
-		}
-		return totalBytesRead;
+	HRESULT Session::Reopen()
+	{
+		return E_NOTIMPL;
+	}
+
+	ExpectedOrHResult<SessionPtr> Session::OpenAnother()
+	{
+		return E_NOTIMPL;
 	}
 
-	ExpectedOrHResult<ObjectID> Lookup(CComPtr<IPortableDevice>& device, const std::vector<std::string>& path)
+	ExpectedOrHResult<ObjectID> Session::Lookup(const std::vector<std::string>& path)
 	{
-		ObjectID currentObjectID("DEVICE");
+		ObjectID currentObjectID(RootObjectID);
 		for (const auto& piece : path)
 		{
-			auto contents = EnumerateContents(device, currentObjectID);
-			if (!contents) return contents.GetResult();
-			auto nextObjectID = std::find_if(contents->begin(), contents->end(), [&](const auto& id) {
-				auto props = ReadProperties(device, id);
-				return props && props->name == piece;
-			});
-			if (nextObjectID == contents->end()) return ObjectID{};
+			auto nextObjectID = FindChild(currentObjectID, piece);
+			if (!nextObjectID) return nextObjectID.GetResult();
+			if (nextObjectID->empty()) return ObjectID{};
 
-			currentObjectID = *nextObjectID;
+			currentObjectID = std::move(*nextObjectID);
 		}
 		return currentObjectID;
 	}
+
+	std::string DescribeError(HRESULT hr)
+	{
+		char code[16];
+		std::snprintf(code, sizeof(code), "0x%08x", static_cast<unsigned int>(hr));
+#ifdef _WIN32
+		_com_error e(hr);
+		return std::string(CT2A(e.ErrorMessage(), CP_UTF8)) + " (" + code + ")";
+#else
+		return std::string("error ") + code;
+#endif
+	}
+
+	ErrorClass ClassifyError(HRESULT hr)
+	{
+		// What USB stacks and drivers report when the device was too slow to
+		// respond or the data got mangled on the way
+		static const HRESULT transientErrors[] = {
+			E_FAIL, // all that some backends have to say
+			E_PENDING,
+			HRESULT_FROM_WIN32(ERROR_NOT_READY),
+			HRESULT_FROM_WIN32(ERROR_CRC),
+			HRESULT_FROM_WIN32(ERROR_GEN_FAILURE),
+			HRESULT_FROM_WIN32(ERROR_SEM_TIMEOUT),
+			HRESULT_FROM_WIN32(ERROR_BUSY),
+			HRESULT_FROM_WIN32(ERROR_IO_DEVICE),
+			HRESULT_FROM_WIN32(ERROR_TIMEOUT),
+		};
+		// The device went away, if only for a moment
+		static const HRESULT resetErrors[] = {
+			HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE),
+			HRESULT_FROM_WIN32(ERROR_NO_SUCH_DEVICE),
+			HRESULT_FROM_WIN32(ERROR_DEVICE_NOT_CONNECTED),
+			HRESULT_FROM_WIN32(ERROR_DEVICE_REMOVED),
+#ifdef _WIN32
+			E_WPD_DEVICE_NOT_OPEN,
+			E_WPD_DEVICE_IS_HUNG,
+#endif
+		};
+		if (std::find(std::begin(resetErrors), std::end(resetErrors), hr) != std::end(resetErrors)) return ErrorClass::DeviceReset;
+		if (std::find(std::begin(transientErrors), std::end(transientErrors), hr) != std::end(transientErrors)) return ErrorClass::Transient;
+		return ErrorClass::Permanent;
+	}
+
+	const char* GetErrorClassName(ErrorClass errorClass)
+	{
+		switch (errorClass) {
+			case ErrorClass::Permanent: return "permanent";
+			case ErrorClass::Transient: return "transient";
+			case ErrorClass::DeviceReset: return "device-reset";
+		}
+		return "unknown";
+	}
 }
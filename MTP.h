@@ -6,12 +6,15 @@
  */
 #pragma once
 
-#include <atlbase.h>
+#include <cstdint>
 #include <optional>
 #include <functional>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
-#include <PortableDeviceApi.h>
+#include "Platform.h"
 
 namespace mtp
 {
@@ -43,7 +46,48 @@ namespace mtp
     };
 
     using DeviceID = std::string;
-    using ObjectID = std::string;
+
+#ifdef _WIN32
+    using NativeChar = wchar_t;
+#else
+    using NativeChar = char;
+#endif
+    using NativeString = std::basic_string<NativeChar>;
+    using NativeStringView = std::basic_string_view<NativeChar>;
+
+    // Identifies an object on a device, using the representation of the
+    // backend: wide strings for WPD, which are also what paths are made of on
+    // Windows. IDs are interned, so that each distinct ID is stored only once
+    // and copying, comparing and hashing them does not touch the string. An
+    // interned ID is freed once the last copy of it is gone
+    class ObjectID
+    {
+    public:
+        // Shared by all copies of an ID; only MTP.cpp knows what is inside
+        struct Interned;
+
+        ObjectID() = default;
+        explicit ObjectID(NativeStringView id);
+        ObjectID(const ObjectID& other) noexcept;
+        ObjectID(ObjectID&& other) noexcept : id(other.id) { other.id = nullptr; }
+        ObjectID& operator=(ObjectID other) noexcept { std::swap(id, other.id); return *this; }
+        ~ObjectID();
+        // Converts, so only meant for the boundaries
+        static ObjectID FromUtf8(std::string_view id);
+        std::string ToUtf8() const;
+
+        // An empty ID refers to no object at all
+        bool empty() const { return id == nullptr; }
+        const NativeString& Native() const;
+        const NativeChar* c_str() const { return Native().c_str(); }
+
+        bool operator==(const ObjectID& other) const { return id == other.id; }
+        bool operator!=(const ObjectID& other) const { return id != other.id; }
+        size_t Hash() const { return std::hash<const void*>{}(id); }
+
+    private:
+        Interned* id{};
+    };
 
     struct PortableDevice
     {
@@ -59,17 +103,99 @@ namespace mtp
         std::optional<std::string> fileName;
         std::optional<GUID> contentType;
         std::optional<GUID> format;
-        std::optional<ULONG> size;
+        std::optional<uint64_t> size;
+        std::optional<std::string> persistentId;
+        std::optional<int64_t> modified; // seconds since the epoch
     };
 
-    ExpectedOrHResult<std::vector<PortableDevice>> EnumeratePortableDevices();
-    ExpectedOrHResult<CComPtr<IPortableDevice>> OpenDevice(const DeviceID&);
+    struct ObjectInfo
+    {
+        ObjectID id;
+        ObjectProperties properties;
+    };
+
+    using ReadCallbackFn = std::function<bool(const void*, size_t)>;
+    // Receives the children of a folder a batch at a time; return false to stop
+    using ObjectInfoCallbackFn = std::function<bool(std::vector<ObjectInfo>&)>;
+
+    // An opened device. Implemented by each backend, which keeps whatever
+    // per-device state it needs for as long as the session lives
+    class Session
+    {
+    public:
+        virtual ~Session() = default;
+
+        virtual ExpectedOrHResult<ObjectProperties> ReadProperties(const ObjectID&) = 0;
+        virtual ExpectedOrHResult<std::vector<ObjectID>> EnumerateContents(const ObjectID&) = 0;
+        virtual ExpectedOrHResult<uint64_t> ReadData(const ObjectID&, ReadCallbackFn callback) = 0;
+        // Like ReadData(), but skips the first bytes of the object. Yields
+        // E_NOTIMPL if the backend or device cannot do this
+        virtual ExpectedOrHResult<uint64_t> ReadDataFrom(const ObjectID&, uint64_t offset, ReadCallbackFn callback);
+
+        // Retrieves the properties of all children of an object. Backends
+        // should override this if they can avoid a round trip per object;
+        // the default just calls ReadProperties() for every child
+        virtual ExpectedOrHResult<size_t> EnumerateContentsWithProperties(const ObjectID&, ObjectInfoCallbackFn callback);
+        // The same, for walking a tree once, such as to back it up: sessions
+        // that remember what they learn leave this out
+        virtual ExpectedOrHResult<size_t> EnumerateContentsOnce(const ObjectID&, ObjectInfoCallbackFn callback);
+
+        // Yields the object ID of the object with the given persistent ID,
+        // which is only valid for this session. Not supported by default
+        virtual ExpectedOrHResult<ObjectID> FindByPersistentId(const std::string& persistentId);
+
+        // Yields the child of an object with the given name, or an empty
+        // ObjectID if there is none
+        virtual ExpectedOrHResult<ObjectID> FindChild(const ObjectID& parent, const std::string& name);
+
+        // Sessions may remember what they learnt about objects; these make
+        // sure the object, or everything, is asked for again next time
+        virtual void Invalidate(const ObjectID&);
+        virtual void InvalidateAll();
+
+        // Opens the device again after it was reset or reconnected. Object
+        // IDs handed out before may no longer be valid afterwards; look them
+        // up by persistent ID where possible. Not supported by default
+        virtual HRESULT Reopen();
+
+        // Opens another session to the same device, so that several threads
+        // can have requests outstanding at once. Object IDs are valid in
+        // both. Not supported by default
+        virtual ExpectedOrHResult<std::shared_ptr<Session>> OpenAnother();
+
+        // Resolves a path of object names, starting at the device root. Yields
+        // an empty ObjectID if the path does not exist
+        ExpectedOrHResult<ObjectID> Lookup(const std::vector<std::string>& path);
+    };
+    using SessionPtr = std::shared_ptr<Session>;
+
+    // Object ID of the root of every device, regardless of backend
+    const ObjectID& GetRootObjectID();
+    inline const ObjectID RootObjectID = GetRootObjectID();
 
-    ExpectedOrHResult<ObjectProperties> ReadProperties(CComPtr<IPortableDevice>& device, const ObjectID&);
-    ExpectedOrHResult<std::vector<ObjectID>> EnumerateContents(CComPtr<IPortableDevice>& device, const ObjectID&);
+    // WPD format GUIDs embed the MTP object format code in their first 16 bits
+    constexpr GUID MakeFormat(std::uint16_t mtpFormatCode)
+    {
+        return GUID{ static_cast<std::uint32_t>(mtpFormatCode) << 16, 0xAE6C, 0x4804, { 0x98, 0xBA, 0xC5, 0x7B, 0x46, 0x96, 0x5F, 0xE7 } };
+    }
 
-    ExpectedOrHResult<ObjectID> Lookup(CComPtr<IPortableDevice>& device, const std::vector<std::string>& path);
+    ExpectedOrHResult<std::vector<PortableDevice>> EnumeratePortableDevices();
+    ExpectedOrHResult<SessionPtr> OpenDevice(const DeviceID&);
 
-    using ReadCallbackFn = std::function<bool(const void*, size_t)>;
-    ExpectedOrHResult<size_t> ReadData(CComPtr<IPortableDevice>& device, const ObjectID&, ReadCallbackFn callback);
+    std::string DescribeError(HRESULT hr);
+
+    // How a failed call to the device is best dealt with
+    enum class ErrorClass
+    {
+        Permanent, // trying again will not help, such as for a missing object
+        Transient, // the device or connection hiccuped; try again a bit later
+        DeviceReset, // the session is lost; reopen it before trying again
+    };
+    ErrorClass ClassifyError(HRESULT hr);
+    const char* GetErrorClassName(ErrorClass errorClass);
 }
+
+template<> struct std::hash<mtp::ObjectID>
+{
+    size_t operator()(const mtp::ObjectID& id) const { return id.Hash(); }
+};
@@ -0,0 +1,82 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#pragma once
+
+#include <chrono>
+#include <filesystem>
+#include <string>
+#include <vector>
+#include "MTP.h"
+
+namespace mtp
+{
+    // A backend knows how to find and open devices of a given kind. Device IDs
+    // are prefixed with the backend name so OpenDevice() can route them back
+    class Backend
+    {
+    public:
+        virtual ~Backend() = default;
+
+        virtual const char* GetName() const = 0;
+        virtual ExpectedOrHResult<std::vector<PortableDevice>> EnumeratePortableDevices() = 0;
+        virtual ExpectedOrHResult<SessionPtr> OpenDevice(const DeviceID&) = 0;
+    };
+
+#ifdef _WIN32
+    std::unique_ptr<Backend> CreateWpdBackend();
+#endif
+#ifdef HAVE_LIBMTP
+    std::unique_ptr<Backend> CreateLibMtpBackend();
+#endif
+
+    // The simulated backend exposes a directory tree as a device: every
+    // subdirectory of the root is presented as a storage. Devices are listed
+    // from the REPLICANDROID_SIMULATED_DEVICES environment variable, which
+    // holds a list of root directories separated by ';'. The
+    // REPLICANDROID_SIMULATED_LATENCY_US and REPLICANDROID_SIMULATED_BANDWIDTH
+    // (bytes/second) variables set the default options, and
+    // REPLICANDROID_SIMULATED_FAILURE_RATE makes reads fail now and then
+    struct SimulatedDeviceOptions
+    {
+        std::chrono::microseconds latency{};
+        size_t bandwidth{}; // bytes/second, 0 for unlimited
+        size_t transferSize{ 256 * 1024 };
+        // Share of the reads that time out after the first chunk, as a flaky
+        // cable would
+        double failureRate{};
+    };
+
+    // Wraps a session so that the folder contents and properties it yields are
+    // remembered. This is what OpenDevice() hands out, so everything using the
+    // device shares what is known about it
+    SessionPtr CreateCachedSession(SessionPtr session);
+    // Wraps a session so that every call to the device is recorded, see Trace.h
+    SessionPtr CreateInstrumentedSession(SessionPtr session);
+
+    std::unique_ptr<Backend> CreateSimulatedBackend();
+    ExpectedOrHResult<SessionPtr> OpenSimulatedDevice(const std::filesystem::path& root, const SimulatedDeviceOptions&);
+
+    // A synthetic device is generated in memory, for benchmarks that need more
+    // objects than are practical to create on disk. Each entry adds a number of
+    // files of the same size below a path, whose first piece is the storage.
+    // Files are numbered within their entry and named after their number, such
+    // as 000042.jpg; with filesPerFolder set, they are spread over subfolders
+    // named after the file number divided by it, such as 0003. The contents
+    // are a repeating pattern
+    struct SyntheticFiles
+    {
+        std::string path; // such as "Internal/DCIM/Camera"
+        size_t numFiles{};
+        uint64_t size{};
+        std::string extension;
+        size_t filesPerFolder{};
+    };
+
+    ExpectedOrHResult<SessionPtr> OpenSyntheticDevice(const std::vector<SyntheticFiles>& files, const SimulatedDeviceOptions&);
+    // The names leading to a file, for use with Session::Lookup()
+    std::vector<std::string> GetSyntheticPath(const SyntheticFiles& files, size_t n);
+}
@@ -0,0 +1,268 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#include "MTPBackend.h"
+
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+namespace mtp
+{
+	namespace
+	{
+		// Keeps the memory used in check when a large tree is walked; the least
+		// recently used folders and properties are forgotten first
+		constexpr size_t MAX_CACHED_OBJECTS = 256 * 1024;
+
+		class CachedSession : public Session
+		{
+			struct LruEntry
+			{
+				ObjectID id;
+				bool isFolder; // or properties
+			};
+			using LruList = std::list<LruEntry>; // most recently used first
+
+			struct Folder
+			{
+				std::vector<ObjectInfo> children;
+				std::unordered_map<std::string, size_t> childByName;
+				LruList::iterator lru;
+			};
+
+			struct CachedProperties
+			{
+				ObjectProperties properties;
+				LruList::iterator lru;
+			};
+
+			SessionPtr session;
+			std::mutex mutex;
+			std::unordered_map<ObjectID, CachedProperties> properties;
+			std::unordered_map<ObjectID, Folder> folders;
+			LruList lru;
+			size_t numCachedObjects{};
+			// Bumped whenever everything is invalidated; results of calls to the
+			// session that started before then are not cached
+			uint64_t generation{};
+
+			// Must be called with the mutex held
+			Folder* FindFolder(const ObjectID& id)
+			{
+				auto it = folders.find(id);
+				if (it == folders.end()) return nullptr;
+				lru.splice(lru.begin(), lru, it->second.lru);
+				return &it->second;
+			}
+
+			void RemoveFolder(const ObjectID& id)
+			{
+				auto it = folders.find(id);
+				if (it == folders.end()) return;
+				numCachedObjects -= it->second.children.size();
+				lru.erase(it->second.lru);
+				folders.erase(it);
+			}
+
+			void RemoveProperties(const ObjectID& id)
+			{
+				auto it = properties.find(id);
+				if (it == properties.end()) return;
+				--numCachedObjects;
+				lru.erase(it->second.lru);
+				properties.erase(it);
+			}
+
+			// Makes room for the given number of objects
+			void Evict(size_t numObjects)
+			{
+				while (!lru.empty() && numCachedObjects + numObjects > MAX_CACHED_OBJECTS) {
+					const auto oldest = lru.back();
+					if (oldest.isFolder)
+						RemoveFolder(oldest.id);
+					else
+						RemoveProperties(oldest.id);
+				}
+			}
+
+			void AddProperties(const ObjectID& id, const ObjectProperties& props, uint64_t fetchedIn)
+			{
+				std::lock_guard lock(mutex);
+				if (fetchedIn != generation) return;
+				RemoveProperties(id);
+				Evict(1);
+				++numCachedObjects;
+				lru.push_front({ id, false });
+				properties.emplace(id, CachedProperties{ props, lru.begin() });
+			}
+
+			void AddFolder(const ObjectID& id, std::vector<ObjectInfo> children, uint64_t fetchedIn)
+			{
+				std::lock_guard lock(mutex);
+				if (fetchedIn != generation) return;
+				RemoveFolder(id);
+				Evict(children.size());
+
+				Folder folder;
+				for (size_t n = 0; n < children.size(); ++n) {
+					if (children[n].properties.name) folder.childByName.emplace(*children[n].properties.name, n);
+				}
+				numCachedObjects += children.size();
+				folder.children = std::move(children);
+				lru.push_front({ id, true });
+				folder.lru = lru.begin();
+				folders.emplace(id, std::move(folder));
+			}
+
+		public:
+			CachedSession(SessionPtr session) : session(std::move(session)) { }
+
+			ExpectedOrHResult<ObjectProperties> ReadProperties(const ObjectID& id) override
+			{
+				uint64_t fetchedIn;
+				{
+					std::lock_guard lock(mutex);
+					if (auto it = properties.find(id); it != properties.end()) {
+						lru.splice(lru.begin(), lru, it->second.lru);
+						return ObjectProperties{ it->second.properties };
+					}
+					fetchedIn = generation;
+				}
+				auto result = session->ReadProperties(id);
+				if (result) AddProperties(id, *result, fetchedIn);
+				return result;
+			}
+
+			ExpectedOrHResult<std::vector<ObjectID>> EnumerateContents(const ObjectID& id) override
+			{
+				{
+					std::lock_guard lock(mutex);
+					if (auto folder = FindFolder(id); folder) {
+						std::vector<ObjectID> results;
+						for (const auto& child : folder->children) results.push_back(child.id);
+						return results;
+					}
+				}
+				return session->EnumerateContents(id);
+			}
+
+			ExpectedOrHResult<size_t> EnumerateContentsWithProperties(const ObjectID& id, ObjectInfoCallbackFn callback) override
+			{
+				std::vector<ObjectInfo> children;
+				bool cached{};
+				uint64_t fetchedIn;
+				{
+					std::lock_guard lock(mutex);
+					if (auto folder = FindFolder(id); folder) {
+						children = folder->children;
+						cached = true;
+					}
+					fetchedIn = generation;
+				}
+				if (cached) {
+					const auto numObjects = children.size();
+					if (!children.empty()) std::invoke(callback, children);
+					return numObjects;
+				}
+
+				// Only remember the folder if we have seen all of it
+				bool complete = true;
+				auto result = session->EnumerateContentsWithProperties(id, [&](auto& batch) {
+					children.insert(children.end(), batch.begin(), batch.end());
+					if (std::invoke(callback, batch)) return true;
+					complete = false;
+					return false;
+				});
+				if (result && complete) AddFolder(id, std::move(children), fetchedIn);
+				return result;
+			}
+
+			// Walking the whole tree would only push out what is worth keeping
+			ExpectedOrHResult<size_t> EnumerateContentsOnce(const ObjectID& id, ObjectInfoCallbackFn callback) override
+			{
+				return session->EnumerateContentsWithProperties(id, std::move(callback));
+			}
+
+			ExpectedOrHResult<uint64_t> ReadData(const ObjectID& id, ReadCallbackFn callback) override
+			{
+				return session->ReadData(id, std::move(callback));
+			}
+
+			ExpectedOrHResult<uint64_t> ReadDataFrom(const ObjectID& id, uint64_t offset, ReadCallbackFn callback) override
+			{
+				return session->ReadDataFrom(id, offset, std::move(callback));
+			}
+
+			ExpectedOrHResult<ObjectID> FindByPersistentId(const std::string& persistentId) override
+			{
+				return session->FindByPersistentId(persistentId);
+			}
+
+			ExpectedOrHResult<ObjectID> FindChild(const ObjectID& parent, const std::string& name) override
+			{
+				auto lookup = [&]() -> std::optional<ObjectID> {
+					std::lock_guard lock(mutex);
+					auto folder = FindFolder(parent);
+					if (!folder) return {};
+					auto it = folder->childByName.find(name);
+					if (it == folder->childByName.end()) return ObjectID{};
+					return folder->children[it->second].id;
+				};
+				if (auto id = lookup(); id) return std::move(*id);
+
+				// Fetch the entire folder, so that it ends up in the cache
+				auto result = EnumerateContentsWithProperties(parent, [](auto&) { return true; });
+				if (!result) return result.GetResult();
+				if (auto id = lookup(); id) return std::move(*id);
+				return Session::FindChild(parent, name);
+			}
+
+			void Invalidate(const ObjectID& id) override
+			{
+				std::lock_guard lock(mutex);
+				RemoveProperties(id);
+				RemoveFolder(id);
+				session->Invalidate(id);
+			}
+
+			void InvalidateAll() override
+			{
+				std::lock_guard lock(mutex);
+				properties.clear();
+				folders.clear();
+				lru.clear();
+				numCachedObjects = 0;
+				++generation;
+				session->InvalidateAll();
+			}
+
+			// What we know may be about object IDs that are no longer valid.
+			// Invalidating again afterwards drops whatever calls that were
+			// still going on while reopening come back with
+			HRESULT Reopen() override
+			{
+				InvalidateAll();
+				const auto hr = session->Reopen();
+				InvalidateAll();
+				return hr;
+			}
+
+			// With a cache of its own
+			ExpectedOrHResult<SessionPtr> OpenAnother() override
+			{
+				auto other = session->OpenAnother();
+				if (!other) return other.GetResult();
+				return CreateCachedSession(std::move(*other));
+			}
+		};
+	}
+
+	SessionPtr CreateCachedSession(SessionPtr session)
+	{
+		return std::make_shared<CachedSession>(std::move(session));
+	}
+}
@@ -0,0 +1,411 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#ifdef HAVE_LIBMTP
+#include "MTPBackend.h"
+#include "ReadSizeTuner.h"
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <libmtp.h>
+
+namespace mtp
+{
+	namespace
+	{
+		constexpr auto BACKEND_NAME = "libmtp";
+
+		// libmtp identifies objects by a 32-bit handle, but needs the storage
+		// as well to list a folder. Storages are encoded as 'S<storage>' and
+		// objects as '<storage>:<handle>', both in hex
+		struct Handle
+		{
+			uint32_t storage{};
+			uint32_t item{ LIBMTP_FILES_AND_FOLDERS_ROOT };
+		};
+
+		ObjectID MakeStorageID(uint32_t storage)
+		{
+			char s[16];
+			std::snprintf(s, sizeof(s), "S%08" PRIx32, storage);
+			return ObjectID(s);
+		}
+
+		ObjectID MakeObjectID(uint32_t storage, uint32_t item)
+		{
+			char s[24];
+			std::snprintf(s, sizeof(s), "%08" PRIx32 ":%08" PRIx32, storage, item);
+			return ObjectID(s);
+		}
+
+		std::optional<Handle> ParseObjectID(const ObjectID& id)
+		{
+			Handle handle;
+			if (std::sscanf(id.c_str(), "S%" SCNx32, &handle.storage) == 1) return handle;
+			if (std::sscanf(id.c_str(), "%" SCNx32 ":%" SCNx32, &handle.storage, &handle.item) == 2) return handle;
+			return {};
+		}
+
+		GUID FormatFromFiletype(LIBMTP_filetype_t filetype)
+		{
+			switch (filetype) {
+				case LIBMTP_FILETYPE_FOLDER: return MakeFormat(0x3001);
+				case LIBMTP_FILETYPE_TEXT: return MakeFormat(0x3004);
+				case LIBMTP_FILETYPE_HTML: return MakeFormat(0x3005);
+				case LIBMTP_FILETYPE_WAV: return MakeFormat(0x3008);
+				case LIBMTP_FILETYPE_MP3: return MakeFormat(0x3009);
+				case LIBMTP_FILETYPE_AVI: return MakeFormat(0x300A);
+				case LIBMTP_FILETYPE_MPEG: return MakeFormat(0x300B);
+				case LIBMTP_FILETYPE_ASF: return MakeFormat(0x300C);
+				case LIBMTP_FILETYPE_JPEG: return MakeFormat(0x3801);
+				case LIBMTP_FILETYPE_BMP: return MakeFormat(0x3804);
+				case LIBMTP_FILETYPE_GIF: return MakeFormat(0x3807);
+				case LIBMTP_FILETYPE_JFIF: return MakeFormat(0x3808);
+				case LIBMTP_FILETYPE_PNG: return MakeFormat(0x380B);
+				case LIBMTP_FILETYPE_TIFF: return MakeFormat(0x380D);
+				case LIBMTP_FILETYPE_WMA: return MakeFormat(0xB901);
+				case LIBMTP_FILETYPE_OGG: return MakeFormat(0xB902);
+				case LIBMTP_FILETYPE_AAC: return MakeFormat(0xB903);
+				case LIBMTP_FILETYPE_FLAC: return MakeFormat(0xB906);
+				case LIBMTP_FILETYPE_WMV: return MakeFormat(0xB981);
+				case LIBMTP_FILETYPE_MP4: return MakeFormat(0xB982);
+				default: return MakeFormat(0x3000);
+			}
+		}
+
+		ObjectProperties ToObjectProperties(const LIBMTP_file_t& file)
+		{
+			ObjectProperties result;
+			if (file.filename) {
+				result.name = file.filename;
+				result.fileName = file.filename;
+			}
+			result.format = FormatFromFiletype(file.filetype);
+			// libmtp offers no persistent ID; object handles may change between
+			// sessions, so leave it unset
+			if (file.modificationdate > 0) result.modified = static_cast<int64_t>(file.modificationdate);
+			if (file.filetype == LIBMTP_FILETYPE_FOLDER) {
+				result.contentType = WPD_CONTENT_TYPE_FOLDER;
+			} else {
+				result.contentType = WPD_CONTENT_TYPE_GENERIC_FILE;
+				result.size = file.filesize;
+			}
+			return result;
+		}
+
+		std::optional<std::string> TakeString(char* s)
+		{
+			if (!s) return {};
+			std::string result(s);
+			std::free(s);
+			return result;
+		}
+
+		class LibMtpSession : public Session
+		{
+			LIBMTP_mtpdevice_t* device;
+			// libmtp device handles must not be used from multiple threads at once
+			std::mutex mutex;
+			ReadSizeTuner readSizeTuner;
+
+			// Translates the most recent error into what the WPD backend would
+			// report, so that failures are classified the same way
+			HRESULT GetLastError()
+			{
+				auto hr = E_FAIL;
+				for (auto error = LIBMTP_Get_Errorstack(device); error; error = error->next) {
+					switch (error->errornumber) {
+						case LIBMTP_ERROR_USB_LAYER: hr = HRESULT_FROM_WIN32(ERROR_IO_DEVICE); break;
+						case LIBMTP_ERROR_NO_DEVICE_ATTACHED:
+						case LIBMTP_ERROR_CONNECTING: hr = HRESULT_FROM_WIN32(ERROR_DEVICE_NOT_CONNECTED); break;
+						case LIBMTP_ERROR_MEMORY_ALLOCATION: hr = E_OUTOFMEMORY; break;
+						case LIBMTP_ERROR_CANCELLED: hr = E_ABORT; break;
+						default: break;
+					}
+				}
+				LIBMTP_Clear_Errorstack(device);
+				return hr;
+			}
+
+			// Yields the list of files, which is empty for an empty folder as
+			// well as when listing it failed; only the error stack tells them
+			// apart. Must be called with the mutex held
+			ExpectedOrHResult<LIBMTP_file_t*> GetFilesAndFolders(const Handle& handle)
+			{
+				LIBMTP_Clear_Errorstack(device);
+				auto files = LIBMTP_Get_Files_And_Folders(device, handle.storage, handle.item);
+				if (!files && LIBMTP_Get_Errorstack(device)) return GetLastError();
+				return files;
+			}
+
+		public:
+			LibMtpSession(LIBMTP_mtpdevice_t* device) : device(device) { }
+			~LibMtpSession() { LIBMTP_Release_Device(device); }
+
+			ExpectedOrHResult<ObjectProperties> ReadProperties(const ObjectID& id) override
+			{
+				std::lock_guard lock(mutex);
+				if (id == RootObjectID) {
+					ObjectProperties result;
+					result.name = TakeString(LIBMTP_Get_Friendlyname(device));
+					result.contentType = WPD_CONTENT_TYPE_FUNCTIONAL_OBJECT;
+					return result;
+				}
+
+				auto handle = ParseObjectID(id);
+				if (!handle) return E_INVALIDARG;
+				if (handle->item == LIBMTP_FILES_AND_FOLDERS_ROOT) {
+					for (auto storage = device->storage; storage; storage = storage->next) {
+						if (storage->id != handle->storage) continue;
+						ObjectProperties result;
+						if (storage->StorageDescription) result.name = storage->StorageDescription;
+						result.contentType = WPD_CONTENT_TYPE_FUNCTIONAL_OBJECT;
+						return result;
+					}
+					return E_INVALIDARG;
+				}
+
+				auto file = LIBMTP_Get_Filemetadata(device, handle->item);
+				if (!file) return GetLastError();
+				auto result = ToObjectProperties(*file);
+				LIBMTP_destroy_file_t(file);
+				return result;
+			}
+
+			ExpectedOrHResult<std::vector<ObjectID>> EnumerateContents(const ObjectID& id) override
+			{
+				std::lock_guard lock(mutex);
+				std::vector<ObjectID> results;
+				if (id == RootObjectID) {
+					for (auto storage = device->storage; storage; storage = storage->next)
+						results.push_back(MakeStorageID(storage->id));
+					return results;
+				}
+
+				auto handle = ParseObjectID(id);
+				if (!handle) return E_INVALIDARG;
+
+				auto files = GetFilesAndFolders(*handle);
+				if (!files) return files.GetResult();
+				auto file = *files;
+				while (file) {
+					results.push_back(MakeObjectID(file->storage_id, file->item_id));
+					auto next = file->next;
+					LIBMTP_destroy_file_t(file);
+					file = next;
+				}
+				return results;
+			}
+
+			ExpectedOrHResult<size_t> EnumerateContentsWithProperties(const ObjectID& id, ObjectInfoCallbackFn callback) override
+			{
+				if (id == RootObjectID) return Session::EnumerateContentsWithProperties(id, std::move(callback));
+
+				// Listing a folder already yields all metadata we need
+				std::vector<ObjectInfo> batch;
+				{
+					std::lock_guard lock(mutex);
+					auto handle = ParseObjectID(id);
+					if (!handle) return E_INVALIDARG;
+
+					auto files = GetFilesAndFolders(*handle);
+					if (!files) return files.GetResult();
+					auto file = *files;
+					while (file) {
+						batch.push_back({ MakeObjectID(file->storage_id, file->item_id), ToObjectProperties(*file) });
+						auto next = file->next;
+						LIBMTP_destroy_file_t(file);
+						file = next;
+					}
+				}
+				const auto numObjects = batch.size();
+				if (!batch.empty()) std::invoke(callback, batch);
+				return numObjects;
+			}
+
+			ExpectedOrHResult<uint64_t> ReadDataFrom(const ObjectID& id, uint64_t offset, ReadCallbackFn callback) override
+			{
+				if (offset == 0) return ReadData(id, std::move(callback));
+
+				// Requires the device to support GetPartialObject, which Android does
+				constexpr uint32_t CHUNK_SIZE = 1024 * 1024;
+				std::lock_guard lock(mutex);
+				auto handle = ParseObjectID(id);
+				if (!handle || handle->item == LIBMTP_FILES_AND_FOLDERS_ROOT) return E_INVALIDARG;
+
+				// Whole objects are read the way libmtp sees fit, but here we
+				// decide how much to ask for at once
+				uint64_t totalBytesRead{};
+				while (true) {
+					const auto readSize = static_cast<uint32_t>(readSizeTuner.GetReadSize(CHUNK_SIZE));
+					unsigned char* data{};
+					unsigned int length{};
+					const auto start = ReadSizeTuner::Clock::now();
+					if (LIBMTP_GetPartialObject(device, handle->item, offset + totalBytesRead, readSize, &data, &length) != 0) {
+						std::free(data);
+						const auto hr = GetLastError();
+						// Failing right away most likely means the device lacks
+						// partial reads; the caller can then start over
+						if (totalBytesRead == 0) return E_NOTIMPL;
+						return hr;
+					}
+					readSizeTuner.Record(readSize, length, ReadSizeTuner::Clock::now() - start);
+					totalBytesRead += length;
+					const auto proceed = length > 0 && std::invoke(callback, data, length);
+					std::free(data);
+					if (!proceed || length < readSize) break;
+				}
+				return totalBytesRead;
+			}
+
+			ExpectedOrHResult<uint64_t> ReadData(const ObjectID& id, ReadCallbackFn callback) override
+			{
+				std::lock_guard lock(mutex);
+				auto handle = ParseObjectID(id);
+				if (!handle || handle->item == LIBMTP_FILES_AND_FOLDERS_ROOT) return E_INVALIDARG;
+
+				struct Context {
+					ReadCallbackFn& callback;
+					uint64_t totalBytesRead{};
+					bool cancelled{};
+				} context{ callback };
+
+				auto put = [](void*, void* priv, uint32_t sendlen, unsigned char* data, uint32_t* putlen) -> uint16_t {
+					auto& context = *static_cast<Context*>(priv);
+					*putlen = sendlen;
+					context.totalBytesRead += sendlen;
+					if (!std::invoke(context.callback, data, sendlen)) {
+						context.cancelled = true;
+						return LIBMTP_HANDLER_RETURN_CANCEL;
+					}
+					return LIBMTP_HANDLER_RETURN_OK;
+				};
+				if (LIBMTP_Get_File_To_Handler(device, handle->item, put, &context, nullptr, nullptr) != 0) {
+					// A cancel from the callback is not an error, just like the WPD backend
+					const auto hr = GetLastError();
+					if (!context.cancelled) return hr;
+				}
+				return context.totalBytesRead;
+			}
+		};
+
+		class LibMtpBackend : public Backend
+		{
+			// Reading the serial number takes opening the device, so it is
+			// remembered for as long as the device stays connected
+			std::mutex mutex;
+			std::map<std::tuple<uint32_t, uint8_t, uint16_t, uint16_t>, std::string> serialNumbers;
+
+			// The device number changes whenever the device is connected again,
+			// such as after a reset, so the ID is made of what does not. If the
+			// device had to be opened to find out, it is handed out when asked
+			// for and released otherwise
+			std::optional<DeviceID> GetDeviceID(LIBMTP_raw_device_t& raw, LIBMTP_mtpdevice_t** opened = nullptr)
+			{
+				const auto& entry = raw.device_entry;
+				const auto connection = std::make_tuple(raw.bus_location, raw.devnum, entry.vendor_id, entry.product_id);
+				std::optional<std::string> serialNumber;
+				{
+					std::lock_guard lock(mutex);
+					if (auto it = serialNumbers.find(connection); it != serialNumbers.end()) serialNumber = it->second;
+				}
+				if (!serialNumber) {
+					auto device = LIBMTP_Open_Raw_Device_Uncached(&raw);
+					if (!device) return {};
+					serialNumber = TakeString(LIBMTP_Get_Serialnumber(device)).value_or(std::string());
+					if (opened)
+						*opened = device;
+					else
+						LIBMTP_Release_Device(device);
+					std::lock_guard lock(mutex);
+					serialNumbers[connection] = *serialNumber;
+				}
+
+				char id[32];
+				std::snprintf(id, sizeof(id), "%04x:%04x:", entry.vendor_id, entry.product_id);
+				// Without a serial number, the connection is all we have to
+				// tell identical devices apart
+				if (serialNumber->empty())
+					return std::string(BACKEND_NAME) + ':' + id + std::to_string(raw.bus_location) + '.' + std::to_string(raw.devnum);
+				return std::string(BACKEND_NAME) + ':' + id + *serialNumber;
+			}
+
+		public:
+			LibMtpBackend()
+			{
+				LIBMTP_Init();
+			}
+
+			const char* GetName() const override { return BACKEND_NAME; }
+
+			ExpectedOrHResult<std::vector<PortableDevice>> EnumeratePortableDevices() override
+			{
+				std::vector<PortableDevice> devices;
+				LIBMTP_raw_device_t* rawDevices{};
+				int numRawDevices{};
+				switch (LIBMTP_Detect_Raw_Devices(&rawDevices, &numRawDevices)) {
+					case LIBMTP_ERROR_NONE:
+						break;
+					case LIBMTP_ERROR_NO_DEVICE_ATTACHED:
+						return devices;
+					default:
+						return E_FAIL;
+				}
+
+				for (int n = 0; n < numRawDevices; ++n) {
+					auto& raw = rawDevices[n];
+					// Devices that cannot be opened cannot be backed up either
+					const auto id = GetDeviceID(raw);
+					if (!id) continue;
+					auto toOptional = [](const char* s) -> std::optional<std::string> {
+						if (s) return s;
+						return {};
+					};
+					devices.push_back({ *id, toOptional(raw.device_entry.product), toOptional(raw.device_entry.vendor), {} });
+				}
+				std::free(rawDevices);
+				return devices;
+			}
+
+			ExpectedOrHResult<SessionPtr> OpenDevice(const DeviceID& deviceId) override
+			{
+				LIBMTP_raw_device_t* rawDevices{};
+				int numRawDevices{};
+				if (LIBMTP_Detect_Raw_Devices(&rawDevices, &numRawDevices) != LIBMTP_ERROR_NONE) return E_FAIL;
+
+				LIBMTP_mtpdevice_t* device{};
+				for (int n = 0; n < numRawDevices && !device; ++n) {
+					LIBMTP_mtpdevice_t* opened{};
+					const auto id = GetDeviceID(rawDevices[n], &opened);
+					if (id != deviceId) {
+						if (opened) LIBMTP_Release_Device(opened);
+						continue;
+					}
+					device = opened ? opened : LIBMTP_Open_Raw_Device_Uncached(&rawDevices[n]);
+				}
+				std::free(rawDevices);
+				if (!device) return E_FAIL;
+
+				if (LIBMTP_Get_Storage(device, LIBMTP_STORAGE_SORTBY_NOTSORTED) != 0) {
+					LIBMTP_Release_Device(device);
+					return E_FAIL;
+				}
+				return SessionPtr(std::make_shared<LibMtpSession>(device));
+			}
+		};
+	}
+
+	std::unique_ptr<Backend> CreateLibMtpBackend()
+	{
+		return std::make_unique<LibMtpBackend>();
+	}
+}
+#endif
@@ -0,0 +1,607 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#include "MTPBackend.h"
+#include "BufferPool.h"
+#include "ReadSizeTuner.h"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <thread>
+
+namespace mtp
+{
+	namespace
+	{
+		constexpr auto BACKEND_NAME = "sim";
+
+		std::filesystem::path FromUtf8(const std::string& s)
+		{
+			return std::filesystem::path(std::u8string(s.begin(), s.end()));
+		}
+
+		// Object IDs are the path relative to the device root, so they remain
+		// stable across runs just like the MTP persistent IDs would. Both are
+		// in the native form of paths, so no conversion is needed
+		std::filesystem::path ToPath(const std::filesystem::path& root, const ObjectID& id)
+		{
+			if (id == RootObjectID) return root;
+			return root / id.Native();
+		}
+
+		ObjectID ToObjectID(const std::filesystem::path& root, const std::filesystem::path& path)
+		{
+			return ObjectID(path.lexically_relative(root).generic_string<NativeChar>());
+		}
+
+		std::string ToUtf8(const std::filesystem::path& path)
+		{
+			auto u8 = path.generic_u8string();
+			return std::string(u8.begin(), u8.end());
+		}
+
+		int64_t ToUnixTime(std::filesystem::file_time_type time)
+		{
+#ifdef __GLIBCXX__
+			const auto sysTime = std::chrono::file_clock::to_sys(time);
+#else
+			const auto sysTime = std::chrono::clock_cast<std::chrono::system_clock>(time);
+#endif
+			return std::chrono::duration_cast<std::chrono::seconds>(sysTime.time_since_epoch()).count();
+		}
+
+		GUID GuessFormat(const std::filesystem::path& path)
+		{
+			static const std::map<std::string, std::uint16_t> formats{
+				{ ".txt", 0x3004 }, { ".htm", 0x3005 }, { ".html", 0x3005 }, { ".wav", 0x3008 },
+				{ ".mp3", 0x3009 }, { ".avi", 0x300A }, { ".mpg", 0x300B }, { ".asf", 0x300C },
+				{ ".jpg", 0x3801 }, { ".jpeg", 0x3801 }, { ".bmp", 0x3804 }, { ".gif", 0x3807 },
+				{ ".png", 0x380B }, { ".tif", 0x380D }, { ".tiff", 0x380D }, { ".wma", 0xB901 },
+				{ ".ogg", 0xB902 }, { ".aac", 0xB903 }, { ".flac", 0xB906 }, { ".wmv", 0xB981 },
+				{ ".mp4", 0xB982 }, { ".3gp", 0xB984 }, { ".heic", 0xB883 },
+			};
+			auto extension = ToUtf8(path.extension());
+			std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char ch) { return std::tolower(ch); });
+			if (auto it = formats.find(extension); it != formats.end()) return MakeFormat(it->second);
+			return MakeFormat(0x3000); // undefined
+		}
+
+		using Clock = std::chrono::steady_clock;
+
+		// Does not hand out data before the link could have delivered it, given
+		// when the reads started and the round trips made since
+		void WaitForLink(const SimulatedDeviceOptions& options, Clock::time_point start, Clock::duration roundTrips, uint64_t totalBytes)
+		{
+			if (options.bandwidth == 0 && options.latency.count() == 0) return;
+			const auto due = start + roundTrips + std::chrono::duration_cast<Clock::duration>(
+				std::chrono::duration<double>(options.bandwidth > 0 ? static_cast<double>(totalBytes) / options.bandwidth : 0.0));
+			std::this_thread::sleep_until(due);
+		}
+
+		class SimulatedSession : public Session
+		{
+			const std::filesystem::path root;
+			const SimulatedDeviceOptions options;
+			ReadSizeTuner readSizeTuner;
+			std::mutex randomMutex;
+			std::minstd_rand random;
+
+			void SimulateLatency() const
+			{
+				if (options.latency.count() > 0) std::this_thread::sleep_for(options.latency);
+			}
+
+			bool ShouldFail()
+			{
+				if (options.failureRate <= 0) return false;
+				std::lock_guard lock(randomMutex);
+				return std::uniform_real_distribution<double>{}(random) < options.failureRate;
+			}
+
+			ExpectedOrHResult<ObjectProperties> GetProperties(const ObjectID& id) const
+			{
+				std::error_code ec;
+				const auto path = ToPath(root, id);
+				const auto status = std::filesystem::status(path, ec);
+				if (ec) return E_INVALIDARG;
+
+				ObjectProperties result;
+				if (id == RootObjectID) {
+					result.name = ToUtf8(root.filename());
+					result.contentType = WPD_CONTENT_TYPE_FUNCTIONAL_OBJECT;
+					return result;
+				}
+
+				result.name = ToUtf8(path.filename());
+				result.fileName = result.name;
+				result.persistentId = id.ToUtf8();
+				if (const auto modified = std::filesystem::last_write_time(path, ec); !ec)
+					result.modified = ToUnixTime(modified);
+				if (std::filesystem::is_directory(status)) {
+					result.contentType = WPD_CONTENT_TYPE_FOLDER;
+					result.format = MakeFormat(0x3001); // association
+				} else {
+					result.contentType = WPD_CONTENT_TYPE_GENERIC_FILE;
+					result.format = GuessFormat(path);
+					const auto size = std::filesystem::file_size(path, ec);
+					if (!ec) result.size = size;
+				}
+				return result;
+			}
+
+			ExpectedOrHResult<std::vector<ObjectID>> GetContents(const ObjectID& id) const
+			{
+				std::error_code ec;
+				std::filesystem::directory_iterator it(ToPath(root, id), ec);
+				if (ec) return E_INVALIDARG;
+
+				std::vector<ObjectID> results;
+				for (; it != std::filesystem::directory_iterator(); it.increment(ec)) {
+					if (ec) return E_FAIL;
+					results.push_back(ToObjectID(root, it->path()));
+				}
+				// Keep the order stable, the filesystem does not guarantee any
+				std::sort(results.begin(), results.end(), [](const auto& a, const auto& b) { return a.Native() < b.Native(); });
+				return results;
+			}
+
+		public:
+			SimulatedSession(std::filesystem::path root, const SimulatedDeviceOptions& options)
+				: root(std::move(root)), options(options)
+			{
+			}
+
+			ExpectedOrHResult<ObjectProperties> ReadProperties(const ObjectID& id) override
+			{
+				SimulateLatency();
+				return GetProperties(id);
+			}
+
+			ExpectedOrHResult<std::vector<ObjectID>> EnumerateContents(const ObjectID& id) override
+			{
+				SimulateLatency();
+				return GetContents(id);
+			}
+
+			ExpectedOrHResult<size_t> EnumerateContentsWithProperties(const ObjectID& id, ObjectInfoCallbackFn callback) override
+			{
+				// Like a real bulk request, this is one round trip per batch
+				constexpr size_t BATCH_SIZE = 256;
+
+				SimulateLatency();
+				auto contents = GetContents(id);
+				if (!contents) return contents.GetResult();
+
+				size_t numObjects{};
+				std::vector<ObjectInfo> batch;
+				for (auto& objectId : *contents) {
+					auto props = GetProperties(objectId);
+					if (!props) continue;
+					batch.push_back({ std::move(objectId), std::move(*props) });
+					++numObjects;
+					if (batch.size() == BATCH_SIZE) {
+						if (!std::invoke(callback, batch)) return numObjects;
+						batch.clear();
+						SimulateLatency();
+					}
+				}
+				if (!batch.empty()) std::invoke(callback, batch);
+				return numObjects;
+			}
+
+			ExpectedOrHResult<ObjectID> FindByPersistentId(const std::string& persistentId) override
+			{
+				// Our persistent IDs are the object IDs
+				SimulateLatency();
+				std::error_code ec;
+				const auto id = ObjectID::FromUtf8(persistentId);
+				if (id.empty() || id == RootObjectID || !std::filesystem::exists(ToPath(root, id), ec)) return E_INVALIDARG;
+				return id;
+			}
+
+			ExpectedOrHResult<uint64_t> ReadData(const ObjectID& id, ReadCallbackFn callback) override
+			{
+				return ReadDataFrom(id, 0, std::move(callback));
+			}
+
+			ExpectedOrHResult<uint64_t> ReadDataFrom(const ObjectID& id, uint64_t offset, ReadCallbackFn callback) override
+			{
+				SimulateLatency();
+
+				std::ifstream ifs(ToPath(root, id), std::ifstream::in | std::ifstream::binary);
+				if (!ifs) return E_INVALIDARG;
+				if (offset > 0 && !ifs.seekg(offset)) return E_INVALIDARG;
+
+				const auto start = Clock::now();
+
+				const auto fail = ShouldFail();
+				uint64_t totalBytesRead{};
+				auto buffer = BufferPool::Get().Acquire(readSizeTuner.GetMaxReadSize(options.transferSize));
+				// Every read is a round trip to the device, on top of the time it
+				// takes to transfer the data
+				Clock::duration roundTrips{};
+				while (true) {
+					const auto readSize = readSizeTuner.GetReadSize(options.transferSize);
+					const auto readStart = Clock::now();
+					ifs.read(buffer.get(), readSize);
+					const auto bytesRead = static_cast<size_t>(ifs.gcount());
+					if (bytesRead == 0) {
+						if (ifs.bad()) return E_FAIL;
+						break;
+					}
+
+					totalBytesRead += bytesRead;
+					roundTrips += options.latency;
+					WaitForLink(options, start, roundTrips, totalBytesRead);
+					readSizeTuner.Record(readSize, bytesRead, Clock::now() - readStart);
+					if (!std::invoke(callback, buffer.get(), bytesRead)) break;
+					if (fail) return HRESULT_FROM_WIN32(ERROR_SEM_TIMEOUT);
+				}
+				return totalBytesRead;
+			}
+		};
+
+		constexpr int64_t SYNTHETIC_MODIFIED = 1640995200; // 2022-01-01
+		constexpr size_t SYNTHETIC_PATTERN_SIZE = 1024 * 1024;
+
+		std::string FormatNumber(size_t n, int width)
+		{
+			char s[32];
+			std::snprintf(s, sizeof(s), "%0*zu", width, n);
+			return s;
+		}
+
+		// Laid out breadth first, so that the children of a folder are
+		// consecutive. Nodes are kept small as there may be millions of them;
+		// file names are put together when asked for
+		struct SyntheticDevice
+		{
+			static constexpr uint32_t NO_NODE = UINT32_MAX;
+
+			struct Node
+			{
+				uint32_t parent;
+				uint32_t firstChild;
+				uint32_t numChildren;
+				uint32_t name; // in folderNames for folders, the file number otherwise
+				uint16_t entry; // in files
+				bool isFolder;
+			};
+
+			std::vector<SyntheticFiles> files;
+			std::vector<Node> nodes;
+			std::vector<std::string> folderNames;
+			// Handed out as the contents of every file, with room for a
+			// transfer at any offset
+			std::vector<char> pattern;
+
+			std::string GetName(const Node& node) const
+			{
+				if (node.isFolder) return folderNames[node.name];
+				return FormatNumber(node.name, 6) + files[node.entry].extension;
+			}
+		};
+
+		struct PendingFolder
+		{
+			struct Run
+			{
+				uint16_t entry;
+				size_t first;
+				size_t count;
+			};
+
+			std::map<std::string, std::unique_ptr<PendingFolder>> subfolders;
+			std::vector<Run> runs;
+
+			PendingFolder& GetSubfolder(const std::string& name)
+			{
+				auto& subfolder = subfolders[name];
+				if (!subfolder) subfolder = std::make_unique<PendingFolder>();
+				return *subfolder;
+			}
+		};
+
+		std::shared_ptr<const SyntheticDevice> CreateSyntheticDevice(const std::vector<SyntheticFiles>& files, size_t transferSize)
+		{
+			if (files.size() > UINT16_MAX) return {};
+
+			PendingFolder root;
+			uint64_t numNodes = 1;
+			for (size_t entry = 0; entry < files.size(); ++entry) {
+				const auto& f = files[entry];
+				auto folder = &root;
+				std::string_view remaining(f.path);
+				while (!remaining.empty()) {
+					const auto sep = remaining.find('/');
+					const auto piece = std::string(remaining.substr(0, sep));
+					remaining = sep == std::string_view::npos ? std::string_view{} : remaining.substr(sep + 1);
+					if (piece.empty()) continue;
+					folder = &folder->GetSubfolder(piece);
+					++numNodes;
+				}
+				// Files must be in a storage
+				if (folder == &root) return {};
+
+				if (f.filesPerFolder == 0) {
+					folder->runs.push_back({ static_cast<uint16_t>(entry), 0, f.numFiles });
+				} else {
+					for (size_t first = 0; first < f.numFiles; first += f.filesPerFolder) {
+						auto& subfolder = folder->GetSubfolder(FormatNumber(first / f.filesPerFolder, 4));
+						subfolder.runs.push_back({ static_cast<uint16_t>(entry), first, std::min(f.filesPerFolder, f.numFiles - first) });
+						++numNodes;
+					}
+				}
+				numNodes += f.numFiles;
+			}
+			if (numNodes >= SyntheticDevice::NO_NODE) return {};
+
+			auto device = std::make_shared<SyntheticDevice>();
+			device->files = files;
+			device->nodes.reserve(static_cast<size_t>(numNodes));
+			device->folderNames.push_back("Synthetic");
+			device->nodes.push_back({ SyntheticDevice::NO_NODE, 0, 0, 0, 0, true });
+
+			std::deque<std::pair<const PendingFolder*, uint32_t>> queue{ { &root, 0 } };
+			while (!queue.empty()) {
+				const auto [folder, index] = queue.front();
+				queue.pop_front();
+
+				const auto firstChild = static_cast<uint32_t>(device->nodes.size());
+				for (const auto& [name, subfolder] : folder->subfolders) {
+					queue.emplace_back(subfolder.get(), static_cast<uint32_t>(device->nodes.size()));
+					device->nodes.push_back({ index, 0, 0, static_cast<uint32_t>(device->folderNames.size()), 0, true });
+					device->folderNames.push_back(name);
+				}
+				for (const auto& run : folder->runs) {
+					for (size_t n = 0; n < run.count; ++n)
+						device->nodes.push_back({ index, 0, 0, static_cast<uint32_t>(run.first + n), run.entry, false });
+				}
+				device->nodes[index].firstChild = firstChild;
+				device->nodes[index].numChildren = static_cast<uint32_t>(device->nodes.size()) - firstChild;
+			}
+
+			device->pattern.resize(SYNTHETIC_PATTERN_SIZE + transferSize);
+			std::minstd_rand random;
+			for (auto& ch : device->pattern)
+				ch = static_cast<char>(random());
+			return device;
+		}
+
+		class SyntheticSession : public Session
+		{
+			const std::shared_ptr<const SyntheticDevice> device;
+			const SimulatedDeviceOptions options;
+
+			void SimulateLatency() const
+			{
+				if (options.latency.count() > 0) std::this_thread::sleep_for(options.latency);
+			}
+
+			// Object IDs are the node numbers, which are the persistent IDs too
+			std::optional<uint32_t> ToIndex(const ObjectID& id) const
+			{
+				if (id == RootObjectID) return 0;
+				const auto s = id.ToUtf8();
+				uint32_t index{};
+				const auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), index);
+				if (ec != std::errc{} || end != s.data() + s.size() || index == 0 || index >= device->nodes.size()) return {};
+				return index;
+			}
+
+			static ObjectID ToObjectID(uint32_t index)
+			{
+				if (index == 0) return RootObjectID;
+				return ObjectID::FromUtf8(std::to_string(index));
+			}
+
+			ObjectProperties GetProperties(uint32_t index) const
+			{
+				const auto& node = device->nodes[index];
+				ObjectProperties result;
+				result.name = device->GetName(node);
+				if (index == 0) {
+					result.contentType = WPD_CONTENT_TYPE_FUNCTIONAL_OBJECT;
+					return result;
+				}
+
+				result.fileName = result.name;
+				result.persistentId = std::to_string(index);
+				result.modified = SYNTHETIC_MODIFIED;
+				if (node.isFolder) {
+					result.contentType = WPD_CONTENT_TYPE_FOLDER;
+					result.format = MakeFormat(0x3001); // association
+				} else {
+					result.contentType = WPD_CONTENT_TYPE_GENERIC_FILE;
+					result.format = GuessFormat(FromUtf8(*result.name));
+					result.size = device->files[node.entry].size;
+				}
+				return result;
+			}
+
+		public:
+			SyntheticSession(std::shared_ptr<const SyntheticDevice> device, const SimulatedDeviceOptions& options)
+				: device(std::move(device)), options(options)
+			{
+			}
+
+			ExpectedOrHResult<ObjectProperties> ReadProperties(const ObjectID& id) override
+			{
+				SimulateLatency();
+				const auto index = ToIndex(id);
+				if (!index) return E_INVALIDARG;
+				return GetProperties(*index);
+			}
+
+			ExpectedOrHResult<std::vector<ObjectID>> EnumerateContents(const ObjectID& id) override
+			{
+				SimulateLatency();
+				const auto index = ToIndex(id);
+				if (!index) return E_INVALIDARG;
+
+				const auto& node = device->nodes[*index];
+				std::vector<ObjectID> results;
+				results.reserve(node.numChildren);
+				for (uint32_t n = 0; n < node.numChildren; ++n)
+					results.push_back(ToObjectID(node.firstChild + n));
+				return results;
+			}
+
+			ExpectedOrHResult<size_t> EnumerateContentsWithProperties(const ObjectID& id, ObjectInfoCallbackFn callback) override
+			{
+				// Batched like SimulatedSession
+				constexpr size_t BATCH_SIZE = 256;
+
+				SimulateLatency();
+				const auto index = ToIndex(id);
+				if (!index) return E_INVALIDARG;
+
+				const auto& node = device->nodes[*index];
+				std::vector<ObjectInfo> batch;
+				for (uint32_t n = 0; n < node.numChildren; ++n) {
+					const auto child = node.firstChild + n;
+					batch.push_back({ ToObjectID(child), GetProperties(child) });
+					if (batch.size() == BATCH_SIZE) {
+						if (!std::invoke(callback, batch)) return static_cast<size_t>(n + 1);
+						batch.clear();
+						SimulateLatency();
+					}
+				}
+				if (!batch.empty()) std::invoke(callback, batch);
+				return static_cast<size_t>(node.numChildren);
+			}
+
+			ExpectedOrHResult<ObjectID> FindByPersistentId(const std::string& persistentId) override
+			{
+				SimulateLatency();
+				const auto id = ObjectID::FromUtf8(persistentId);
+				if (id.empty() || id == RootObjectID || !ToIndex(id)) return E_INVALIDARG;
+				return id;
+			}
+
+			ExpectedOrHResult<uint64_t> ReadData(const ObjectID& id, ReadCallbackFn callback) override
+			{
+				return ReadDataFrom(id, 0, std::move(callback));
+			}
+
+			ExpectedOrHResult<uint64_t> ReadDataFrom(const ObjectID& id, uint64_t offset, ReadCallbackFn callback) override
+			{
+				SimulateLatency();
+				const auto index = ToIndex(id);
+				if (!index || device->nodes[*index].isFolder) return E_INVALIDARG;
+
+				const auto& node = device->nodes[*index];
+				const auto size = device->files[node.entry].size;
+				if (offset > size) return E_INVALIDARG;
+
+				const auto start = Clock::now();
+				uint64_t totalBytesRead{};
+				Clock::duration roundTrips{};
+				for (auto position = offset; position < size; ) {
+					const auto readSize = static_cast<size_t>(std::min<uint64_t>(options.transferSize, size - position));
+					// Files start at different points of the pattern, so they differ
+					const auto patternOffset = static_cast<size_t>((position + *index * 4099ull) % SYNTHETIC_PATTERN_SIZE);
+					position += readSize;
+					totalBytesRead += readSize;
+					roundTrips += options.latency;
+					WaitForLink(options, start, roundTrips, totalBytesRead);
+					if (!std::invoke(callback, device->pattern.data() + patternOffset, readSize)) break;
+				}
+				return totalBytesRead;
+			}
+
+			ExpectedOrHResult<SessionPtr> OpenAnother() override
+			{
+				return SessionPtr(std::make_shared<SyntheticSession>(device, options));
+			}
+		};
+
+		SimulatedDeviceOptions GetDefaultOptions()
+		{
+			SimulatedDeviceOptions options;
+			if (const auto latency = std::getenv("REPLICANDROID_SIMULATED_LATENCY_US"); latency)
+				options.latency = std::chrono::microseconds(std::strtoull(latency, nullptr, 10));
+			if (const auto bandwidth = std::getenv("REPLICANDROID_SIMULATED_BANDWIDTH"); bandwidth)
+				options.bandwidth = std::strtoull(bandwidth, nullptr, 10);
+			if (const auto failureRate = std::getenv("REPLICANDROID_SIMULATED_FAILURE_RATE"); failureRate)
+				options.failureRate = std::strtod(failureRate, nullptr);
+			return options;
+		}
+
+		class SimulatedBackend : public Backend
+		{
+		public:
+			const char* GetName() const override { return BACKEND_NAME; }
+
+			ExpectedOrHResult<std::vector<PortableDevice>> EnumeratePortableDevices() override
+			{
+				std::vector<PortableDevice> devices;
+				const auto roots = std::getenv("REPLICANDROID_SIMULATED_DEVICES");
+				if (!roots) return devices;
+
+				std::string_view remaining(roots);
+				while (!remaining.empty()) {
+					const auto sep = remaining.find(';');
+					const auto root = std::string(remaining.substr(0, sep));
+					remaining = sep == std::string_view::npos ? std::string_view{} : remaining.substr(sep + 1);
+					if (root.empty()) continue;
+
+					devices.push_back({ std::string(BACKEND_NAME) + ':' + root, root, "ReplicAndroid", "Simulated device" });
+				}
+				return devices;
+			}
+
+			ExpectedOrHResult<SessionPtr> OpenDevice(const DeviceID& deviceId) override
+			{
+				const auto root = deviceId.substr(std::strlen(BACKEND_NAME) + 1);
+				return OpenSimulatedDevice(FromUtf8(root), GetDefaultOptions());
+			}
+		};
+	}
+
+	std::unique_ptr<Backend> CreateSimulatedBackend()
+	{
+		return std::make_unique<SimulatedBackend>();
+	}
+
+	ExpectedOrHResult<SessionPtr> OpenSimulatedDevice(const std::filesystem::path& root, const SimulatedDeviceOptions& options)
+	{
+		std::error_code ec;
+		if (!std::filesystem::is_directory(root, ec)) return E_INVALIDARG;
+		return SessionPtr(std::make_shared<SimulatedSession>(root, options));
+	}
+
+	ExpectedOrHResult<SessionPtr> OpenSyntheticDevice(const std::vector<SyntheticFiles>& files, const SimulatedDeviceOptions& options)
+	{
+		auto device = CreateSyntheticDevice(files, options.transferSize);
+		if (!device) return E_INVALIDARG;
+		return SessionPtr(std::make_shared<SyntheticSession>(std::move(device), options));
+	}
+
+	std::vector<std::string> GetSyntheticPath(const SyntheticFiles& files, size_t n)
+	{
+		std::vector<std::string> path;
+		std::string_view remaining(files.path);
+		while (!remaining.empty()) {
+			const auto sep = remaining.find('/');
+			if (sep != 0) path.emplace_back(remaining.substr(0, sep));
+			remaining = sep == std::string_view::npos ? std::string_view{} : remaining.substr(sep + 1);
+		}
+		if (files.filesPerFolder > 0) path.push_back(FormatNumber(n / files.filesPerFolder, 4));
+		path.push_back(FormatNumber(n, 6) + files.extension);
+		return path;
+	}
+}
@@ -0,0 +1,103 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#include "MTPBackend.h"
+#include "Trace.h"
+
+namespace mtp
+{
+	namespace
+	{
+		class InstrumentedSession : public Session
+		{
+			SessionPtr session;
+
+		public:
+			InstrumentedSession(SessionPtr session) : session(std::move(session)) { }
+
+			ExpectedOrHResult<ObjectProperties> ReadProperties(const ObjectID& id) override
+			{
+				trace::Span span(trace::Operation::ReadProperties);
+				return session->ReadProperties(id);
+			}
+
+			ExpectedOrHResult<std::vector<ObjectID>> EnumerateContents(const ObjectID& id) override
+			{
+				trace::Span span(trace::Operation::EnumerateContents);
+				return session->EnumerateContents(id);
+			}
+
+			ExpectedOrHResult<size_t> EnumerateContentsWithProperties(const ObjectID& id, ObjectInfoCallbackFn callback) override
+			{
+				// Only the time spent waiting for the device counts, not the
+				// time the caller spends on every batch
+				auto start = trace::Clock::now();
+				auto result = session->EnumerateContentsWithProperties(id, [&](auto& batch) {
+					trace::Record(trace::Operation::EnumerateContentsWithProperties, start);
+					const auto proceed = std::invoke(callback, batch);
+					start = trace::Clock::now();
+					return proceed;
+				});
+				trace::Record(trace::Operation::EnumerateContentsWithProperties, start);
+				return result;
+			}
+
+			ExpectedOrHResult<uint64_t> ReadData(const ObjectID& id, ReadCallbackFn callback) override
+			{
+				return ReadDataFrom(id, 0, std::move(callback));
+			}
+
+			// The first chunk tells how long it takes to set up a transfer; the
+			// others how fast the device delivers data
+			ExpectedOrHResult<uint64_t> ReadDataFrom(const ObjectID& id, uint64_t offset, ReadCallbackFn callback) override
+			{
+				auto operation = trace::Operation::ReadDataFirstChunk;
+				auto start = trace::Clock::now();
+				return session->ReadDataFrom(id, offset, [&](const void* data, size_t length) {
+					trace::Record(operation, start, length);
+					const auto proceed = std::invoke(callback, data, length);
+					operation = trace::Operation::ReadDataChunk;
+					start = trace::Clock::now();
+					return proceed;
+				});
+			}
+
+			ExpectedOrHResult<ObjectID> FindByPersistentId(const std::string& persistentId) override
+			{
+				trace::Span span(trace::Operation::FindByPersistentId);
+				return session->FindByPersistentId(persistentId);
+			}
+
+			void Invalidate(const ObjectID& id) override
+			{
+				session->Invalidate(id);
+			}
+
+			void InvalidateAll() override
+			{
+				session->InvalidateAll();
+			}
+
+			HRESULT Reopen() override
+			{
+				trace::Span span(trace::Operation::Reopen);
+				return session->Reopen();
+			}
+
+			ExpectedOrHResult<SessionPtr> OpenAnother() override
+			{
+				auto other = session->OpenAnother();
+				if (!other) return other.GetResult();
+				return CreateInstrumentedSession(std::move(*other));
+			}
+		};
+	}
+
+	SessionPtr CreateInstrumentedSession(SessionPtr session)
+	{
+		return std::make_shared<InstrumentedSession>(std::move(session));
+	}
+}
@@ -0,0 +1,477 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#ifdef _WIN32
+#include "MTPBackend.h"
+#include "BufferPool.h"
+#include "ReadSizeTuner.h"
+#include "Unicode.h"
+
+#include <atlbase.h>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <unordered_set>
+#include "portabledeviceapi.h"
+#include "portabledevice.h"
+
+namespace mtp
+{
+	namespace
+	{
+		constexpr auto BACKEND_NAME = "wpd";
+		constexpr auto CLIENT_NAME = L"ReplicAndroid";
+		constexpr auto CLIENT_MAJOR_VER = 1;
+		constexpr auto CLIENT_MINOR_VER = 0;
+		constexpr auto CLIENT_REVISION = 0;
+
+		ExpectedOrHResult<CComPtr<IPortableDeviceValues>> GetClientInformation()
+		{
+			CComPtr<IPortableDeviceValues> clientInformation;
+
+			if (const auto hr = clientInformation.CoCreateInstance(CLSID_PortableDeviceValues, NULL, CLSCTX_INPROC_SERVER); FAILED(hr)) return hr;
+			if (const auto hr = clientInformation->SetStringValue(WPD_CLIENT_NAME, CLIENT_NAME); FAILED(hr)) return hr;
+			if (const auto hr = clientInformation->SetUnsignedIntegerValue(WPD_CLIENT_MAJOR_VERSION, CLIENT_MAJOR_VER); FAILED(hr)) return hr;
+			if (const auto hr = clientInformation->SetUnsignedIntegerValue(WPD_CLIENT_MINOR_VERSION, CLIENT_MINOR_VER); FAILED(hr)) return hr;
+			if (const auto hr = clientInformation->SetUnsignedIntegerValue(WPD_CLIENT_REVISION, CLIENT_REVISION); FAILED(hr)) return hr;
+			if (const auto hr = clientInformation->SetUnsignedIntegerValue(WPD_CLIENT_SECURITY_QUALITY_OF_SERVICE, SECURITY_IMPERSONATION); FAILED(hr)) return hr;
+
+			return clientInformation;
+		}
+
+		ExpectedOrHResult<CComPtr<IPortableDeviceKeyCollection>> CreatePropertyKeys()
+		{
+			CComPtr<IPortableDeviceKeyCollection> propsToRead;
+			if (const auto hr = propsToRead.CoCreateInstance(CLSID_PortableDeviceKeyCollection, NULL, CLSCTX_INPROC_SERVER); FAILED(hr)) return hr;
+
+			if (const auto hr = propsToRead->Add(WPD_OBJECT_PARENT_ID); FAILED(hr)) return hr;
+			if (const auto hr = propsToRead->Add(WPD_OBJECT_NAME); FAILED(hr)) return hr;
+			if (const auto hr = propsToRead->Add(WPD_OBJECT_PERSISTENT_UNIQUE_ID); FAILED(hr)) return hr;
+			if (const auto hr = propsToRead->Add(WPD_OBJECT_FORMAT); FAILED(hr)) return hr;
+			if (const auto hr = propsToRead->Add(WPD_OBJECT_CONTENT_TYPE); FAILED(hr)) return hr;
+			if (const auto hr = propsToRead->Add(WPD_OBJECT_ORIGINAL_FILE_NAME); FAILED(hr)) return hr;
+			if (const auto hr = propsToRead->Add(WPD_OBJECT_SIZE); FAILED(hr)) return hr;
+			if (const auto hr = propsToRead->Add(WPD_OBJECT_DATE_MODIFIED); FAILED(hr)) return hr;
+
+			return propsToRead;
+		}
+
+		ObjectProperties ToObjectProperties(IPortableDeviceValues* objectProperties)
+		{
+			auto getString = [&](const PROPERTYKEY& key, auto& result) {
+				PWSTR strValue;
+				if (const auto hr = objectProperties->GetStringValue(key, &strValue); SUCCEEDED(hr)) {
+					result = unicode::ToUtf8(strValue);
+					CoTaskMemFree(strValue);
+				}
+			};
+
+			// Sizes are 64-bit, unlike what GetUnsignedIntegerValue() yields
+			auto getLongLong = [&](const PROPERTYKEY& key, auto& result) {
+				ULONGLONG value;
+				if (const auto hr = objectProperties->GetUnsignedLargeIntegerValue(key, &value); SUCCEEDED(hr)) {
+					result = value;
+				}
+			};
+
+			auto getGuid = [&](const PROPERTYKEY& key, auto& result) {
+				GUID guid;
+				if (const auto hr = objectProperties->GetGuidValue(key, &guid); SUCCEEDED(hr)) {
+					result = guid;
+				}
+			};
+
+			auto getDate = [&](const PROPERTYKEY& key, auto& result) {
+				PROPVARIANT value;
+				PropVariantInit(&value);
+				if (const auto hr = objectProperties->GetValue(key, &value); SUCCEEDED(hr) && value.vt == VT_DATE) {
+					// OLE dates count days since 1899-12-30
+					constexpr auto OLE_DATE_UNIX_EPOCH = 25569.0;
+					result = static_cast<int64_t>((value.date - OLE_DATE_UNIX_EPOCH) * 86400.0);
+				}
+				PropVariantClear(&value);
+			};
+
+			ObjectProperties result;
+			getString(WPD_OBJECT_NAME, result.name);
+			getString(WPD_OBJECT_ORIGINAL_FILE_NAME, result.fileName);
+			getGuid(WPD_OBJECT_CONTENT_TYPE, result.contentType);
+			getGuid(WPD_OBJECT_FORMAT, result.format);
+			getLongLong(WPD_OBJECT_SIZE, result.size);
+			getString(WPD_OBJECT_PERSISTENT_UNIQUE_ID, result.persistentId);
+			getDate(WPD_OBJECT_DATE_MODIFIED, result.modified);
+			return result;
+		}
+
+		// Invokes the callback with the ID of every child of an object; the
+		// callback takes ownership of the string
+		template<typename Fn> HRESULT ForEachObjectID(IPortableDeviceContent* content, const ObjectID& id, Fn callback)
+		{
+			CComPtr<IEnumPortableDeviceObjectIDs> enumObjectIDs;
+			auto hr = content->EnumObjects(0, id.c_str(), nullptr, &enumObjectIDs);
+			if (FAILED(hr)) return hr;
+
+			while (hr == S_OK) {
+				constexpr auto NUM_OBJECTS_TO_REQUEST = 10;
+				PWSTR objectIDs[NUM_OBJECTS_TO_REQUEST];
+				DWORD numIds{};
+				hr = enumObjectIDs->Next(NUM_OBJECTS_TO_REQUEST, objectIDs, &numIds);
+				if (FAILED(hr)) break;
+
+				for (DWORD n = 0; n < numIds; ++n) {
+					std::invoke(callback, objectIDs[n]);
+				}
+			}
+			return S_OK;
+		}
+
+		// Receives the results of a bulk property request, which the driver
+		// delivers on a thread of its own
+		class BulkPropertiesCallback : public IPortableDevicePropertiesBulkCallback
+		{
+			LONG refCount{ 1 };
+			std::mutex mutex;
+			std::condition_variable cv;
+			std::deque<std::vector<ObjectInfo>> batches;
+			bool done{};
+			HRESULT status{ S_OK };
+
+		public:
+			BulkPropertiesCallback() = default;
+			virtual ~BulkPropertiesCallback() = default;
+
+			// Returns the next batch, or nothing once the request is complete
+			std::optional<std::vector<ObjectInfo>> WaitForBatch()
+			{
+				std::unique_lock lock(mutex);
+				cv.wait(lock, [&] { return done || !batches.empty(); });
+				if (batches.empty()) return {};
+				auto batch = std::move(batches.front());
+				batches.pop_front();
+				return batch;
+			}
+
+			void WaitForEnd()
+			{
+				std::unique_lock lock(mutex);
+				cv.wait(lock, [&] { return done; });
+			}
+
+			HRESULT GetStatus()
+			{
+				std::lock_guard lock(mutex);
+				return status;
+			}
+
+			HRESULT __stdcall QueryInterface(REFIID riid, void** ppv) override
+			{
+				if (!ppv) return E_POINTER;
+				if (riid == IID_IUnknown || riid == IID_IPortableDevicePropertiesBulkCallback) {
+					*ppv = static_cast<IPortableDevicePropertiesBulkCallback*>(this);
+					AddRef();
+					return S_OK;
+				}
+				*ppv = nullptr;
+				return E_NOINTERFACE;
+			}
+
+			ULONG __stdcall AddRef() override
+			{
+				return InterlockedIncrement(&refCount);
+			}
+
+			ULONG __stdcall Release() override
+			{
+				const auto result = InterlockedDecrement(&refCount);
+				if (result == 0) delete this;
+				return result;
+			}
+
+			HRESULT __stdcall OnStart(REFGUID) override
+			{
+				return S_OK;
+			}
+
+			HRESULT __stdcall OnProgress(REFGUID, IPortableDeviceValuesCollection* values) override
+			{
+				DWORD numValues{};
+				if (const auto hr = values->GetCount(&numValues); FAILED(hr)) return hr;
+
+				std::vector<ObjectInfo> batch;
+				batch.reserve(numValues);
+				for (DWORD n = 0; n < numValues; ++n) {
+					CComPtr<IPortableDeviceValues> objectProperties;
+					if (FAILED(values->GetAt(n, &objectProperties))) continue;
+
+					PWSTR objectID;
+					if (FAILED(objectProperties->GetStringValue(WPD_OBJECT_ID, &objectID))) continue;
+					batch.push_back({ ObjectID(objectID), ToObjectProperties(objectProperties) });
+					CoTaskMemFree(objectID);
+				}
+
+				std::lock_guard lock(mutex);
+				batches.push_back(std::move(batch));
+				cv.notify_all();
+				return S_OK;
+			}
+
+			HRESULT __stdcall OnEnd(REFGUID, HRESULT hrStatus) override
+			{
+				std::lock_guard lock(mutex);
+				status = hrStatus;
+				done = true;
+				cv.notify_all();
+				return S_OK;
+			}
+		};
+
+		class WpdSession : public Session
+		{
+			// Everything we need from the device is acquired once and reused for
+			// every call; this saves several COM calls per object
+			CComPtr<IPortableDevice> device;
+			CComPtr<IPortableDeviceContent> content;
+			CComPtr<IPortableDeviceProperties> properties;
+			CComPtr<IPortableDevicePropertiesBulk> bulkProperties; // optional
+			CComPtr<IPortableDeviceResources> resources;
+			CComPtr<IPortableDeviceKeyCollection> propertyKeys;
+			CComPtr<IPortableDeviceKeyCollection> bulkPropertyKeys;
+			ReadSizeTuner readSizeTuner;
+
+		public:
+			static ExpectedOrHResult<SessionPtr> Create(CComPtr<IPortableDevice> device)
+			{
+				auto session = std::make_shared<WpdSession>();
+				session->device = std::move(device);
+				if (const auto hr = session->device->Content(&session->content); FAILED(hr)) return hr;
+				if (const auto hr = session->content->Properties(&session->properties); FAILED(hr)) return hr;
+				if (const auto hr = session->content->Transfer(&session->resources); FAILED(hr)) return hr;
+
+				auto propertyKeys = CreatePropertyKeys();
+				if (!propertyKeys) return propertyKeys.GetResult();
+				session->propertyKeys = *propertyKeys;
+
+				// Not every driver supports bulk operations
+				if (SUCCEEDED(session->properties.QueryInterface(&session->bulkProperties))) {
+					auto bulkPropertyKeys = CreatePropertyKeys();
+					if (!bulkPropertyKeys) return bulkPropertyKeys.GetResult();
+					if (const auto hr = (*bulkPropertyKeys)->Add(WPD_OBJECT_ID); FAILED(hr)) return hr;
+					session->bulkPropertyKeys = *bulkPropertyKeys;
+				}
+				return SessionPtr(std::move(session));
+			}
+
+			ExpectedOrHResult<ObjectProperties> ReadProperties(const ObjectID& id) override
+			{
+				CComPtr<IPortableDeviceValues> objectProperties;
+				if (const auto hr = properties->GetValues(id.c_str(), propertyKeys, &objectProperties); FAILED(hr)) return hr;
+
+				return ToObjectProperties(objectProperties);
+			}
+
+			ExpectedOrHResult<size_t> EnumerateContentsWithProperties(const ObjectID& id, ObjectInfoCallbackFn callback) override
+			{
+				if (!bulkProperties) return Session::EnumerateContentsWithProperties(id, std::move(callback));
+
+				CComPtr<IPortableDevicePropVariantCollection> objectIDs;
+				if (const auto hr = objectIDs.CoCreateInstance(CLSID_PortableDevicePropVariantCollection, NULL, CLSCTX_INPROC_SERVER); FAILED(hr)) return hr;
+
+				std::vector<ObjectID> requested;
+				const auto hr = ForEachObjectID(content, id, [&](PWSTR objectID) {
+					requested.push_back(ObjectID(objectID));
+					PROPVARIANT value;
+					PropVariantInit(&value);
+					value.vt = VT_LPWSTR;
+					value.pwszVal = objectID; // freed by PropVariantClear()
+					objectIDs->Add(&value);
+					PropVariantClear(&value);
+				});
+				if (FAILED(hr)) return hr;
+
+				DWORD numObjectIDs{};
+				if (const auto hr = objectIDs->GetCount(&numObjectIDs); FAILED(hr)) return hr;
+				if (numObjectIDs == 0) return size_t{};
+
+				CComPtr<BulkPropertiesCallback> bulkCallback;
+				bulkCallback.Attach(new BulkPropertiesCallback);
+				GUID context;
+				if (const auto hr = bulkProperties->QueueGetValuesByObjectList(objectIDs, bulkPropertyKeys, bulkCallback, &context); FAILED(hr)) return hr;
+				if (const auto hr = bulkProperties->Start(context); FAILED(hr)) return hr;
+
+				// The bulk callback runs on a driver thread; hand the batches over
+				// so that the caller's callback is invoked from this thread
+				size_t numObjects{};
+				std::unordered_set<ObjectID> received;
+				while (true) {
+					auto batch = bulkCallback->WaitForBatch();
+					if (!batch) break;
+					numObjects += batch->size();
+					for (const auto& object : *batch)
+						received.insert(object.id);
+					if (!std::invoke(callback, *batch)) {
+						bulkProperties->Cancel(context);
+						bulkCallback->WaitForEnd();
+						return numObjects;
+					}
+				}
+				if (const auto hr = bulkCallback->GetStatus(); FAILED(hr)) return hr;
+
+				// Drivers may leave objects out of the bulk results; a listing
+				// that misses them would pass for a complete one
+				if (received.size() < numObjectIDs) {
+					std::vector<ObjectInfo> missing;
+					for (const auto& objectID : requested) {
+						if (received.contains(objectID)) continue;
+						auto objectProperties = ReadProperties(objectID);
+						if (!objectProperties) return objectProperties.GetResult();
+						missing.push_back({ objectID, std::move(*objectProperties) });
+					}
+					numObjects += missing.size();
+					if (!missing.empty()) std::invoke(callback, missing);
+				}
+				return numObjects;
+			}
+
+			ExpectedOrHResult<ObjectID> FindByPersistentId(const std::string& persistentId) override
+			{
+				CComPtr<IPortableDevicePropVariantCollection> persistentIDs;
+				if (const auto hr = persistentIDs.CoCreateInstance(CLSID_PortableDevicePropVariantCollection, NULL, CLSCTX_INPROC_SERVER); FAILED(hr)) return hr;
+
+				auto wPersistentId = unicode::ToWide(persistentId);
+				PROPVARIANT value;
+				PropVariantInit(&value);
+				value.vt = VT_LPWSTR;
+				value.pwszVal = wPersistentId.data();
+				if (const auto hr = persistentIDs->Add(&value); FAILED(hr)) return hr;
+
+				CComPtr<IPortableDevicePropVariantCollection> objectIDs;
+				if (const auto hr = content->GetObjectIDsFromPersistentUniqueIDs(persistentIDs, &objectIDs); FAILED(hr)) return hr;
+
+				PROPVARIANT objectID;
+				PropVariantInit(&objectID);
+				if (const auto hr = objectIDs->GetAt(0, &objectID); FAILED(hr)) return hr;
+				ObjectID result;
+				if (objectID.vt == VT_LPWSTR && objectID.pwszVal) result = ObjectID(objectID.pwszVal);
+				PropVariantClear(&objectID);
+				// Unknown persistent IDs yield an empty object ID
+				if (result.empty()) return E_INVALIDARG;
+				return result;
+			}
+
+			ExpectedOrHResult<std::vector<ObjectID>> EnumerateContents(const ObjectID& id) override
+			{
+				std::vector<ObjectID> results;
+				const auto hr = ForEachObjectID(content, id, [&](PWSTR objectID) {
+					results.push_back(ObjectID(objectID));
+					CoTaskMemFree(objectID);
+				});
+				if (FAILED(hr)) return hr;
+				return results;
+			}
+
+			ExpectedOrHResult<uint64_t> ReadData(const ObjectID& id, ReadCallbackFn callback) override
+			{
+				return ReadDataFrom(id, 0, std::move(callback));
+			}
+
+			ExpectedOrHResult<uint64_t> ReadDataFrom(const ObjectID& id, uint64_t offset, ReadCallbackFn callback) override
+			{
+				DWORD optimalTransferSize;
+				CComPtr<IStream> stream;
+				if (const auto hr = resources->GetStream(id.c_str(), WPD_RESOURCE_DEFAULT, STGM_READ, &optimalTransferSize, &stream); FAILED(hr)) return hr;
+				if (offset > 0) {
+					// Only works if the driver supports partial object reads. How
+					// it fails otherwise differs per driver; the caller can then
+					// start over
+					LARGE_INTEGER position;
+					position.QuadPart = static_cast<LONGLONG>(offset);
+					if (FAILED(stream->Seek(position, STREAM_SEEK_SET, nullptr))) return E_NOTIMPL;
+				}
+
+				uint64_t totalBytesRead{};
+				auto buffer = BufferPool::Get().Acquire(readSizeTuner.GetMaxReadSize(optimalTransferSize));
+				while (true) {
+					const auto readSize = readSizeTuner.GetReadSize(optimalTransferSize);
+					DWORD bytesRead;
+					const auto start = ReadSizeTuner::Clock::now();
+					if (const auto hr = stream->Read(buffer.get(), static_cast<ULONG>(readSize), &bytesRead); FAILED(hr)) return hr;
+					readSizeTuner.Record(readSize, bytesRead, ReadSizeTuner::Clock::now() - start);
+					if (bytesRead == 0) break;
+
+					totalBytesRead += bytesRead;
+					if (!std::invoke(callback, buffer.get(), bytesRead)) break;
+				}
+				return totalBytesRead;
+			}
+		};
+
+		class WpdBackend : public Backend
+		{
+		public:
+			const char* GetName() const override { return BACKEND_NAME; }
+
+			ExpectedOrHResult<std::vector<PortableDevice>> EnumeratePortableDevices() override
+			{
+				CComPtr<IPortableDeviceManager> portableDeviceManager;
+				if (const auto hr = CoCreateInstance(CLSID_PortableDeviceManager, NULL, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&portableDeviceManager)); FAILED(hr)) return hr;
+
+				DWORD deviceCount{};
+				if (const auto hr = portableDeviceManager->GetDevices(NULL, &deviceCount); FAILED(hr)) return hr;
+
+				std::vector<PortableDevice> devices;
+				if (deviceCount > 0)
+				{
+					auto deviceIDs = std::make_unique<PWSTR[]>(deviceCount);
+					if (const auto hr = portableDeviceManager->GetDevices(deviceIDs.get(), &deviceCount); FAILED(hr)) return hr;
+
+					for (int n = 0; n < deviceCount; ++n) {
+						const auto id = deviceIDs[n];
+
+						auto getString = [&](auto func) -> std::optional<std::string> {
+							DWORD size{};
+							if (const auto hr = func(nullptr, &size); SUCCEEDED(hr)) {
+								if (size == 0) return "";
+								auto str = std::make_unique<WCHAR[]>(size);
+								if (const auto hr = func(str.get(), &size); SUCCEEDED(hr))
+									return unicode::ToUtf8(str.get());
+							}
+							return {};
+						};
+
+						auto name = getString([&](auto str, auto size) { return portableDeviceManager->GetDeviceFriendlyName(id, str, size); });
+						auto manufacturer = getString([&](auto str, auto size) { return portableDeviceManager->GetDeviceManufacturer(id, str, size); });
+						auto descr = getString([&](auto str, auto size) { return portableDeviceManager->GetDeviceDescription(id, str, size); });
+						devices.push_back({ std::string(BACKEND_NAME) + ':' + unicode::ToUtf8(id), std::move(name), std::move(manufacturer), std::move(descr) });
+						CoTaskMemFree(id);
+					}
+				}
+				return devices;
+			}
+
+			ExpectedOrHResult<SessionPtr> OpenDevice(const DeviceID& deviceId) override
+			{
+				CComPtr<IPortableDevice> device;
+				if (const auto hr = device.CoCreateInstance(CLSID_PortableDeviceFTM, NULL, CLSCTX_INPROC_SERVER); FAILED(hr)) return hr;
+
+				auto clientInformation = GetClientInformation();
+				if (!clientInformation) return clientInformation.GetResult();
+
+				clientInformation->SetUnsignedIntegerValue(WPD_CLIENT_DESIRED_ACCESS, GENERIC_READ);
+				auto id = unicode::ToWide(deviceId.substr(std::strlen(BACKEND_NAME) + 1));
+				if (const auto hr = device->Open(id.data(), *clientInformation); FAILED(hr)) return hr;
+
+				return WpdSession::Create(std::move(device));
+			}
+		};
+	}
+
+	std::unique_ptr<Backend> CreateWpdBackend()
+	{
+		return std::make_unique<WpdBackend>();
+	}
+}
+#endif
@@ -0,0 +1,129 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#include "Manifest.h"
+#include <algorithm>
+#include <fstream>
+
+namespace
+{
+	constexpr char MAGIC[4] = { 'R', 'A', 'M', 'F' };
+	constexpr uint32_t VERSION = 1;
+
+	// All integers are stored little-endian, regardless of the host
+	template<typename T> void WriteInt(std::ostream& os, T value)
+	{
+		char bytes[sizeof(T)];
+		for (size_t n = 0; n < sizeof(T); ++n)
+			bytes[n] = static_cast<char>(static_cast<uint64_t>(value) >> (8 * n));
+		os.write(bytes, sizeof(bytes));
+	}
+
+	template<typename T> bool ReadInt(std::istream& is, T& value)
+	{
+		unsigned char bytes[sizeof(T)];
+		if (!is.read(reinterpret_cast<char*>(bytes), sizeof(bytes))) return false;
+		uint64_t v{};
+		for (size_t n = 0; n < sizeof(T); ++n)
+			v |= static_cast<uint64_t>(bytes[n]) << (8 * n);
+		value = static_cast<T>(v);
+		return true;
+	}
+
+	void WriteString(std::ostream& os, const std::string& s)
+	{
+		WriteInt<uint32_t>(os, static_cast<uint32_t>(s.size()));
+		os.write(s.data(), s.size());
+	}
+
+	// Lengths beyond the end of the file are rejected before allocating
+	// anything, as the file may well be damaged
+	bool ReadString(std::istream& is, uint64_t fileSize, std::string& s)
+	{
+		uint32_t length;
+		if (!ReadInt(is, length)) return false;
+		const auto position = is.tellg();
+		if (position < 0 || length > fileSize - static_cast<uint64_t>(position)) return false;
+		s.resize(length);
+		return static_cast<bool>(is.read(s.data(), length));
+	}
+}
+
+Manifest Manifest::Load(const std::filesystem::path& where)
+{
+	Manifest manifest;
+	std::error_code ec;
+	const auto fileSize = std::filesystem::file_size(where / FILE_NAME, ec);
+	if (ec) return manifest;
+	std::ifstream ifs(where / FILE_NAME, std::ifstream::in | std::ifstream::binary);
+	if (!ifs) return manifest;
+
+	char magic[sizeof(MAGIC)];
+	uint32_t version;
+	uint64_t numEntries;
+	if (!ifs.read(magic, sizeof(magic)) || !std::equal(std::begin(magic), std::end(magic), std::begin(MAGIC))) return manifest;
+	if (!ReadInt(ifs, version) || version != VERSION) return manifest;
+	if (!ReadInt(ifs, numEntries)) return manifest;
+
+	for (uint64_t n = 0; n < numEntries; ++n) {
+		std::string key;
+		ManifestEntry entry;
+		uint8_t isFolder;
+		if (!ReadString(ifs, fileSize, key) || !ReadString(ifs, fileSize, entry.path) ||
+			!ReadInt(ifs, entry.size) || !ReadInt(ifs, entry.modified) || !ReadInt(ifs, isFolder)) {
+			// Truncated; better to start over than to trust part of it
+			return Manifest{};
+		}
+		entry.isFolder = isFolder != 0;
+		manifest.Add(key, std::move(entry));
+	}
+	return manifest;
+}
+
+bool Manifest::Save(const std::filesystem::path& where) const
+{
+	// Write a new file and move it in place, so a crash never leaves a
+	// damaged manifest behind
+	const auto path = where / FILE_NAME;
+	auto tempPath = path;
+	tempPath += ".new";
+	{
+		std::ofstream ofs(tempPath, std::ofstream::out | std::ofstream::trunc | std::ofstream::binary);
+		ofs.write(MAGIC, sizeof(MAGIC));
+		WriteInt<uint32_t>(ofs, VERSION);
+		WriteInt<uint64_t>(ofs, entries.size());
+		for (const auto& [key, entry] : entries) {
+			WriteString(ofs, key);
+			WriteString(ofs, entry.path);
+			WriteInt<uint64_t>(ofs, entry.size);
+			WriteInt<int64_t>(ofs, entry.modified);
+			WriteInt<uint8_t>(ofs, entry.isFolder ? 1 : 0);
+		}
+		if (!ofs.flush()) return false;
+	}
+
+	std::error_code ec;
+	std::filesystem::rename(tempPath, path, ec);
+	return !ec;
+}
+
+const ManifestEntry* Manifest::Find(const std::string& key) const
+{
+	auto it = entries.find(key);
+	return it != entries.end() ? &it->second : nullptr;
+}
+
+void Manifest::Add(const std::string& key, ManifestEntry entry)
+{
+	entries.insert_or_assign(key, std::move(entry));
+}
+
+void Manifest::Merge(const Manifest& other)
+{
+	for (const auto& [key, entry] : other.entries) {
+		if (!Find(key)) Add(key, entry);
+	}
+}
@@ -0,0 +1,42 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <unordered_map>
+
+// Everything we remember about an object that was backed up
+struct ManifestEntry
+{
+	std::string path; // relative to the backup location
+	uint64_t size{};
+	int64_t modified{}; // seconds since the epoch, 0 if unknown
+	bool isFolder{};
+};
+
+// Records which objects were backed up to a location, keyed by the device's
+// persistent object ID. This allows later runs to skip unchanged objects
+// without looking at the destination at all
+class Manifest
+{
+public:
+	static constexpr auto FILE_NAME = ".replicandroid-manifest";
+
+	// Yields an empty manifest if there is none or it cannot be read
+	static Manifest Load(const std::filesystem::path& where);
+	bool Save(const std::filesystem::path& where) const;
+
+	const ManifestEntry* Find(const std::string& key) const;
+	void Add(const std::string& key, ManifestEntry entry);
+	// Adds all entries of the other manifest that we do not have
+	void Merge(const Manifest& other);
+
+private:
+	std::unordered_map<std::string, ManifestEntry> entries;
+};
@@ -0,0 +1,82 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#include "ObjectStore.h"
+#include "Hash.h"
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <string>
+
+namespace
+{
+	// Objects whose hash and size match another one, but whose content does
+	// not, get a number appended; more than this many is not a coincidence
+	constexpr unsigned int MAX_COLLISIONS = 16;
+
+	bool HaveSameContent(const std::filesystem::path& a, const std::filesystem::path& b)
+	{
+		constexpr size_t BUFFER_SIZE = 256 * 1024;
+		std::ifstream aStream(a, std::ifstream::in | std::ifstream::binary);
+		std::ifstream bStream(b, std::ifstream::in | std::ifstream::binary);
+		if (!aStream || !bStream) return false;
+
+		const auto aBuffer = std::make_unique<char[]>(BUFFER_SIZE);
+		const auto bBuffer = std::make_unique<char[]>(BUFFER_SIZE);
+		while (true) {
+			aStream.read(aBuffer.get(), BUFFER_SIZE);
+			bStream.read(bBuffer.get(), BUFFER_SIZE);
+			const auto length = aStream.gcount();
+			if (length != bStream.gcount() || !std::equal(aBuffer.get(), aBuffer.get() + length, bBuffer.get())) return false;
+			if (length == 0) return !aStream.bad() && !bStream.bad();
+		}
+	}
+}
+
+ObjectStore::ObjectStore(std::filesystem::path root)
+	: root(std::move(root))
+{
+	std::error_code ec;
+	std::filesystem::create_directories(this->root, ec);
+}
+
+bool ObjectStore::Add(const std::filesystem::path& file, uint64_t hash, uint64_t size, const std::filesystem::path& destPath)
+{
+	const auto name = Hash64::ToString(hash) + '-' + std::to_string(size);
+	const auto directory = root / name.substr(0, 2);
+
+	std::error_code ec;
+	std::filesystem::create_directory(directory, ec);
+	std::filesystem::path objectPath;
+	for (unsigned int n = 0; ; ++n) {
+		if (n == MAX_COLLISIONS) return false;
+		objectPath = directory / (n == 0 ? name : name + '-' + std::to_string(n));
+
+		// Unlike renaming, linking never replaces an object that is there
+		// already, such as one another backup just stored
+		std::filesystem::create_hard_link(file, objectPath, ec);
+		if (!ec) {
+			std::filesystem::remove(file, ec);
+			break;
+		}
+		if (std::filesystem::exists(objectPath, ec)) {
+			// The hash is not strong enough to go by alone
+			if (!HaveSameContent(file, objectPath)) continue;
+			std::filesystem::remove(file, ec);
+			break;
+		}
+
+		// The filesystem has no hard links
+		std::filesystem::rename(file, objectPath, ec);
+		if (ec) return false;
+		break;
+	}
+
+	std::filesystem::remove(destPath, ec);
+	std::filesystem::create_hard_link(objectPath, destPath, ec);
+	if (ec) std::filesystem::copy_file(objectPath, destPath, std::filesystem::copy_options::overwrite_existing, ec);
+	return !ec;
+}
@@ -0,0 +1,30 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+
+// Content-addressed storage: every distinct file content is stored once,
+// named after its hash and size, and compared before it is shared in case
+// the hashes collide. Backed up files are hard links to the stored object,
+// or copies where the filesystem has no hard links
+class ObjectStore
+{
+public:
+	static constexpr auto DIRECTORY_NAME = ".objects";
+
+	explicit ObjectStore(std::filesystem::path root);
+
+	// Moves a completely written file into the store, unless the content is
+	// already present, and makes it available at the destination path. The
+	// file must be on the same filesystem as the store
+	bool Add(const std::filesystem::path& file, uint64_t hash, uint64_t size, const std::filesystem::path& destPath);
+
+private:
+	std::filesystem::path root;
+};
@@ -0,0 +1,161 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#include "OutputFile.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+OutputFile::~OutputFile()
+{
+	Close();
+}
+
+#ifdef _WIN32
+bool OutputFile::Open(const std::filesystem::path& path, bool append, bool direct, uint64_t expectedSize)
+{
+	Close();
+	std::error_code ec;
+	const auto size = append ? std::filesystem::file_size(path, ec) : 0;
+	if (ec) return false;
+	this->direct = direct && size % ALIGNMENT == 0;
+	const DWORD flags = FILE_ATTRIBUTE_NORMAL | (this->direct ? FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH : 0);
+	auto h = CreateFileW(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr, append ? OPEN_EXISTING : CREATE_ALWAYS, flags, nullptr);
+	if (h == INVALID_HANDLE_VALUE) return false;
+	handle = h;
+
+	LARGE_INTEGER distance;
+	distance.QuadPart = static_cast<LONGLONG>(size);
+	if (!SetFilePointerEx(handle, distance, nullptr, FILE_BEGIN)) {
+		Close();
+		return false;
+	}
+	position = size;
+	paddedTo = 0;
+	reservedTo = 0;
+	Reserve(expectedSize);
+	return true;
+}
+
+void OutputFile::Reserve(uint64_t size)
+{
+	// Only allocates the space; the end of the file stays where it is
+	if (size <= position) return;
+	FILE_ALLOCATION_INFO info;
+	info.AllocationSize.QuadPart = static_cast<LONGLONG>(size);
+	if (SetFileInformationByHandle(handle, FileAllocationInfo, &info, sizeof(info))) reservedTo = size;
+}
+
+bool OutputFile::Write(char* data, size_t length, size_t capacity)
+{
+	// The last bit of a file is padded, and cut off once it is closed
+	auto writeLength = length;
+	if (direct && length % ALIGNMENT != 0) {
+		writeLength = (length + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+		if (writeLength > capacity) return false;
+		std::memset(data + length, 0, writeLength - length);
+		paddedTo = position + writeLength;
+	}
+
+	while (writeLength > 0) {
+		DWORD written;
+		const auto chunk = static_cast<DWORD>(std::min<size_t>(writeLength, 1u << 30));
+		if (!WriteFile(handle, data, chunk, &written, nullptr) || written == 0) return false;
+		data += written;
+		writeLength -= written;
+	}
+	position += length;
+	return true;
+}
+
+bool OutputFile::Close()
+{
+	if (!handle) return true;
+	bool ok = true;
+	if (paddedTo > position || reservedTo > position) {
+		FILE_END_OF_FILE_INFO info;
+		info.EndOfFile.QuadPart = static_cast<LONGLONG>(position);
+		ok = SetFileInformationByHandle(handle, FileEndOfFileInfo, &info, sizeof(info));
+	}
+	ok = CloseHandle(handle) && ok;
+	handle = nullptr;
+	return ok;
+}
+#else
+bool OutputFile::Open(const std::filesystem::path& path, bool append, bool direct, uint64_t expectedSize)
+{
+	Close();
+	fd = ::open(path.c_str(), O_WRONLY | O_CREAT | (append ? 0 : O_TRUNC), 0666);
+	if (fd < 0) return false;
+
+	const auto size = ::lseek(fd, 0, SEEK_END);
+	if (size < 0) {
+		Close();
+		return false;
+	}
+	position = static_cast<uint64_t>(size);
+	paddedTo = 0;
+	reservedTo = 0;
+	Reserve(expectedSize);
+	this->direct = false;
+	if (direct && position % ALIGNMENT == 0) {
+#if defined(O_DIRECT)
+		this->direct = ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_DIRECT) == 0;
+#elif defined(F_NOCACHE)
+		this->direct = ::fcntl(fd, F_NOCACHE, 1) == 0;
+#endif
+	}
+	return true;
+}
+
+void OutputFile::Reserve(uint64_t size)
+{
+#if defined(__linux__)
+	// Keeping the size means a partial file still tells how much it holds
+	if (size > position && ::fallocate(fd, FALLOC_FL_KEEP_SIZE, static_cast<off_t>(position), static_cast<off_t>(size - position)) == 0)
+		reservedTo = size;
+#else
+	(void)size;
+#endif
+}
+
+bool OutputFile::Write(char* data, size_t length, size_t)
+{
+#if defined(O_DIRECT)
+	// Unlike Windows, the last bit of a file can be written normally
+	if (direct && length % ALIGNMENT != 0) {
+		if (::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) & ~O_DIRECT) != 0) return false;
+		direct = false;
+	}
+#endif
+	while (length > 0) {
+		const auto written = ::write(fd, data, length);
+		if (written < 0 && errno == EINTR) continue;
+		if (written <= 0) return false;
+		data += written;
+		length -= static_cast<size_t>(written);
+		position += static_cast<uint64_t>(written);
+	}
+	return true;
+}
+
+bool OutputFile::Close()
+{
+	if (fd < 0) return true;
+	bool ok = true;
+	// Cutting the file at its size frees the blocks reserved past it
+	if (reservedTo > position) ok = ::ftruncate(fd, static_cast<off_t>(position)) == 0;
+	ok = ::close(fd) == 0 && ok;
+	fd = -1;
+	return ok;
+}
+#endif
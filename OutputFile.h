@@ -0,0 +1,53 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+
+// A file that is being written, optionally using direct I/O: the data then
+// goes to the disk without passing through the OS cache, which spares the
+// cache from files that are not going to be read again and saves copying
+// them. Direct writes require the data and their length to be aligned to
+// ALIGNMENT; only the last write of a file may be shorter.
+// If the final size of the file is known, the space for it is reserved up
+// front, so that large files are not fragmented by growing them bit by bit
+class OutputFile
+{
+public:
+	static constexpr size_t ALIGNMENT = 4096;
+
+	OutputFile() = default;
+	OutputFile(const OutputFile&) = delete;
+	OutputFile& operator=(const OutputFile&) = delete;
+	~OutputFile();
+
+	// Falls back to normal writes if direct I/O is not possible, for example
+	// when appending to a file whose size is not aligned. Failing to reserve
+	// space is not an error; not every filesystem can
+	bool Open(const std::filesystem::path& path, bool append, bool direct, uint64_t expectedSize = 0);
+	// The buffer must have room for capacity bytes, so that a short last
+	// write can be padded if needed
+	bool Write(char* data, size_t length, size_t capacity);
+	// Space that was reserved but not written, because there was less data
+	// than expected, is given back
+	bool Close();
+
+private:
+#ifdef _WIN32
+	void* handle{};
+#else
+	int fd{ -1 };
+#endif
+	bool direct{};
+	uint64_t position{};
+	uint64_t paddedTo{}; // the file must be cut back to position on close
+	uint64_t reservedTo{}; // likewise
+
+	void Reserve(uint64_t size);
+};
@@ -0,0 +1,76 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#include "PartialFile.h"
+#include <algorithm>
+#include <fstream>
+
+namespace
+{
+	constexpr auto CHECKPOINT_MAGIC = "replicandroid-checkpoint 1";
+}
+
+PartialFile::PartialFile(const std::filesystem::path& destPath, std::string key, uint64_t size, int64_t modified)
+	: key(std::move(key)), size(size), modified(modified)
+{
+	path = destPath;
+	path += SUFFIX;
+	checkpointPath = destPath;
+	checkpointPath += CHECKPOINT_SUFFIX;
+}
+
+uint64_t PartialFile::Resume()
+{
+	std::ifstream ifs(checkpointPath);
+	std::string magic, checkpointKey;
+	uint64_t checkpointSize{}, offset{};
+	int64_t checkpointModified{};
+	std::getline(ifs, magic);
+	std::getline(ifs, checkpointKey);
+	ifs >> checkpointSize >> checkpointModified >> offset;
+	ifs.close();
+
+	std::error_code ec;
+	const auto partialSize = std::filesystem::file_size(path, ec);
+	if (ec || !ifs || magic != CHECKPOINT_MAGIC || checkpointKey != key ||
+		checkpointSize != size || checkpointModified != modified)
+	{
+		Discard();
+		return 0;
+	}
+
+	// Anything past the checkpoint may not have been written completely
+	offset = std::min(offset, partialSize);
+	if (offset != partialSize) std::filesystem::resize_file(path, offset, ec);
+	if (ec) {
+		Discard();
+		return 0;
+	}
+	return offset;
+}
+
+bool PartialFile::SaveCheckpoint(uint64_t offset) const
+{
+	std::ofstream ofs(checkpointPath, std::ofstream::out | std::ofstream::trunc);
+	ofs << CHECKPOINT_MAGIC << '\n' << key << '\n' << size << '\n' << modified << '\n' << offset << '\n';
+	return static_cast<bool>(ofs.flush());
+}
+
+bool PartialFile::Commit(const std::filesystem::path& destPath)
+{
+	std::error_code ec;
+	std::filesystem::rename(path, destPath, ec);
+	if (ec) return false;
+	std::filesystem::remove(checkpointPath, ec);
+	return true;
+}
+
+void PartialFile::Discard()
+{
+	std::error_code ec;
+	std::filesystem::remove(path, ec);
+	std::filesystem::remove(checkpointPath, ec);
+}
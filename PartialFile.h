@@ -0,0 +1,42 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+
+// An object being transferred to '<destination>.partial'. A checkpoint next
+// to it records which object it holds and how much of it was written, so an
+// interrupted transfer can be resumed by a later run. The destination itself
+// only appears once the transfer is complete
+class PartialFile
+{
+public:
+	static constexpr auto SUFFIX = ".partial";
+	static constexpr auto CHECKPOINT_SUFFIX = ".partial.checkpoint";
+
+	// The key, size and modification date identify the object's content
+	PartialFile(const std::filesystem::path& destPath, std::string key, uint64_t size, int64_t modified);
+
+	const std::filesystem::path& GetPath() const { return path; }
+
+	// Yields the number of bytes that can be kept from an earlier attempt
+	// to transfer the same content; anything else is thrown away
+	uint64_t Resume();
+	bool SaveCheckpoint(uint64_t offset) const;
+	// Moves the completed file to its destination
+	bool Commit(const std::filesystem::path& destPath);
+	void Discard();
+
+private:
+	std::filesystem::path path;
+	std::filesystem::path checkpointPath;
+	std::string key;
+	uint64_t size;
+	int64_t modified;
+};
@@ -0,0 +1,78 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#pragma once
+
+#ifdef _WIN32
+#include <windows.h>
+#include <PortableDevice.h>
+#else
+#include <cstdint>
+
+// The device layer reports errors as HRESULTs and identifies content types
+// and formats using WPD GUIDs; provide just enough of both so that the non-WPD
+// backends can share that vocabulary
+using HRESULT = std::int32_t;
+using ULONG = std::uint32_t;
+using DWORD = std::uint32_t;
+
+#define SUCCEEDED(hr) (static_cast<HRESULT>(hr) >= 0)
+#define FAILED(hr) (static_cast<HRESULT>(hr) < 0)
+
+constexpr HRESULT S_OK = 0;
+constexpr HRESULT S_FALSE = 1;
+constexpr HRESULT E_NOTIMPL = static_cast<HRESULT>(0x80004001);
+constexpr HRESULT E_ABORT = static_cast<HRESULT>(0x80004004);
+constexpr HRESULT E_FAIL = static_cast<HRESULT>(0x80004005);
+constexpr HRESULT E_UNEXPECTED = static_cast<HRESULT>(0x8000FFFF);
+constexpr HRESULT E_ACCESSDENIED = static_cast<HRESULT>(0x80070005);
+constexpr HRESULT E_OUTOFMEMORY = static_cast<HRESULT>(0x8007000E);
+constexpr HRESULT E_INVALIDARG = static_cast<HRESULT>(0x80070057);
+constexpr HRESULT E_PENDING = static_cast<HRESULT>(0x8000000A);
+
+// Errors reported by the USB stack are Win32 error codes, wrapped in an HRESULT
+constexpr HRESULT HRESULT_FROM_WIN32(DWORD x)
+{
+	return static_cast<HRESULT>(x) <= 0 ? static_cast<HRESULT>(x) : static_cast<HRESULT>((x & 0x0000FFFF) | 0x80070000);
+}
+
+constexpr DWORD ERROR_FILE_NOT_FOUND = 2;
+constexpr DWORD ERROR_INVALID_HANDLE = 6;
+constexpr DWORD ERROR_NOT_READY = 21;
+constexpr DWORD ERROR_CRC = 23;
+constexpr DWORD ERROR_GEN_FAILURE = 31;
+constexpr DWORD ERROR_SEM_TIMEOUT = 121;
+constexpr DWORD ERROR_BUSY = 170;
+constexpr DWORD ERROR_NO_SUCH_DEVICE = 433;
+constexpr DWORD ERROR_IO_DEVICE = 1117;
+constexpr DWORD ERROR_DEVICE_NOT_CONNECTED = 1167;
+constexpr DWORD ERROR_NOT_FOUND = 1168;
+constexpr DWORD ERROR_TIMEOUT = 1460;
+constexpr DWORD ERROR_DEVICE_REMOVED = 1617;
+
+struct GUID
+{
+	std::uint32_t Data1;
+	std::uint16_t Data2;
+	std::uint16_t Data3;
+	std::uint8_t Data4[8];
+};
+
+constexpr bool operator==(const GUID& a, const GUID& b)
+{
+	if (a.Data1 != b.Data1 || a.Data2 != b.Data2 || a.Data3 != b.Data3) return false;
+	for (int n = 0; n < 8; ++n)
+		if (a.Data4[n] != b.Data4[n]) return false;
+	return true;
+}
+
+constexpr GUID WPD_CONTENT_TYPE_FUNCTIONAL_OBJECT{ 0x99ED0160, 0x17FF, 0x4C44, { 0x9D, 0x98, 0x1D, 0x7A, 0x6F, 0x94, 0x19, 0x21 } };
+constexpr GUID WPD_CONTENT_TYPE_FOLDER{ 0x27E2E392, 0xA111, 0x48E0, { 0xAB, 0x0C, 0xE1, 0x77, 0x05, 0xA0, 0x5F, 0x85 } };
+constexpr GUID WPD_CONTENT_TYPE_GENERIC_FILE{ 0x0085E0A6, 0x8D34, 0x45D7, { 0xBC, 0x5C, 0x44, 0x7E, 0x59, 0xC7, 0x3D, 0x48 } };
+constexpr GUID WPD_CONTENT_TYPE_IMAGE{ 0xEF2107D5, 0xA52A, 0x4243, { 0xA2, 0x6B, 0x62, 0xD4, 0x17, 0x6D, 0x76, 0x03 } };
+constexpr GUID WPD_CONTENT_TYPE_VIDEO{ 0x9261B03C, 0x3D78, 0x4519, { 0x85, 0xE3, 0x02, 0xC5, 0xE1, 0xF5, 0x0B, 0xB9 } };
+constexpr GUID WPD_CONTENT_TYPE_AUDIO{ 0x4AD2C85E, 0x5E2D, 0x45E5, { 0x88, 0x64, 0x4F, 0x22, 0x9E, 0x3C, 0x6C, 0xF0 } };
+#endif
@@ -0,0 +1,48 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include "Config.h"
+
+// Counters kept up to date by a running backup. Rather than being told
+// about every file, the UI samples these at its own pace. The values are
+// only informational, so relaxed ordering will do
+struct Progress
+{
+	std::atomic<unsigned int> totalNumberOfItems{};
+	std::atomic<uint64_t> totalNumberOfBytes{};
+	std::atomic<bool> scanComplete{};
+
+	std::atomic<unsigned int> itemsTransferredSuccessfully{};
+	std::atomic<unsigned int> itemsTransferredFailures{};
+	std::atomic<unsigned int> itemsTransferredSkipped{};
+	std::atomic<uint64_t> bytesRead{};
+	std::atomic<uint64_t> bytesSkipped{};
+	// Received so far for the file that is being transferred
+	std::atomic<uint64_t> bytesInProgress{};
+
+	static void Add(std::atomic<unsigned int>& counter, unsigned int n = 1) { counter.fetch_add(n, std::memory_order_relaxed); }
+	static void Add(std::atomic<uint64_t>& counter, uint64_t n) { counter.fetch_add(n, std::memory_order_relaxed); }
+
+	NumbersAvailable GetNumbers() const
+	{
+		return { totalNumberOfItems.load(std::memory_order_relaxed), totalNumberOfBytes.load(std::memory_order_relaxed) };
+	}
+
+	ItemsUpdate GetItems() const
+	{
+		return {
+			itemsTransferredSuccessfully.load(std::memory_order_relaxed),
+			itemsTransferredFailures.load(std::memory_order_relaxed),
+			itemsTransferredSkipped.load(std::memory_order_relaxed),
+			bytesRead.load(std::memory_order_relaxed),
+			bytesSkipped.load(std::memory_order_relaxed),
+		};
+	}
+};
@@ -0,0 +1,62 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#include "ReadSizeTuner.h"
+#include <algorithm>
+
+ReadSizeTuner::ReadSizeTuner(size_t maxReadSize)
+	: maxReadSize(maxReadSize)
+{
+}
+
+size_t ReadSizeTuner::GetReadSize(size_t optimalSize)
+{
+	std::lock_guard lock(mutex);
+	lastOptimalSize = optimalSize;
+	const auto multiplier = MULTIPLIERS[exploring ? current : best];
+	return std::max(optimalSize, std::min(optimalSize * multiplier, maxReadSize));
+}
+
+size_t ReadSizeTuner::GetMaxReadSize(size_t optimalSize) const
+{
+	return std::max(optimalSize, std::min(optimalSize * MULTIPLIERS.back(), maxReadSize));
+}
+
+void ReadSizeTuner::Record(size_t readSize, size_t bytesRead, Clock::duration duration)
+{
+	if (bytesRead < readSize) return;
+
+	std::lock_guard lock(mutex);
+	// Ignore reads made with a multiple we are no longer interested in
+	const auto index = exploring ? current : best;
+	if (readSize != std::max(lastOptimalSize, std::min(lastOptimalSize * MULTIPLIERS[index], maxReadSize))) return;
+
+	auto& trial = trials[index];
+	trial.bytes += bytesRead;
+	trial.duration += duration;
+	if (exploring) {
+		if (trial.bytes >= BYTES_PER_TRIAL) Advance();
+	} else if ((bytesSinceTrials += bytesRead) >= BYTES_BETWEEN_TRIALS) {
+		trials = {};
+		current = 0;
+		exploring = true;
+	}
+}
+
+void ReadSizeTuner::Advance()
+{
+	if (++current < MULTIPLIERS.size()) return;
+
+	auto rate = [](const Trial& trial) {
+		return trial.duration.count() > 0 ? static_cast<double>(trial.bytes) / trial.duration.count() : 0.0;
+	};
+	best = 0;
+	for (size_t n = 1; n < trials.size(); ++n) {
+		if (rate(trials[n]) > rate(trials[best])) best = n;
+	}
+	exploring = false;
+	bytesSinceTrials = 0;
+}
@@ -0,0 +1,60 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+// Finds out how much data to ask a device for at once. Drivers report an
+// optimal transfer size, but larger reads often do better as every read is a
+// round trip over USB. Each multiple of the optimal size is tried in turn and
+// the one that delivers the most bytes per second is kept; as conditions
+// change, the others are tried again every now and then
+class ReadSizeTuner
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+	static constexpr std::array<size_t, 5> MULTIPLIERS{ 1, 2, 4, 8, 16 };
+	// How much data to measure before moving on to the next multiple
+	static constexpr uint64_t BYTES_PER_TRIAL = 8 * 1024 * 1024;
+	// How much data to transfer using the best multiple before trying all of
+	// them again
+	static constexpr uint64_t BYTES_BETWEEN_TRIALS = 512 * 1024 * 1024;
+
+	// Reads are never made larger than this
+	explicit ReadSizeTuner(size_t maxReadSize = 16 * 1024 * 1024);
+
+	// May change from one read to the next
+	size_t GetReadSize(size_t optimalSize);
+	// The largest GetReadSize() may return, to size buffers
+	size_t GetMaxReadSize(size_t optimalSize) const;
+	// Only reads that returned everything asked for say anything about the
+	// throughput; shorter ones are at the end of a file
+	void Record(size_t readSize, size_t bytesRead, Clock::duration);
+
+private:
+	struct Trial
+	{
+		uint64_t bytes{};
+		Clock::duration duration{};
+	};
+
+	const size_t maxReadSize;
+	std::mutex mutex;
+	std::array<Trial, MULTIPLIERS.size()> trials;
+	size_t current{}; // index into MULTIPLIERS
+	size_t best{};
+	bool exploring{ true };
+	uint64_t bytesSinceTrials{};
+	size_t lastOptimalSize{};
+
+	void Advance();
+};
@@ -10,14 +10,15 @@
 #include "WorkingDialog.h"
 #include "Config.h"
 #include "WorkThread.h"
-#include <comdef.h>
+#include "ObjectStore.h"
 #include <QFileDialog>
 #include <QMessageBox>
 #include <QStandardItemModel>
+#include <filesystem>
 
 namespace
 {
-    CComPtr<IPortableDevice> activeDevice;
+    mtp::SessionPtr activeDevice;
     Configuration config;
 
     void UpdateDeviceList(Ui::ReplicAndroidClass& ui)
@@ -50,19 +51,19 @@ namespace
             config.what.push_back(std::move(wi));
         }
         config.where = "C:/Temp";
+        config.deduplicate = false;
     }
 
     void ReportError(QWidget* parent, HRESULT hr)
     {
-        auto e = _com_error(hr);
-        QString s = QString("Error: %1 (%2)").arg(e.ErrorMessage(), hr);
+        QString s = QString("Error: %1").arg(QString::fromStdString(mtp::DescribeError(hr)));
         QMessageBox::critical(parent, "Error occured", s);
     }
 }
 
 void ReplicAndroid::OnDeviceOpenedOrClosed()
 {
-	const bool isDeviceConnected = activeDevice;
+	const bool isDeviceConnected = activeDevice != nullptr;
 
 	if (isDeviceConnected) {
 		ui.btnConnect->setText("&Disconnect");
@@ -77,13 +78,15 @@ void ReplicAndroid::OnDeviceOpenedOrClosed()
 	ui.btnWhatAdd->setEnabled(isDeviceConnected);
 	ui.btnWhatRemove->setEnabled(false);
 	ui.btnWhereBrowse->setEnabled(isDeviceConnected);
+	ui.chkAllDevices->setEnabled(isDeviceConnected);
+	ui.chkDeduplicate->setEnabled(isDeviceConnected);
 	ui.btnStart->setEnabled(isDeviceConnected);
 }
 
 void ReplicAndroid::OnConnectClicked()
 {
     if (activeDevice) {
-        activeDevice.Release();
+        activeDevice.reset();
     } else {
         const auto deviceId = ui.cmbDevices->currentData().toString();
         auto device = mtp::OpenDevice(deviceId.toStdString());
@@ -150,41 +153,79 @@ void ReplicAndroid::UpdateWhatModel()
 void ReplicAndroid::UpdateWherePath()
 {
     ui.edtStorePath->setText(config.where.c_str());
+    ui.chkDeduplicate->setChecked(config.deduplicate);
 }
 
-void ReplicAndroid::OnStartClicked()
+void ReplicAndroid::OnDeduplicateToggled(bool checked)
 {
-    BackupLocations locations;
+    config.deduplicate = checked;
+}
 
+bool ReplicAndroid::AddBackupJob(std::vector<BackupJob>& jobs, const QString& name, mtp::SessionPtr device, const std::string& where)
+{
+    auto deviceConfig = config;
+    deviceConfig.where = where;
+
+    BackupLocations locations;
     for (const auto& what : config.what) {
-        auto objectId = mtp::Lookup(activeDevice, what.path);
+        auto objectId = device->Lookup(what.path);
         if (!objectId)
         {
             ReportError(this, objectId.GetResult());
-            return;
+            return false;
         }
         if (objectId->empty())
         {
             QString s;
             for (const auto& piece : what.path) { s += "/"; s += piece.c_str(); }
-            QMessageBox::critical(this, "Error", QString("Unable to locate %1 on device, aborting backup").arg(s));
-            return;
+            QMessageBox::critical(this, "Error", QString("Unable to locate %1 on %2, aborting backup").arg(s, name));
+            return false;
         }
 
-        std::string destLocation;
-        for (const auto& piece : what.path) {
-            destLocation += piece;
-        }
-        destLocation.erase(std::remove_if(destLocation.begin(), destLocation.end(), [](const auto v) {
-            const auto ch = static_cast<unsigned char>(v);
-            return !std::isalnum(ch);
-		}), destLocation.end());
+        std::string destPath = GetDestinationPath(deviceConfig, what);
+        locations.push_back({ *objectId, destPath, Filter(what.filters) });
+    }
+    jobs.push_back({ name, std::move(device), std::move(locations) });
+    return true;
+}
 
-        std::string destPath = config.where + '/' + destLocation;
-        locations.push_back({ *objectId, destPath });
+void ReplicAndroid::OnStartClicked()
+{
+    std::vector<BackupJob> jobs;
+    if (!ui.chkAllDevices->isChecked()) {
+        if (!AddBackupJob(jobs, ui.cmbDevices->currentText(), activeDevice, config.where)) return;
+    } else {
+        // Every device gets a directory of its own; the one that is already
+        // connected need not be opened again
+        auto devices = mtp::EnumeratePortableDevices();
+        if (!devices)
+        {
+            ReportError(this, devices.GetResult());
+            return;
+        }
+        const auto activeDeviceId = ui.cmbDevices->currentData().toString().toStdString();
+        for (const auto& device : *devices) {
+            auto session = device.id == activeDeviceId ? mtp::ExpectedOrHResult<mtp::SessionPtr>{ mtp::SessionPtr(activeDevice) } : mtp::OpenDevice(device.id);
+            if (!session)
+            {
+                ReportError(this, session.GetResult());
+                return;
+            }
+            const auto name = device.friendlyName.value_or(device.id);
+            const auto where = GetDeviceDirectory(config.where, device.id, name);
+            std::error_code ec;
+            std::filesystem::create_directory(where, ec);
+            if (!AddBackupJob(jobs, QString::fromStdString(name), *session, where)) return;
+        }
     }
 
-	WorkingDialog dlg(this, activeDevice, std::move(locations));
+    BackupOptions options;
+    if (config.deduplicate) options.objectStore = config.where + '/' + ObjectStore::DIRECTORY_NAME;
+    options.directIo = config.directIo;
+    options.checksums = config.checksums;
+    options.scanThreads = config.scanThreads;
+
+	WorkingDialog dlg(this, std::move(jobs), std::move(options));
     dlg.exec();
 }
 
@@ -200,6 +241,7 @@ ReplicAndroid::ReplicAndroid(QWidget *parent)
     connect(ui.btnWhatRemove, &QPushButton::clicked, this, &ReplicAndroid::OnWhatRemoveClicked);
     connect(ui.lvWhat->selectionModel(), &QItemSelectionModel::currentChanged, this, &ReplicAndroid::OnWhatSelectionChanged);
     connect(ui.btnWhereBrowse, &QPushButton::clicked, this, &ReplicAndroid::OnWhereClicked);
+    connect(ui.chkDeduplicate, &QCheckBox::toggled, this, &ReplicAndroid::OnDeduplicateToggled);
     connect(ui.btnStart, &QPushButton::clicked, this, &ReplicAndroid::OnStartClicked);
 
     ui.lvWhat->setEditTriggers(QAbstractItemView::NoEditTriggers);
@@ -8,8 +8,11 @@
 
 #include <QtWidgets/QWidget>
 #include "ui_ReplicAndroid.h"
+#include "MTP.h"
+#include <vector>
 
 class QStandardItemModel;
+struct BackupJob;
 
 class ReplicAndroid : public QWidget
 {
@@ -21,10 +24,12 @@ private:
     void OnDeviceOpenedOrClosed();
     void UpdateWhatModel();
     void UpdateWherePath();
+    bool AddBackupJob(std::vector<BackupJob>& jobs, const QString& name, mtp::SessionPtr device, const std::string& where);
 
 private slots:
     void OnConnectClicked();
     void OnWhereClicked();
+    void OnDeduplicateToggled(bool checked);
     void OnWhatAddClicked();
     void OnWhatRemoveClicked();
     void OnWhatSelectionChanged();
@@ -0,0 +1,430 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#include "Backup.h"
+#include "Config.h"
+#include "MTP.h"
+#include "MTPBackend.h"
+#include "Manifest.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <new>
+#include <optional>
+#include <string>
+#include <vector>
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+// Measures the backup engine against synthetic devices of a few typical
+// shapes, so that builds can be compared. Every shape goes through the
+// same phases: looking up files, a first backup, a backup with nothing
+// changed, and one without the manifest where every file is checked on
+// disk. Results are printed as JSON
+namespace
+{
+	std::atomic<uint64_t> numAllocations{};
+}
+
+// Counted for every object, to see how much the engine allocates per file
+void* operator new(std::size_t size)
+{
+	++numAllocations;
+	if (auto p = std::malloc(size > 0 ? size : 1); p) return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+namespace
+{
+	enum ExitCode
+	{
+		EXIT_OK = 0,
+		EXIT_USAGE = 1,  // bad arguments
+		EXIT_FAILED = 2, // a phase could not be completed
+	};
+
+	struct Shape
+	{
+		const char* name;
+		const char* description;
+		std::vector<mtp::SyntheticFiles> files;
+	};
+
+	const std::vector<Shape>& GetShapes()
+	{
+		constexpr uint64_t KB = 1024, MB = 1024 * KB, GB = 1024 * MB;
+		static const std::vector<Shape> shapes{
+			{ "photos", "10k photos of 3 MB", { { "Internal/DCIM/Camera", 10'000, 3 * MB, ".jpg" } } },
+			{ "cache", "1M files of 2 KB in folders of 1000", { { "Internal/Android/data/com.example.app/cache", 1'000'000, 2 * KB, ".tmp", 1000 } } },
+			{ "videos", "3 videos of 4 GB", { { "Internal/Movies", 3, 4 * GB, ".mp4" } } },
+		};
+		return shapes;
+	}
+
+	struct Settings
+	{
+		std::vector<const Shape*> shapes;
+		double scale{ 1.0 };
+		mtp::SimulatedDeviceOptions device;
+		unsigned int scanThreads{ 1 };
+		size_t numLookups{ 1000 };
+		std::filesystem::path where;
+		bool keep{};
+		bool verbose{};
+	};
+
+	struct PhaseResult
+	{
+		const char* name;
+		bool complete{};
+		double seconds{};
+		uint64_t objects{};
+		uint64_t bytes{};
+		float scanSeconds{};
+		uint64_t allocations{};
+		uint64_t peakRss{};
+	};
+
+	uint64_t GetPeakRss()
+	{
+#ifdef _WIN32
+		PROCESS_MEMORY_COUNTERS counters{};
+		if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+		return counters.PeakWorkingSetSize;
+#else
+		rusage usage{};
+		if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+		return static_cast<uint64_t>(usage.ru_maxrss);
+#else
+		return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+#endif
+	}
+
+	void Append(std::string& s, const char* format, ...)
+	{
+		char buffer[512];
+		va_list args;
+		va_start(args, format);
+		std::vsnprintf(buffer, sizeof(buffer), format, args);
+		va_end(args);
+		s += buffer;
+	}
+
+	void PrintUsage(const char* program)
+	{
+		std::fprintf(stderr,
+			"usage: %s --shape <name> [options]\n"
+			"  --shape <name>       device to generate; may be given more than once:\n", program);
+		for (const auto& shape : GetShapes())
+			std::fprintf(stderr, "                         %-8s %s\n", shape.name, shape.description);
+		std::fprintf(stderr,
+			"  --scale <factor>     multiply the number of files of every shape, such as 0.01\n"
+			"                       for a quick run; once down to a single file, its size\n"
+			"                       is multiplied instead\n"
+			"  --latency-us <n>     time every call to the device takes\n"
+			"  --bandwidth <n>      bytes/second the device delivers (default unlimited)\n"
+			"  --scan-threads <n>   number of folders to list at the same time (default 1)\n"
+			"  --lookups <n>        number of files to look up by path (default 1000)\n"
+			"  --where <directory>  where to store the backups (default the temp directory);\n"
+			"                       removed when done\n"
+			"  --keep               leave the backups in place\n"
+			"  --output <file>      save the results as JSON, besides printing them\n"
+			"  --verbose            print device and disk statistics on stderr\n");
+	}
+
+	std::vector<mtp::SyntheticFiles> ScaleFiles(const Shape& shape, double scale)
+	{
+		auto files = shape.files;
+		for (auto& f : files) {
+			const auto numFiles = f.numFiles * scale;
+			f.numFiles = std::max<size_t>(1, static_cast<size_t>(numFiles));
+			// Shapes of a few large files shrink by their size instead, so
+			// that a quick run is quick for them too
+			if (numFiles < 1) f.size = std::max<uint64_t>(1, static_cast<uint64_t>(f.size * numFiles));
+		}
+		return files;
+	}
+
+	// Sessions are wrapped the way mtp::OpenDevice() does it, so that the
+	// caching and tracing are measured as well. A new one for every phase
+	// starts out with nothing cached, like a new run of the program
+	mtp::ExpectedOrHResult<mtp::SessionPtr> OpenDevice(const std::vector<mtp::SyntheticFiles>& files, const Settings& settings)
+	{
+		auto session = mtp::OpenSyntheticDevice(files, settings.device);
+		if (!session) return session.GetResult();
+		return mtp::CreateCachedSession(mtp::CreateInstrumentedSession(std::move(*session)));
+	}
+
+	template<typename Fn> PhaseResult MeasurePhase(const char* name, Fn fn)
+	{
+		PhaseResult result;
+		result.name = name;
+		const auto allocations = numAllocations.load();
+		const auto start = std::chrono::steady_clock::now();
+		fn(result);
+		result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		result.allocations = numAllocations.load() - allocations;
+		result.peakRss = GetPeakRss();
+		return result;
+	}
+
+	PhaseResult MeasureLookups(const std::vector<mtp::SyntheticFiles>& files, const Settings& settings)
+	{
+		// Spread over all files, so that most folders are listed
+		std::vector<std::vector<std::string>> paths;
+		size_t numFiles{};
+		for (const auto& f : files) numFiles += f.numFiles;
+		const auto numLookups = std::min(settings.numLookups, numFiles);
+		for (const auto& f : files) {
+			const auto count = std::max<size_t>(1, numLookups * f.numFiles / numFiles);
+			for (size_t n = 0; n < count; ++n)
+				paths.push_back(mtp::GetSyntheticPath(f, n * f.numFiles / count));
+		}
+
+		auto session = OpenDevice(files, settings);
+		return MeasurePhase("lookup", [&](PhaseResult& result) {
+			if (!session) return;
+			result.complete = true;
+			for (const auto& path : paths) {
+				auto objectId = (*session)->Lookup(path);
+				if (!objectId || objectId->empty()) {
+					result.complete = false;
+					break;
+				}
+				++result.objects;
+			}
+		});
+	}
+
+	PhaseResult MeasureBackup(const char* name, const std::vector<mtp::SyntheticFiles>& files, const std::filesystem::path& where, const Settings& settings)
+	{
+		auto session = OpenDevice(files, settings);
+		if (!session) return { name };
+
+		// The storages are backed up as a whole
+		BackupLocations locations;
+		for (const auto& f : files) {
+			const auto storage = mtp::GetSyntheticPath(f, 0).front();
+			if (std::any_of(locations.begin(), locations.end(), [&](const auto& l) { return l.where == (where / storage).string(); })) continue;
+			auto objectId = (*session)->Lookup({ storage });
+			if (!objectId || objectId->empty()) return { name };
+			locations.push_back({ *objectId, (where / storage).string(), Filter() });
+		}
+
+		BackupOptions options;
+		options.writeBudget = std::make_shared<WriteBudget>();
+		options.scanThreads = settings.scanThreads;
+		Backup backup(*session, std::move(locations), options);
+		auto phase = MeasurePhase(name, [&](PhaseResult& result) {
+			const auto r = backup.Run();
+			result.complete = r.complete && r.failedItems.empty();
+			result.objects = r.items.itemsTransferredSuccessfully + r.items.itemsTransferredSkipped + r.items.itemsTransferredFailures;
+			result.bytes = r.items.bytesRead;
+			result.scanSeconds = r.scanSeconds;
+		});
+		if (settings.verbose) {
+			std::fprintf(stderr, "%s\n", name);
+			std::fputs(backup.GetStatistics().GetSummary().c_str(), stderr);
+		}
+		return phase;
+	}
+
+	void RemoveManifests(const std::filesystem::path& where)
+	{
+		std::error_code ec;
+		for (auto it = std::filesystem::recursive_directory_iterator(where, ec); !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+			if (it->path().filename() == Manifest::FILE_NAME) std::filesystem::remove(it->path(), ec);
+		}
+	}
+
+	void AppendPhase(std::string& json, const PhaseResult& phase)
+	{
+		const auto perSecond = [&](double value) { return phase.seconds > 0 ? value / phase.seconds : 0.0; };
+		Append(json, "        {\n");
+		Append(json, "          \"phase\": \"%s\",\n", phase.name);
+		Append(json, "          \"complete\": %s,\n", phase.complete ? "true" : "false");
+		Append(json, "          \"seconds\": %.3f,\n", phase.seconds);
+		Append(json, "          \"scanSeconds\": %.3f,\n", phase.scanSeconds);
+		Append(json, "          \"objects\": %llu,\n", static_cast<unsigned long long>(phase.objects));
+		Append(json, "          \"objectsPerSecond\": %.1f,\n", perSecond(static_cast<double>(phase.objects)));
+		Append(json, "          \"bytes\": %llu,\n", static_cast<unsigned long long>(phase.bytes));
+		Append(json, "          \"megabytesPerSecond\": %.1f,\n", perSecond(phase.bytes / (1024.0 * 1024.0)));
+		Append(json, "          \"allocations\": %llu,\n", static_cast<unsigned long long>(phase.allocations));
+		Append(json, "          \"allocationsPerObject\": %.1f,\n", phase.objects > 0 ? static_cast<double>(phase.allocations) / phase.objects : 0.0);
+		// Of the whole process so far, so it never goes down between phases;
+		// run a single shape to get the peak of that shape alone
+		Append(json, "          \"peakRssBytes\": %llu\n", static_cast<unsigned long long>(phase.peakRss));
+		Append(json, "        }");
+	}
+
+	bool ParseNumber(const char* s, unsigned long long& value)
+	{
+		char* end;
+		value = std::strtoull(s, &end, 10);
+		return *s != '\0' && *end == '\0';
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	Settings settings;
+	std::string output;
+	for (int n = 1; n < argc; ++n) {
+		const std::string arg = argv[n];
+		const auto needsValue = arg == "--shape" || arg == "--scale" || arg == "--latency-us" || arg == "--bandwidth" ||
+			arg == "--scan-threads" || arg == "--lookups" || arg == "--where" || arg == "--output";
+		if (needsValue && n + 1 >= argc) {
+			std::fprintf(stderr, "%s needs a value\n", arg.c_str());
+			return EXIT_USAGE;
+		}
+
+		unsigned long long value{};
+		if (arg == "--shape") {
+			const std::string name = argv[++n];
+			const auto& shapes = GetShapes();
+			const auto it = std::find_if(shapes.begin(), shapes.end(), [&](const auto& shape) { return name == shape.name; });
+			if (it == shapes.end()) {
+				std::fprintf(stderr, "unknown shape '%s'\n", name.c_str());
+				return EXIT_USAGE;
+			}
+			settings.shapes.push_back(&*it);
+		} else if (arg == "--scale") {
+			char* end;
+			settings.scale = std::strtod(argv[++n], &end);
+			if (*end != '\0' || !(settings.scale > 0)) {
+				std::fprintf(stderr, "--scale must be a positive number\n");
+				return EXIT_USAGE;
+			}
+		} else if (arg == "--latency-us") {
+			if (!ParseNumber(argv[++n], value)) {
+				std::fprintf(stderr, "--latency-us must be a number\n");
+				return EXIT_USAGE;
+			}
+			settings.device.latency = std::chrono::microseconds(value);
+		} else if (arg == "--bandwidth") {
+			if (!ParseNumber(argv[++n], value)) {
+				std::fprintf(stderr, "--bandwidth must be a number\n");
+				return EXIT_USAGE;
+			}
+			settings.device.bandwidth = static_cast<size_t>(value);
+		} else if (arg == "--scan-threads") {
+			if (!ParseScanThreads(argv[++n], settings.scanThreads)) {
+				std::fprintf(stderr, "--scan-threads must be a number from 1 to %u\n", MAX_SCAN_THREADS);
+				return EXIT_USAGE;
+			}
+		} else if (arg == "--lookups") {
+			if (!ParseNumber(argv[++n], value)) {
+				std::fprintf(stderr, "--lookups must be a number\n");
+				return EXIT_USAGE;
+			}
+			settings.numLookups = static_cast<size_t>(value);
+		} else if (arg == "--where") {
+			settings.where = argv[++n];
+		} else if (arg == "--keep") {
+			settings.keep = true;
+		} else if (arg == "--output") {
+			output = argv[++n];
+		} else if (arg == "--verbose") {
+			settings.verbose = true;
+		} else {
+			PrintUsage(argv[0]);
+			return EXIT_USAGE;
+		}
+	}
+	if (settings.shapes.empty()) {
+		PrintUsage(argv[0]);
+		return EXIT_USAGE;
+	}
+
+	std::error_code ec;
+	if (settings.where.empty()) settings.where = std::filesystem::temp_directory_path(ec) / "replicandroid-bench";
+	std::filesystem::create_directories(settings.where, ec);
+	if (ec) {
+		std::fprintf(stderr, "cannot create %s: %s\n", settings.where.string().c_str(), ec.message().c_str());
+		return EXIT_USAGE;
+	}
+
+	std::string json;
+	Append(json, "{\n");
+	Append(json, "  \"scale\": %g,\n", settings.scale);
+	Append(json, "  \"latencyUs\": %lld,\n", static_cast<long long>(settings.device.latency.count()));
+	Append(json, "  \"bandwidth\": %zu,\n", settings.device.bandwidth);
+	Append(json, "  \"scanThreads\": %u,\n", settings.scanThreads);
+	Append(json, "  \"shapes\": [");
+
+	bool allComplete = true;
+	for (size_t s = 0; s < settings.shapes.size(); ++s) {
+		const auto& shape = *settings.shapes[s];
+		const auto files = ScaleFiles(shape, settings.scale);
+		// Only what we created ourselves is removed again
+		const auto where = settings.where / shape.name;
+		if (std::filesystem::exists(where, ec)) {
+			std::fprintf(stderr, "%s already exists\n", where.string().c_str());
+			return EXIT_USAGE;
+		}
+		std::filesystem::create_directory(where, ec);
+
+		std::vector<PhaseResult> phases;
+		phases.push_back(MeasureLookups(files, settings));
+		phases.push_back(MeasureBackup("backup", files, where, settings));
+		// Everything is skipped by way of the manifest
+		phases.push_back(MeasureBackup("unchanged", files, where, settings));
+		// Everything is skipped, but only after looking at the files on disk
+		RemoveManifests(where);
+		phases.push_back(MeasureBackup("present", files, where, settings));
+		if (!settings.keep) std::filesystem::remove_all(where, ec);
+
+		size_t numFiles{};
+		uint64_t numBytes{};
+		for (const auto& f : files) {
+			numFiles += f.numFiles;
+			numBytes += f.numFiles * f.size;
+		}
+		Append(json, "%s\n    {\n", s > 0 ? "," : "");
+		Append(json, "      \"shape\": \"%s\",\n", shape.name);
+		Append(json, "      \"files\": %zu,\n", numFiles);
+		Append(json, "      \"bytes\": %llu,\n", static_cast<unsigned long long>(numBytes));
+		Append(json, "      \"phases\": [");
+		for (size_t p = 0; p < phases.size(); ++p) {
+			Append(json, "%s\n", p > 0 ? "," : "");
+			AppendPhase(json, phases[p]);
+			if (!phases[p].complete) allComplete = false;
+		}
+		Append(json, "\n      ]\n    }");
+	}
+	Append(json, "\n  ]\n}\n");
+
+	std::fputs(json.c_str(), stdout);
+	if (!output.empty()) {
+		std::ofstream ofs(output, std::ofstream::out | std::ofstream::trunc | std::ofstream::binary);
+		if (!(ofs << json).flush()) {
+			std::fprintf(stderr, "cannot write %s\n", output.c_str());
+			return EXIT_FAILED;
+		}
+	}
+	return allComplete ? EXIT_OK : EXIT_FAILED;
+}
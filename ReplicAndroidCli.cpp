@@ -0,0 +1,482 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#include "Archive.h"
+#include "Backup.h"
+#include "Checksums.h"
+#include "Config.h"
+#include "MTP.h"
+#include "ObjectStore.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef _WIN32
+#include <objbase.h>
+#endif
+
+// Runs a backup without any user interface, for scheduled backups and for
+// measuring the engine. The result is printed as JSON to stdout; the exit
+// code tells what happened
+namespace
+{
+	enum ExitCode
+	{
+		EXIT_OK = 0,
+		EXIT_USAGE = 1,        // bad arguments or configuration
+		EXIT_DEVICE = 2,       // device not found or could not be opened
+		EXIT_NOT_FOUND = 3,    // a location to back up does not exist
+		EXIT_ITEMS_FAILED = 4, // backup done, but some files could not be copied
+		EXIT_ABORTED = 5,      // interrupted, or the device could not be walked entirely
+	};
+
+	volatile std::sig_atomic_t interrupted{};
+
+	void OnInterrupt(int)
+	{
+		interrupted = 1;
+	}
+
+	void PrintUsage(const char* program)
+	{
+		std::fprintf(stderr,
+			"usage: %s [options]\n"
+			"  --list               list the available devices and exit\n"
+			"  --config <file>      read the settings below from a file\n"
+			"  --device <id|name>   device to back up; may be given more than once, or left\n"
+			"                       out if there is only one\n"
+			"  --all-devices        back up all connected devices at the same time\n"
+			"  --what <path>        location on the device, such as 'Internal storage/DCIM';\n"
+			"                       may be given more than once\n"
+			"  --include <rule>     back up what matches the rule, such as 'type:image', even\n"
+			"                       if a later rule excludes it; applies to the last --what\n"
+			"  --exclude <rule>     leave out what matches the rule, such as\n"
+			"                       'name:.trashed-*' or 'type:video min-size:1G'\n"
+			"  --where <directory>  where to store the backup\n"
+			"  --deduplicate        store identical files only once\n"
+			"  --direct-io          write files without going through the OS cache\n"
+			"  --archive            store the files of every location in a single tar file\n"
+			"  --compress           compress the archive using zstd; implies --archive\n"
+			"  --checksums          record the hash of every file copied, for --verify\n"
+			"  --schedule <policy>  order in which to copy files: discovery (default),\n"
+			"                       smallest-first, largest-first, storage-order or\n"
+			"                       newest-first\n"
+			"  --scan-threads <n>   number of folders to list at the same time (default 1)\n"
+			"  --progress           report progress on stderr every second\n"
+			"  --verbose            print device and disk statistics on stderr when done\n"
+			"  --verify             check the files below --where against their recorded\n"
+			"                       hashes instead of backing up\n", program);
+	}
+
+	std::string DescribeWhat(const WhatItem& what)
+	{
+		std::string s;
+		for (const auto& piece : what.path) { s += "/"; s += piece; }
+		return s;
+	}
+
+	std::string EscapeJson(const std::string& s)
+	{
+		std::string result;
+		for (const auto ch : s) {
+			switch (ch) {
+				case '"': result += "\\\""; break;
+				case '\\': result += "\\\\"; break;
+				case '\n': result += "\\n"; break;
+				case '\r': result += "\\r"; break;
+				case '\t': result += "\\t"; break;
+				default:
+					if (static_cast<unsigned char>(ch) < 0x20) {
+						char escaped[8];
+						std::snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned int>(ch));
+						result += escaped;
+					} else {
+						result += ch;
+					}
+			}
+		}
+		return result;
+	}
+
+	// Needs no device; the work is spread over all processors
+	int VerifyBackup(const std::string& where)
+	{
+		const auto startTime = std::chrono::steady_clock::now();
+		const auto result = VerifyChecksums(where, std::thread::hardware_concurrency());
+		const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+		auto printPaths = [](const std::vector<std::string>& paths) {
+			std::printf("[");
+			for (size_t n = 0; n < paths.size(); ++n)
+				std::printf("%s\n    \"%s\"", n > 0 ? "," : "", EscapeJson(paths[n]).c_str());
+			std::printf("%s]", paths.empty() ? "" : "\n  ");
+		};
+		std::printf("{\n");
+		std::printf("  \"verified\": %zu,\n", result.filesVerified);
+		std::printf("  \"bytes\": %llu,\n", static_cast<unsigned long long>(result.bytesVerified));
+		std::printf("  \"seconds\": %.3f,\n", seconds);
+		std::printf("  \"mismatched\": ");
+		printPaths(result.mismatched);
+		std::printf(",\n  \"missing\": ");
+		printPaths(result.missing);
+		std::printf("\n}\n");
+		return result.mismatched.empty() && result.missing.empty() ? EXIT_OK : EXIT_ITEMS_FAILED;
+	}
+
+	int ListDevices()
+	{
+		auto devices = mtp::EnumeratePortableDevices();
+		if (!devices) {
+			std::fprintf(stderr, "cannot enumerate devices: %s\n", mtp::DescribeError(devices.GetResult()).c_str());
+			return EXIT_DEVICE;
+		}
+		for (const auto& device : *devices)
+			std::printf("%s\t%s\n", device.id.c_str(), device.friendlyName.value_or("<none>").c_str());
+		return EXIT_OK;
+	}
+
+	// Accepts either device IDs or friendly names. Without any, the one
+	// device that is connected is used, or all of them if asked for
+	std::optional<std::vector<mtp::PortableDevice>> FindDevices(const std::vector<std::string>& wanted, bool all)
+	{
+		auto devices = mtp::EnumeratePortableDevices();
+		if (!devices) {
+			std::fprintf(stderr, "cannot enumerate devices: %s\n", mtp::DescribeError(devices.GetResult()).c_str());
+			return {};
+		}
+		if (all || wanted.empty()) {
+			if (devices->empty()) {
+				std::fprintf(stderr, "no devices found\n");
+				return {};
+			}
+			if (!all && devices->size() > 1) {
+				std::fprintf(stderr, "more than one device found; use --device or --all-devices\n");
+				return {};
+			}
+			return std::move(*devices);
+		}
+
+		std::vector<mtp::PortableDevice> result;
+		for (const auto& device : wanted) {
+			auto it = std::find_if(devices->begin(), devices->end(), [&](const auto& d) {
+				return d.id == device || d.friendlyName == device;
+			});
+			if (it != devices->end()) {
+				result.push_back(*it);
+			} else if (device.find(':') != std::string::npos) {
+				// Simulated devices need not be listed to be opened
+				result.push_back({ device, device, {}, {} });
+			} else {
+				std::fprintf(stderr, "device '%s' not found\n", device.c_str());
+				return {};
+			}
+		}
+		return result;
+	}
+
+	// A backup of a single device; each runs on a thread of its own
+	struct DeviceBackup
+	{
+		mtp::PortableDevice device;
+		std::unique_ptr<Backup> backup;
+		Backup::Result result;
+		std::atomic<bool> done{};
+		std::thread thread;
+	};
+
+	void PrintItems(const char* indent, const ItemsUpdate& items, const NumbersAvailable& numbers, double seconds)
+	{
+		std::printf("%s\"itemsTotal\": %u,\n", indent, numbers.totalNumberOfItems);
+		std::printf("%s\"itemsCopied\": %u,\n", indent, items.itemsTransferredSuccessfully);
+		std::printf("%s\"itemsSkipped\": %u,\n", indent, items.itemsTransferredSkipped);
+		std::printf("%s\"itemsFailed\": %u,\n", indent, items.itemsTransferredFailures);
+		std::printf("%s\"bytesTotal\": %llu,\n", indent, static_cast<unsigned long long>(numbers.totalNumberOfBytes));
+		std::printf("%s\"bytesRead\": %llu,\n", indent, static_cast<unsigned long long>(items.bytesRead));
+		std::printf("%s\"bytesSkipped\": %llu,\n", indent, static_cast<unsigned long long>(items.bytesSkipped));
+		std::printf("%s\"bytesPerSecond\": %.0f,\n", indent, seconds > 0 ? items.bytesRead / seconds : 0.0);
+	}
+
+	// How long it took until the first, a given share and all of the copied
+	// files were safe, for comparing schedules
+	void PrintCompletion(const char* indent, const std::vector<float>& completedAt)
+	{
+		std::printf("%s\"secondsUntilCopied\": {", indent);
+		if (!completedAt.empty()) {
+			const auto at = [&](size_t percentage) {
+				return completedAt[(completedAt.size() * percentage + 99) / 100 - 1];
+			};
+			std::printf(" \"first\": %.3f, \"10%%\": %.3f, \"50%%\": %.3f, \"90%%\": %.3f, \"all\": %.3f ",
+				completedAt.front(), at(10), at(50), at(90), completedAt.back());
+		}
+		std::printf("},\n");
+	}
+
+	// Totals first, followed by the results of every device
+	void PrintResults(const std::vector<std::unique_ptr<DeviceBackup>>& backups, const Configuration& config, double seconds)
+	{
+		ItemsUpdate total;
+		NumbersAvailable totalNumbers;
+		bool complete = true;
+		for (const auto& b : backups) {
+			const auto numbers = b->backup->GetProgress().GetNumbers();
+			total.itemsTransferredSuccessfully += b->result.items.itemsTransferredSuccessfully;
+			total.itemsTransferredFailures += b->result.items.itemsTransferredFailures;
+			total.itemsTransferredSkipped += b->result.items.itemsTransferredSkipped;
+			total.bytesRead += b->result.items.bytesRead;
+			total.bytesSkipped += b->result.items.bytesSkipped;
+			totalNumbers.totalNumberOfItems += numbers.totalNumberOfItems;
+			totalNumbers.totalNumberOfBytes += numbers.totalNumberOfBytes;
+			complete = complete && b->result.complete;
+		}
+
+		std::printf("{\n");
+		std::printf("  \"complete\": %s,\n", complete ? "true" : "false");
+		std::printf("  \"seconds\": %.3f,\n", seconds);
+		std::printf("  \"schedule\": \"%s\",\n", GetSchedulePolicyName(config.schedule));
+		std::printf("  \"scanThreads\": %u,\n", config.scanThreads);
+		PrintItems("  ", total, totalNumbers, seconds);
+		std::printf("  \"devices\": [");
+		for (size_t n = 0; n < backups.size(); ++n) {
+			const auto& b = *backups[n];
+			std::printf("%s\n    {\n", n > 0 ? "," : "");
+			std::printf("      \"device\": \"%s\",\n", EscapeJson(b.device.id).c_str());
+			std::printf("      \"name\": \"%s\",\n", EscapeJson(b.device.friendlyName.value_or("")).c_str());
+			std::printf("      \"complete\": %s,\n", b.result.complete ? "true" : "false");
+			PrintItems("      ", b.result.items, b.backup->GetProgress().GetNumbers(), seconds);
+			PrintCompletion("      ", b.result.completedAt);
+			std::printf("      \"itemsRetried\": %u,\n", b.result.itemsRetried);
+			std::printf("      \"scanSeconds\": %.3f,\n", b.result.scanSeconds);
+			std::printf("      \"failed\": [");
+			for (size_t i = 0; i < b.result.failedItems.size(); ++i) {
+				const auto& failed = b.result.failedItems[i];
+				std::printf("%s\n        { \"path\": \"%s\", \"class\": \"%s\", \"error\": \"%s\" }", i > 0 ? "," : "",
+					EscapeJson(failed.destPath).c_str(), mtp::GetErrorClassName(failed.errorClass), EscapeJson(failed.error).c_str());
+			}
+			std::printf("%s]\n    }", b.result.failedItems.empty() ? "" : "\n      ");
+		}
+		std::printf("\n  ]\n");
+		std::printf("}\n");
+	}
+
+	void PrintProgress(const DeviceBackup& b)
+	{
+		const auto& p = b.backup->GetProgress();
+		const auto numbers = p.GetNumbers();
+		const auto items = p.GetItems();
+		std::fprintf(stderr, "%s: %u/%u%s items, %llu/%llu bytes\n",
+			b.device.friendlyName.value_or(b.device.id).c_str(),
+			items.itemsTransferredSuccessfully + items.itemsTransferredSkipped + items.itemsTransferredFailures,
+			numbers.totalNumberOfItems, p.scanComplete ? "" : "+",
+			static_cast<unsigned long long>(items.bytesRead + items.bytesSkipped + p.bytesInProgress.load(std::memory_order_relaxed)),
+			static_cast<unsigned long long>(numbers.totalNumberOfBytes));
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	Configuration config;
+	bool list{}, allDevices{}, progress{}, verbose{}, verify{};
+	for (int n = 1; n < argc; ++n) {
+		const std::string arg = argv[n];
+		const auto needsValue = arg == "--config" || arg == "--device" || arg == "--what" || arg == "--where" || arg == "--schedule" ||
+			arg == "--scan-threads" || arg == "--include" || arg == "--exclude";
+		if (needsValue && n + 1 >= argc) {
+			std::fprintf(stderr, "%s needs a value\n", arg.c_str());
+			return EXIT_USAGE;
+		}
+
+		if (arg == "--list") {
+			list = true;
+		} else if (arg == "--config") {
+			std::string error;
+			if (!LoadConfiguration(argv[++n], config, error)) {
+				std::fprintf(stderr, "%s\n", error.c_str());
+				return EXIT_USAGE;
+			}
+		} else if (arg == "--device") {
+			config.devices.push_back(argv[++n]);
+		} else if (arg == "--all-devices") {
+			allDevices = true;
+		} else if (arg == "--what") {
+			config.what.push_back(ParseWhatItem(argv[++n]));
+		} else if (arg == "--include" || arg == "--exclude") {
+			if (config.what.empty()) {
+				std::fprintf(stderr, "%s must follow --what\n", arg.c_str());
+				return EXIT_USAGE;
+			}
+			FilterRule rule;
+			std::string error;
+			if (!ParseFilterRule(arg == "--include" ? FilterAction::Include : FilterAction::Exclude, argv[++n], rule, error)) {
+				std::fprintf(stderr, "%s: %s\n", arg.c_str(), error.c_str());
+				return EXIT_USAGE;
+			}
+			config.what.back().filters.push_back(std::move(rule));
+		} else if (arg == "--where") {
+			config.where = argv[++n];
+		} else if (arg == "--deduplicate") {
+			config.deduplicate = true;
+		} else if (arg == "--direct-io") {
+			config.directIo = true;
+		} else if (arg == "--archive") {
+			config.archive = true;
+		} else if (arg == "--compress") {
+			config.compress = true;
+		} else if (arg == "--checksums") {
+			config.checksums = true;
+		} else if (arg == "--schedule") {
+			if (!ParseSchedulePolicy(argv[++n], config.schedule)) {
+				std::fprintf(stderr, "unknown schedule '%s'\n", argv[n]);
+				return EXIT_USAGE;
+			}
+		} else if (arg == "--scan-threads") {
+			if (!ParseScanThreads(argv[++n], config.scanThreads)) {
+				std::fprintf(stderr, "--scan-threads must be a number from 1 to %u\n", MAX_SCAN_THREADS);
+				return EXIT_USAGE;
+			}
+		} else if (arg == "--progress") {
+			progress = true;
+		} else if (arg == "--verbose") {
+			verbose = true;
+		} else if (arg == "--verify") {
+			verify = true;
+		} else {
+			PrintUsage(argv[0]);
+			return EXIT_USAGE;
+		}
+	}
+
+#ifdef _WIN32
+	// The user interface gets this from Qt
+	CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+#endif
+	if (list) return ListDevices();
+	if (verify) {
+		if (config.where.empty()) {
+			PrintUsage(argv[0]);
+			return EXIT_USAGE;
+		}
+		return VerifyBackup(config.where);
+	}
+	if (config.what.empty() || config.where.empty()) {
+		PrintUsage(argv[0]);
+		return EXIT_USAGE;
+	}
+
+	if (config.compress && !Archive::IsCompressionSupported()) {
+		std::fprintf(stderr, "compression is not supported by this build\n");
+		return EXIT_USAGE;
+	}
+	if ((config.archive || config.compress) && config.deduplicate) {
+		std::fprintf(stderr, "archives cannot be deduplicated\n");
+		return EXIT_USAGE;
+	}
+	if ((config.archive || config.compress) && config.checksums) {
+		std::fprintf(stderr, "checksums are not recorded for archives\n");
+		return EXIT_USAGE;
+	}
+
+	// Unlike the directory picker, the command line may name a new directory
+	std::error_code ec;
+	std::filesystem::create_directories(config.where, ec);
+	if (ec) {
+		std::fprintf(stderr, "cannot create %s: %s\n", config.where.c_str(), ec.message().c_str());
+		return EXIT_USAGE;
+	}
+
+	const auto devices = FindDevices(config.devices, allDevices);
+	if (!devices) return EXIT_DEVICE;
+	// Backing up several devices at once keeps them apart; a single device
+	// goes where the user interface would put it
+	const auto perDeviceDirectory = allDevices || devices->size() > 1;
+
+	BackupOptions options;
+	if (config.deduplicate) options.objectStore = config.where + '/' + ObjectStore::DIRECTORY_NAME;
+	options.writeBudget = std::make_shared<WriteBudget>();
+	options.directIo = config.directIo;
+	options.schedule = config.schedule;
+	options.scanThreads = config.scanThreads;
+	options.archive = config.archive || config.compress;
+	options.compress = config.compress;
+	options.checksums = config.checksums;
+
+	std::vector<std::unique_ptr<DeviceBackup>> backups;
+	for (const auto& device : *devices) {
+		auto session = mtp::OpenDevice(device.id);
+		if (!session) {
+			std::fprintf(stderr, "cannot open device '%s': %s\n", device.id.c_str(), mtp::DescribeError(session.GetResult()).c_str());
+			return EXIT_DEVICE;
+		}
+
+		auto deviceConfig = config;
+		if (perDeviceDirectory) deviceConfig.where = GetDeviceDirectory(config.where, device.id, device.friendlyName.value_or(device.id));
+		BackupLocations locations;
+		for (const auto& what : config.what) {
+			auto objectId = (*session)->Lookup(what.path);
+			if (!objectId) {
+				std::fprintf(stderr, "cannot look up %s on '%s': %s\n", DescribeWhat(what).c_str(), device.id.c_str(), mtp::DescribeError(objectId.GetResult()).c_str());
+				return EXIT_DEVICE;
+			}
+			if (objectId->empty()) {
+				std::fprintf(stderr, "unable to locate %s on '%s'\n", DescribeWhat(what).c_str(), device.id.c_str());
+				return EXIT_NOT_FOUND;
+			}
+			locations.push_back({ *objectId, GetDestinationPath(deviceConfig, what), Filter(what.filters) });
+		}
+		if (perDeviceDirectory) std::filesystem::create_directory(deviceConfig.where, ec);
+
+		auto b = std::make_unique<DeviceBackup>();
+		b->device = device;
+		b->backup = std::make_unique<Backup>(*session, std::move(locations), options);
+		backups.push_back(std::move(b));
+	}
+
+	std::signal(SIGINT, OnInterrupt);
+	std::signal(SIGTERM, OnInterrupt);
+
+	// Every device is backed up by a thread of its own, so that this one
+	// can watch for interruptions and report progress
+	const auto startTime = std::chrono::steady_clock::now();
+	for (auto& b : backups) {
+		b->thread = std::thread([&b = *b] {
+			b.result = b.backup->Run();
+			b.done = true;
+		});
+	}
+
+	auto nextReport = startTime + std::chrono::seconds(1);
+	while (!std::all_of(backups.begin(), backups.end(), [](const auto& b) { return b->done.load(); })) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		if (interrupted) {
+			for (auto& b : backups) b->backup->Abort();
+		}
+		if (progress && std::chrono::steady_clock::now() >= nextReport) {
+			for (const auto& b : backups) PrintProgress(*b);
+			nextReport += std::chrono::seconds(1);
+		}
+	}
+	for (auto& b : backups) b->thread.join();
+	const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+	PrintResults(backups, config, seconds);
+	if (verbose) {
+		for (const auto& b : backups) {
+			std::fprintf(stderr, "%s\n", b->device.id.c_str());
+			std::fputs(b->backup->GetStatistics().GetSummary().c_str(), stderr);
+		}
+	}
+
+	const auto anyIncomplete = std::any_of(backups.begin(), backups.end(), [](const auto& b) { return !b->result.complete; });
+	const auto anyFailed = std::any_of(backups.begin(), backups.end(), [](const auto& b) { return !b->result.failedItems.empty(); });
+	if (anyIncomplete) return EXIT_ABORTED;
+	if (anyFailed) return EXIT_ITEMS_FAILED;
+	return EXIT_OK;
+}
@@ -0,0 +1,93 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#include "ScanTree.h"
+#include <algorithm>
+#include <cstring>
+
+ScanTree::ScanTree() = default;
+ScanTree::~ScanTree() = default;
+
+ScanTree::NodeID ScanTree::Add(NodeID parent, std::string_view name, std::string_view key, uint64_t size, int64_t modified, bool isFolder)
+{
+	if (IsFull()) return NO_NODE;
+	const auto id = static_cast<NodeID>(numNodes);
+	auto& chunk = chunks[id / NODES_PER_CHUNK];
+	if (!chunk) chunk = std::make_unique<Node[]>(NODES_PER_CHUNK);
+	// Folder names such as 'cache' recur all over; keys are unique
+	chunk[id % NODES_PER_CHUNK] = { parent, isFolder, Intern(name), Store(key), size, modified };
+	++numNodes;
+	return id;
+}
+
+std::string ScanTree::GetPath(NodeID id) const
+{
+	// Gathered from the bottom up, so that the path is allocated only once
+	std::vector<std::string_view> pieces;
+	size_t length = 0;
+	for (auto node = &Get(id); node->parent != NO_NODE; node = &Get(node->parent)) {
+		pieces.push_back(node->name);
+		length += node->name.size() + 1;
+	}
+
+	std::string path;
+	path.reserve(length);
+	for (auto it = pieces.rbegin(); it != pieces.rend(); ++it) {
+		if (!path.empty()) path += '/';
+		path += *it;
+	}
+	return path;
+}
+
+bool ScanTree::HasPath(NodeID id, std::string_view path) const
+{
+	// Compared from the end, as that is where the node is
+	for (auto node = &Get(id); node->parent != NO_NODE; node = &Get(node->parent)) {
+		if (path.size() < node->name.size() || path.substr(path.size() - node->name.size()) != node->name) return false;
+		path.remove_suffix(node->name.size());
+		if (Get(node->parent).parent == NO_NODE) break;
+		if (path.empty() || path.back() != '/') return false;
+		path.remove_suffix(1);
+	}
+	return path.empty();
+}
+
+size_t ScanTree::GetMemoryUsage() const
+{
+	const auto numChunks = (numNodes + NODES_PER_CHUNK - 1) / NODES_PER_CHUNK;
+	return numChunks * NODES_PER_CHUNK * sizeof(Node) + stringBytes;
+}
+
+std::string_view ScanTree::Store(std::string_view s)
+{
+	if (s.empty()) return {};
+	if (s.size() > stringSpace) {
+		// Long strings get a block of their own, so as not to waste the rest
+		// of the current one
+		const auto blockSize = std::max(s.size(), STRING_BLOCK_SIZE);
+		stringBlocks.push_back(std::make_unique<char[]>(blockSize));
+		stringBytes += blockSize;
+		if (blockSize > STRING_BLOCK_SIZE) {
+			std::memcpy(stringBlocks.back().get(), s.data(), s.size());
+			return { stringBlocks.back().get(), s.size() };
+		}
+		stringFree = stringBlocks.back().get();
+		stringSpace = blockSize;
+	}
+	std::memcpy(stringFree, s.data(), s.size());
+	const std::string_view stored(stringFree, s.size());
+	stringFree += s.size();
+	stringSpace -= s.size();
+	return stored;
+}
+
+std::string_view ScanTree::Intern(std::string_view s)
+{
+	if (const auto it = names.find(s); it != names.end()) return *it;
+	const auto stored = Store(s);
+	names.insert(stored);
+	return stored;
+}
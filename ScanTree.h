@@ -0,0 +1,73 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+// The objects found while scanning a device, stored compactly enough for
+// phones with millions of files. Nodes only refer to their parent and are
+// allocated in chunks that never move. Names are stored once, no matter how
+// many objects share them, and paths are only put together when asked for.
+// A single thread adds nodes; other threads may read the nodes they were
+// handed, such as by way of a queue
+class ScanTree
+{
+public:
+	using NodeID = uint32_t;
+	static constexpr NodeID NO_NODE = UINT32_MAX;
+
+	struct Node
+	{
+		NodeID parent;
+		bool isFolder;
+		std::string_view name;
+		std::string_view key; // in the manifest
+		uint64_t size;
+		int64_t modified;
+	};
+
+	ScanTree();
+	~ScanTree();
+	ScanTree(const ScanTree&) = delete;
+	ScanTree& operator=(const ScanTree&) = delete;
+
+	// Nodes without a parent are the roots of the backup locations. Yields
+	// NO_NODE if the tree is full
+	NodeID Add(NodeID parent, std::string_view name, std::string_view key, uint64_t size, int64_t modified, bool isFolder);
+	const Node& Get(NodeID id) const { return chunks[id / NODES_PER_CHUNK][id % NODES_PER_CHUNK]; }
+	// Relative to the root; empty for the root itself
+	std::string GetPath(NodeID id) const;
+	// Same as comparing to GetPath(), without putting the path together
+	bool HasPath(NodeID id, std::string_view path) const;
+
+	bool IsFull() const { return numNodes == NODES_PER_CHUNK * MAX_CHUNKS; }
+	size_t GetNumNodes() const { return numNodes; }
+	// Of the nodes and strings, in bytes
+	size_t GetMemoryUsage() const;
+
+private:
+	static constexpr size_t NODES_PER_CHUNK = 64 * 1024;
+	static constexpr size_t MAX_CHUNKS = 4096;
+	static constexpr size_t STRING_BLOCK_SIZE = 256 * 1024;
+
+	std::string_view Store(std::string_view s);
+	std::string_view Intern(std::string_view s);
+
+	std::array<std::unique_ptr<Node[]>, MAX_CHUNKS> chunks;
+	size_t numNodes{};
+	std::vector<std::unique_ptr<char[]>> stringBlocks;
+	char* stringFree{};
+	size_t stringSpace{};
+	size_t stringBytes{};
+	std::unordered_set<std::string_view> names;
+};
@@ -0,0 +1,113 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+// Like BoundedQueue, but Pop() hands out the waiting item that comes first
+// according to a comparison function rather than the oldest one. Items
+// that compare equal are handed out in the order they were pushed, so
+// without a comparison function this is a plain FIFO. Only the items that
+// are waiting are ordered, so the capacity determines how far ahead the
+// producer may run to find better candidates
+template<typename T> class ScheduledQueue
+{
+public:
+	// Returns true if a must be handed out before b
+	using CompareFn = std::function<bool(const T& a, const T& b)>;
+
+	ScheduledQueue(size_t capacity, CompareFn compare = {}) : capacity(capacity), compare(std::move(compare)) { }
+
+	bool Push(T item)
+	{
+		std::unique_lock lock(mutex);
+		notFull.wait(lock, [&] { return closed || items.size() < capacity; });
+		if (closed) return false;
+		items.push_back({ std::move(item), nextSequence++ });
+		std::push_heap(items.begin(), items.end(), After());
+		notEmpty.notify_one();
+		return true;
+	}
+
+	std::optional<T> Pop()
+	{
+		std::unique_lock lock(mutex);
+		notEmpty.wait(lock, [&] { return closed || !items.empty(); });
+		if (items.empty()) return {};
+		return TakeNext();
+	}
+
+	// Like Pop(), but gives up once the deadline has passed
+	template<typename Clock, typename Duration> std::optional<T> PopUntil(const std::chrono::time_point<Clock, Duration>& deadline)
+	{
+		std::unique_lock lock(mutex);
+		if (!notEmpty.wait_until(lock, deadline, [&] { return closed || !items.empty(); })) return {};
+		if (items.empty()) return {};
+		return TakeNext();
+	}
+
+	// Whether Pop() will never yield anything anymore
+	bool IsDrained()
+	{
+		std::lock_guard lock(mutex);
+		return closed && items.empty();
+	}
+
+	void Close()
+	{
+		std::lock_guard lock(mutex);
+		closed = true;
+		notFull.notify_all();
+		notEmpty.notify_all();
+	}
+
+private:
+	struct Entry
+	{
+		T item;
+		uint64_t sequence;
+	};
+
+	const size_t capacity;
+	const CompareFn compare;
+	std::mutex mutex;
+	std::condition_variable notFull;
+	std::condition_variable notEmpty;
+	std::vector<Entry> items; // a heap with the next item to hand out on top
+	uint64_t nextSequence{};
+	bool closed{};
+
+	// Must be called with the mutex held and an item waiting
+	T TakeNext()
+	{
+		std::pop_heap(items.begin(), items.end(), After());
+		auto item = std::move(items.back().item);
+		items.pop_back();
+		notFull.notify_one();
+		return item;
+	}
+
+	// The heap functions put the largest element on top, so this must
+	// return true if a is handed out after b
+	auto After() const
+	{
+		return [this](const Entry& a, const Entry& b) {
+			if (compare) {
+				if (compare(b.item, a.item)) return true;
+				if (compare(a.item, b.item)) return false;
+			}
+			return a.sequence > b.sequence;
+		};
+	}
+};
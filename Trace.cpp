@@ -0,0 +1,189 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#include "Trace.h"
+#include <algorithm>
+#include <bit>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <mutex>
+#include <vector>
+
+namespace trace
+{
+	namespace
+	{
+		thread_local Statistics* currentStatistics{};
+
+		struct Event
+		{
+			Operation operation;
+			unsigned int threadId;
+			Clock::time_point start;
+			Clock::duration duration;
+			uint64_t bytes;
+		};
+
+		// Only used if tracing is enabled
+		struct Tracer
+		{
+			std::string path;
+			std::mutex mutex;
+			std::vector<Event> events;
+			unsigned int numThreads{};
+
+			Tracer()
+			{
+				if (const auto s = std::getenv("REPLICANDROID_TRACE"); s) path = s;
+			}
+
+			unsigned int GetThreadId()
+			{
+				thread_local unsigned int threadId{};
+				if (threadId == 0) {
+					std::lock_guard lock(mutex);
+					threadId = ++numThreads;
+				}
+				return threadId;
+			}
+		};
+
+		Tracer& GetTracer()
+		{
+			static Tracer tracer;
+			return tracer;
+		}
+
+		uint64_t ToMicroseconds(Clock::duration d)
+		{
+			return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(d).count());
+		}
+	}
+
+	const char* GetName(Operation operation)
+	{
+		switch (operation) {
+			case Operation::ReadProperties: return "ReadProperties";
+			case Operation::EnumerateContents: return "EnumerateContents";
+			case Operation::EnumerateContentsWithProperties: return "EnumerateContentsWithProperties";
+			case Operation::FindByPersistentId: return "FindByPersistentId";
+			case Operation::Reopen: return "Reopen";
+			case Operation::ReadDataFirstChunk: return "ReadData (first chunk)";
+			case Operation::ReadDataChunk: return "ReadData (chunk)";
+			case Operation::WriterWait: return "Writer wait";
+			case Operation::WriteBudgetWait: return "Write budget wait";
+			case Operation::DiskWrite: return "Disk write";
+			case Operation::Hash: return "Hash";
+			default: return "?";
+		}
+	}
+
+	void Statistics::Record(Operation operation, Clock::duration duration, uint64_t bytes)
+	{
+		auto& c = counters[static_cast<size_t>(operation)];
+		const auto us = ToMicroseconds(duration);
+		c.count.fetch_add(1, std::memory_order_relaxed);
+		c.bytes.fetch_add(bytes, std::memory_order_relaxed);
+		c.totalMicroseconds.fetch_add(us, std::memory_order_relaxed);
+		auto max = c.maxMicroseconds.load(std::memory_order_relaxed);
+		while (us > max && !c.maxMicroseconds.compare_exchange_weak(max, us, std::memory_order_relaxed)) { }
+		const auto bucket = std::min<size_t>(std::bit_width(us), NUM_BUCKETS - 1);
+		c.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	std::string Statistics::GetSummary() const
+	{
+		std::string result;
+		char line[256];
+		std::snprintf(line, sizeof(line), "%-32s %9s %10s %10s %8s %8s %8s %8s\n",
+			"Operation", "Count", "MB", "Total s", "Avg us", "p50 us", "p99 us", "Max us");
+		result += line;
+		for (size_t n = 0; n < static_cast<size_t>(Operation::NumOperations); ++n) {
+			const auto& c = counters[n];
+			const auto count = c.count.load(std::memory_order_relaxed);
+			if (count == 0) continue;
+
+			// Percentiles are only known up to their bucket's upper bound
+			auto percentile = [&](double p) -> uint64_t {
+				const auto wanted = static_cast<uint64_t>(p * count);
+				uint64_t seen{};
+				for (size_t b = 0; b < NUM_BUCKETS; ++b) {
+					seen += c.buckets[b].load(std::memory_order_relaxed);
+					if (seen > wanted) return uint64_t{ 1 } << b;
+				}
+				return c.maxMicroseconds.load(std::memory_order_relaxed);
+			};
+			const auto totalMicroseconds = c.totalMicroseconds.load(std::memory_order_relaxed);
+			std::snprintf(line, sizeof(line), "%-32s %9llu %10.1f %10.2f %8llu %8llu %8llu %8llu\n",
+				GetName(static_cast<Operation>(n)),
+				static_cast<unsigned long long>(count),
+				c.bytes.load(std::memory_order_relaxed) / (1024.0 * 1024.0),
+				totalMicroseconds / 1e6,
+				static_cast<unsigned long long>(totalMicroseconds / count),
+				static_cast<unsigned long long>(std::min(percentile(0.5), c.maxMicroseconds.load(std::memory_order_relaxed))),
+				static_cast<unsigned long long>(std::min(percentile(0.99), c.maxMicroseconds.load(std::memory_order_relaxed))),
+				static_cast<unsigned long long>(c.maxMicroseconds.load(std::memory_order_relaxed)));
+			result += line;
+		}
+		return result;
+	}
+
+	Statistics& GetStatistics()
+	{
+		static Statistics global;
+		return currentStatistics ? *currentStatistics : global;
+	}
+
+	StatisticsScope::StatisticsScope(Statistics& statistics)
+		: previous(currentStatistics)
+	{
+		currentStatistics = &statistics;
+	}
+
+	StatisticsScope::~StatisticsScope()
+	{
+		currentStatistics = previous;
+	}
+
+	void Record(Operation operation, Clock::time_point start, uint64_t bytes)
+	{
+		const auto duration = Clock::now() - start;
+		GetStatistics().Record(operation, duration, bytes);
+
+		auto& tracer = GetTracer();
+		if (tracer.path.empty()) return;
+		const auto threadId = tracer.GetThreadId();
+		std::lock_guard lock(tracer.mutex);
+		tracer.events.push_back({ operation, threadId, start, duration, bytes });
+	}
+
+	bool WriteTraceFile()
+	{
+		auto& tracer = GetTracer();
+		if (tracer.path.empty()) return true;
+
+		std::lock_guard lock(tracer.mutex);
+		Clock::time_point epoch{ Clock::time_point::max() };
+		for (const auto& event : tracer.events)
+			epoch = std::min(epoch, event.start);
+
+		std::ofstream ofs(tracer.path, std::ofstream::out | std::ofstream::trunc);
+		ofs << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+		const char* separator = "";
+		for (const auto& event : tracer.events) {
+			ofs << separator
+				<< "{\"name\":\"" << GetName(event.operation) << "\",\"cat\":\"replicandroid\",\"ph\":\"X\""
+				<< ",\"ts\":" << ToMicroseconds(event.start - epoch)
+				<< ",\"dur\":" << ToMicroseconds(event.duration)
+				<< ",\"pid\":1,\"tid\":" << event.threadId
+				<< ",\"args\":{\"bytes\":" << event.bytes << "}}";
+			separator = ",\n";
+		}
+		ofs << "]}\n";
+		return static_cast<bool>(ofs.flush());
+	}
+}
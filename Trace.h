@@ -0,0 +1,99 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Instrumentation of device and disk operations. Every operation is counted
+// in a Statistics object; if the REPLICANDROID_TRACE environment variable
+// names a file, a Chrome/Perfetto trace of all operations is written there
+// as well (load it in chrome://tracing or ui.perfetto.dev)
+namespace trace
+{
+	enum class Operation
+	{
+		ReadProperties,
+		EnumerateContents,
+		EnumerateContentsWithProperties,
+		FindByPersistentId,
+		Reopen,
+		ReadDataFirstChunk, // includes setting up the transfer
+		ReadDataChunk,
+		WriterWait, // waiting for a free buffer, i.e. the disk is behind
+		WriteBudgetWait, // waiting for the backups of other devices to write
+		DiskWrite,
+		Hash, // of data that was written
+		NumOperations
+	};
+
+	const char* GetName(Operation);
+
+	using Clock = std::chrono::steady_clock;
+
+	// Counts, byte totals and a latency histogram per kind of operation
+	class Statistics
+	{
+	public:
+		// Bucket n holds latencies below 2^n microseconds
+		static constexpr size_t NUM_BUCKETS = 32;
+
+		void Record(Operation, Clock::duration, uint64_t bytes);
+		// A table for humans
+		std::string GetSummary() const;
+
+	private:
+		struct Counters
+		{
+			std::atomic<uint64_t> count{};
+			std::atomic<uint64_t> bytes{};
+			std::atomic<uint64_t> totalMicroseconds{};
+			std::atomic<uint64_t> maxMicroseconds{};
+			std::atomic<uint64_t> buckets[NUM_BUCKETS]{};
+		};
+		Counters counters[static_cast<size_t>(Operation::NumOperations)];
+	};
+
+	// Yields where operations on this thread are counted: the object set by
+	// the innermost StatisticsScope, or a process-wide one
+	Statistics& GetStatistics();
+
+	class StatisticsScope
+	{
+		Statistics* previous;
+
+	public:
+		explicit StatisticsScope(Statistics&);
+		~StatisticsScope();
+		StatisticsScope(const StatisticsScope&) = delete;
+		StatisticsScope& operator=(const StatisticsScope&) = delete;
+	};
+
+	// Records an operation that started at the given time and ends now
+	void Record(Operation, Clock::time_point start, uint64_t bytes = 0);
+
+	// Writes all trace events so far to the trace file, if there is one
+	bool WriteTraceFile();
+
+	// Records the operation for the lifetime of the span
+	class Span
+	{
+		Operation operation;
+		Clock::time_point start;
+		uint64_t bytes{};
+
+	public:
+		explicit Span(Operation operation) : operation(operation), start(Clock::now()) { }
+		~Span() { Record(operation, start, bytes); }
+		Span(const Span&) = delete;
+		Span& operator=(const Span&) = delete;
+
+		void SetBytes(uint64_t n) { bytes = n; }
+	};
+}
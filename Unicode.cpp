@@ -0,0 +1,119 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#include "Unicode.h"
+#include <cstdint>
+#include <cstring>
+
+namespace unicode
+{
+	namespace
+	{
+		constexpr char32_t REPLACEMENT_CHARACTER = 0xFFFD;
+		constexpr uint64_t HIGH_BITS = 0x8080808080808080ull;
+
+		// Number of leading ASCII characters, found a word at a time
+		size_t CountAscii(const char* s, size_t length)
+		{
+			size_t n = 0;
+			for (; n + 8 <= length; n += 8) {
+				uint64_t word;
+				std::memcpy(&word, s + n, sizeof(word));
+				if (word & HIGH_BITS) break;
+			}
+			while (n < length && static_cast<unsigned char>(s[n]) < 0x80) ++n;
+			return n;
+		}
+
+		void AppendUtf8(std::string& out, char32_t cp)
+		{
+			if (cp < 0x80) {
+				out += static_cast<char>(cp);
+			} else if (cp < 0x800) {
+				out += static_cast<char>(0xC0 | (cp >> 6));
+				out += static_cast<char>(0x80 | (cp & 0x3F));
+			} else if (cp < 0x10000) {
+				out += static_cast<char>(0xE0 | (cp >> 12));
+				out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+				out += static_cast<char>(0x80 | (cp & 0x3F));
+			} else {
+				out += static_cast<char>(0xF0 | (cp >> 18));
+				out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+				out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+				out += static_cast<char>(0x80 | (cp & 0x3F));
+			}
+		}
+
+		void AppendWide(std::wstring& out, char32_t cp)
+		{
+			if constexpr (sizeof(wchar_t) == 2) {
+				if (cp >= 0x10000) {
+					cp -= 0x10000;
+					out += static_cast<wchar_t>(0xD800 | (cp >> 10));
+					out += static_cast<wchar_t>(0xDC00 | (cp & 0x3FF));
+					return;
+				}
+			}
+			out += static_cast<wchar_t>(cp);
+		}
+
+		// Decodes a single code point that is not ASCII; advances n past it
+		char32_t DecodeUtf8(std::string_view s, size_t& n)
+		{
+			const auto lead = static_cast<unsigned char>(s[n++]);
+			size_t extra;
+			char32_t cp, min;
+			if ((lead & 0xE0) == 0xC0) { extra = 1; cp = lead & 0x1F; min = 0x80; }
+			else if ((lead & 0xF0) == 0xE0) { extra = 2; cp = lead & 0x0F; min = 0x800; }
+			else if ((lead & 0xF8) == 0xF0) { extra = 3; cp = lead & 0x07; min = 0x10000; }
+			else return REPLACEMENT_CHARACTER;
+
+			for (size_t i = 0; i < extra; ++i, ++n) {
+				if (n >= s.size() || (static_cast<unsigned char>(s[n]) & 0xC0) != 0x80) return REPLACEMENT_CHARACTER;
+				cp = (cp << 6) | (static_cast<unsigned char>(s[n]) & 0x3F);
+			}
+			if (cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) return REPLACEMENT_CHARACTER;
+			return cp;
+		}
+	}
+
+	std::string ToUtf8(std::wstring_view s)
+	{
+		std::string out;
+		out.reserve(s.size());
+		for (size_t n = 0; n < s.size(); ++n) {
+			char32_t cp = static_cast<char32_t>(s[n]);
+			if (cp < 0x80) {
+				out += static_cast<char>(cp);
+				continue;
+			}
+			if constexpr (sizeof(wchar_t) == 2) {
+				if (cp >= 0xD800 && cp <= 0xDBFF && n + 1 < s.size() && s[n + 1] >= 0xDC00 && s[n + 1] <= 0xDFFF) {
+					cp = 0x10000 + ((cp - 0xD800) << 10) + (static_cast<char32_t>(s[++n]) - 0xDC00);
+				} else if (cp >= 0xD800 && cp <= 0xDFFF) {
+					cp = REPLACEMENT_CHARACTER;
+				}
+			}
+			if (cp > 0x10FFFF) cp = REPLACEMENT_CHARACTER;
+			AppendUtf8(out, cp);
+		}
+		return out;
+	}
+
+	std::wstring ToWide(std::string_view s)
+	{
+		std::wstring out;
+		out.reserve(s.size());
+		size_t n = 0;
+		while (n < s.size()) {
+			const auto ascii = CountAscii(s.data() + n, s.size() - n);
+			for (size_t end = n + ascii; n < end; ++n)
+				out += static_cast<wchar_t>(s[n]);
+			if (n < s.size()) AppendWide(out, DecodeUtf8(s, n));
+		}
+		return out;
+	}
+}
@@ -0,0 +1,20 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#pragma once
+
+#include <string>
+#include <string_view>
+
+// Conversions between UTF-8 and wide strings, which are UTF-16 on Windows and
+// UTF-32 elsewhere. Names on devices are mostly ASCII, so runs of it are
+// found eight bytes at a time and copied without decoding. Invalid input is
+// replaced by U+FFFD rather than rejected
+namespace unicode
+{
+	std::string ToUtf8(std::wstring_view s);
+	std::wstring ToWide(std::string_view s);
+}
@@ -0,0 +1,87 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+// Hands out work to a fixed number of worker threads. Every worker has a
+// deque of its own, which items are spread over; a worker that runs out
+// takes from the others instead of waiting. Workers take the oldest items
+// first. Unlike BoundedQueue, nothing is handed out once closed, even if
+// items are left
+template<typename T> class WorkStealingQueue
+{
+public:
+	explicit WorkStealingQueue(size_t numWorkers)
+	{
+		for (size_t n = 0; n < numWorkers; ++n)
+			deques.push_back(std::make_unique<Deque>());
+	}
+
+	void Push(T item)
+	{
+		{
+			auto& deque = *deques[nextDeque];
+			nextDeque = (nextDeque + 1) % deques.size();
+			std::lock_guard lock(deque.mutex);
+			deque.items.push_back(std::move(item));
+		}
+		std::lock_guard lock(mutex);
+		++numItems;
+		available.notify_one();
+	}
+
+	// Blocks until there is an item, looking in the worker's own deque first
+	std::optional<T> Pop(size_t worker)
+	{
+		{
+			std::unique_lock lock(mutex);
+			available.wait(lock, [&] { return closed || numItems > 0; });
+			if (closed) return {};
+			// There is an item for us now, though another worker may get to
+			// it first; then there is another one
+			--numItems;
+		}
+		while (true) {
+			for (size_t n = 0; n < deques.size(); ++n) {
+				auto& deque = *deques[(worker + n) % deques.size()];
+				std::lock_guard lock(deque.mutex);
+				if (deque.items.empty()) continue;
+				auto item = std::move(deque.items.front());
+				deque.items.pop_front();
+				return item;
+			}
+		}
+	}
+
+	void Close()
+	{
+		std::lock_guard lock(mutex);
+		closed = true;
+		available.notify_all();
+	}
+
+private:
+	struct Deque
+	{
+		std::mutex mutex;
+		std::deque<T> items;
+	};
+
+	std::vector<std::unique_ptr<Deque>> deques;
+	size_t nextDeque{}; // only used by Push(), from a single thread
+	std::mutex mutex;
+	std::condition_variable available;
+	size_t numItems{};
+	bool closed{};
+};
@@ -7,36 +7,30 @@
 #pragma once
 
 #include <QThread>
-#include "MTP.h"
-#include "Config.h"
-
-struct BackupLocation
-{
-	mtp::ObjectID objectId;
-	std::string where;
-};
-using BackupLocations = std::vector<BackupLocation>;
+#include "Backup.h"
 
 class WorkThread : public QThread
 {
 	Q_OBJECT
 
 public:
-	WorkThread(QObject* parent, CComPtr<IPortableDevice> activeDevice, BackupLocations locations);
+	WorkThread(QObject* parent, mtp::SessionPtr activeDevice, BackupLocations locations, BackupOptions options);
 	virtual ~WorkThread();
-	
-	struct Impl;
+
+	// Makes the thread finish as soon as possible
+	void Abort();
+
+	// May be sampled at any time, from any thread
+	const Progress& GetProgress() const;
+	// Device and disk operations of this backup, for diagnosing slow ones
+	const trace::Statistics& GetStatistics() const;
 
 signals:
-	void numbersUpdated(const NumbersAvailable&);
-	void numbersComplete(const NumbersAvailable&);
-	void itemsUpdated(const NumbersAvailable&, const ItemsUpdate&);
 	void finished(const ItemsUpdate&, const std::vector<FailedItem>&);
 
 public:
 	void run() override;
 
 private:
-	std::unique_ptr<Impl> impl;
+	Backup backup;
 };
-
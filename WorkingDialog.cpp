@@ -8,10 +8,11 @@
 #include "MTP.h"
 #include "WorkThread.h"
 #include <QMessageBox>
+#include <algorithm>
+#include <cmath>
 
-WorkingDialog::WorkingDialog(QWidget* parent, CComPtr<IPortableDevice>& activeDevice, BackupLocations locations)
+WorkingDialog::WorkingDialog(QWidget* parent, std::vector<BackupJob> jobs, BackupOptions options)
     : QDialog(parent)
-    , activeDevice(activeDevice)
 {
     ui.setupUi(this);
 
@@ -21,41 +22,172 @@ WorkingDialog::WorkingDialog(QWidget* parent, CComPtr<IPortableDevice>& activeDe
 
     ui.status->setText("Determining number of items to copy");
 
-    workThread = std::make_unique<WorkThread>(this, activeDevice, std::move(locations));
-	connect(workThread.get(), &WorkThread::numbersUpdated, this, &WorkingDialog::OnNumbersUpdated);
-	connect(workThread.get(), &WorkThread::numbersComplete, this, &WorkingDialog::OnNumbersComplete);
-	connect(workThread.get(), &WorkThread::itemsUpdated, this, &WorkingDialog::OnItemsUpdated);
-	connect(workThread.get(), &WorkThread::finished, this, &WorkingDialog::OnFinished);
-    workThread->start();
+    ui.deviceStatus->setVisible(jobs.size() > 1);
+
+    // Writing the backups of several devices at the same time should not
+    // make the disk seek back and forth between all of them
+    if (jobs.size() > 1) options.writeBudget = std::make_shared<WriteBudget>();
+    devices.reserve(jobs.size());
+    for (auto& job : jobs) {
+        auto workThread = std::make_unique<WorkThread>(this, job.device, std::move(job.locations), options);
+        const auto index = devices.size();
+        connect(workThread.get(), &WorkThread::finished, this, [this, index](const ItemsUpdate& iu, const std::vector<FailedItem>& failedItems) {
+            OnFinished(index, iu, failedItems);
+        });
+        devices.push_back({ std::move(job.name), std::move(job.device), std::move(workThread) });
+    }
+    connect(&progressTimer, &QTimer::timeout, this, &WorkingDialog::UpdateProgress);
+    lastSample = std::chrono::steady_clock::now();
+    progressTimer.start(PROGRESS_INTERVAL_MS);
+    for (auto& device : devices)
+        device.workThread->start();
 }
 
-WorkingDialog::~WorkingDialog() = default;
+WorkingDialog::~WorkingDialog()
+{
+    // Stop all of them at once rather than waiting for each in turn
+    for (auto& device : devices)
+        device.workThread->Abort();
+}
 
-void WorkingDialog::OnNumbersUpdated(const NumbersAvailable& na)
+namespace
 {
-	auto s(QString("Scanning: %1 items totalling %2 KB").arg(na.totalNumberOfItems).arg(na.totalNumberOfBytes / 1024));
-	ui.status->setText(s);
+    QString FormatDuration(double seconds)
+    {
+        const auto s = static_cast<long long>(seconds);
+        return QString("%1:%2:%3").arg(s / 3600).arg((s / 60) % 60, 2, 10, QChar('0')).arg(s % 60, 2, 10, QChar('0'));
+    }
 }
 
-void WorkingDialog::OnNumbersComplete(const NumbersAvailable& na)
+// The progress is sampled rather than reported by the work thread, so that
+// backing up many small files does not flood the event loop. Scanning and
+// copying run at the same time, so the totals keep growing until the scan is
+// complete
+void WorkingDialog::UpdateProgress()
 {
-	auto s(QString("Copying: %1 items totalling %2 KB").arg(na.totalNumberOfItems).arg(na.totalNumberOfBytes / 1024));
+    // With several devices, the totals are those of all of them together
+    NumbersAvailable numbers;
+    ItemsUpdate items;
+    bool scanComplete = true;
+    uint64_t bytesInProgress{};
+    for (const auto& device : devices) {
+        const auto& progress = device.workThread->GetProgress();
+        const auto deviceNumbers = progress.GetNumbers();
+        const auto deviceItems = progress.GetItems();
+        numbers.totalNumberOfItems += deviceNumbers.totalNumberOfItems;
+        numbers.totalNumberOfBytes += deviceNumbers.totalNumberOfBytes;
+        items.itemsTransferredSuccessfully += deviceItems.itemsTransferredSuccessfully;
+        items.itemsTransferredFailures += deviceItems.itemsTransferredFailures;
+        items.itemsTransferredSkipped += deviceItems.itemsTransferredSkipped;
+        items.bytesRead += deviceItems.bytesRead;
+        items.bytesSkipped += deviceItems.bytesSkipped;
+        scanComplete = scanComplete && progress.scanComplete;
+        bytesInProgress += progress.bytesInProgress.load(std::memory_order_relaxed);
+    }
+    if (devices.size() > 1) UpdateDeviceStatus();
+    const auto itemsDone = items.itemsTransferredSuccessfully + items.itemsTransferredSkipped + items.itemsTransferredFailures;
+
+    // Exponential moving averages, so the rates do not jump around with
+    // every file
+    const auto now = std::chrono::steady_clock::now();
+    const auto elapsed = std::chrono::duration<double>(now - lastSample).count();
+    const auto bytesTransferred = std::max<uint64_t>(items.bytesRead + bytesInProgress, lastBytesTransferred);
+    if (elapsed > 0) {
+        const auto weight = 1.0 - std::exp(-elapsed / RATE_SMOOTHING_SECONDS);
+        bytesPerSecond += weight * ((bytesTransferred - lastBytesTransferred) / elapsed - bytesPerSecond);
+        itemsPerSecond += weight * ((itemsDone - lastItemsDone) / elapsed - itemsPerSecond);
+    }
+    lastSample = now;
+    lastBytesTransferred = bytesTransferred;
+    lastItemsDone = itemsDone;
+
+    if (itemsDone == 0 && bytesInProgress == 0 && !scanComplete) {
+        auto s(QString("Scanning: %1 items totalling %2 KB").arg(numbers.totalNumberOfItems).arg(numbers.totalNumberOfBytes / 1024));
+        ui.status->setText(s);
+        return;
+    }
+
+    const uint64_t bytesDone = items.bytesRead + items.bytesSkipped + bytesInProgress;
+    ui.progressBar->setMaximum(numbers.totalNumberOfBytes / 1024);
+    ui.progressBar->setValue(bytesDone / 1024);
+
+    QString eta("estimating time remaining");
+    if (scanComplete && bytesPerSecond > 0) {
+        const auto bytesRemaining = numbers.totalNumberOfBytes > bytesDone ? numbers.totalNumberOfBytes - bytesDone : 0;
+        eta = QString("%1 remaining").arg(FormatDuration(bytesRemaining / bytesPerSecond));
+    }
+    auto s(QString("Copying: %1 of %2%3 items copied, %4 skipped, %5 failured\n%6 MB/s, %7 items/s, %8")
+        .arg(items.itemsTransferredSuccessfully)
+        .arg(numbers.totalNumberOfItems)
+        .arg(scanComplete ? "" : "+")
+        .arg(items.itemsTransferredSkipped)
+        .arg(items.itemsTransferredFailures)
+        .arg(bytesPerSecond / (1024 * 1024), 0, 'f', 1)
+        .arg(itemsPerSecond, 0, 'f', 1)
+        .arg(eta));
 	ui.status->setText(s);
-    ui.progressBar->setMaximum(na.totalNumberOfBytes / 1024);
 }
 
-void WorkingDialog::OnItemsUpdated(const NumbersAvailable& na, const ItemsUpdate& iu)
+// One line per device, so that a slow or stuck one stands out
+void WorkingDialog::UpdateDeviceStatus()
 {
-    const auto total = (iu.bytesRead + iu.bytesSkipped) / 1024;
-    ui.progressBar->setValue(total);
-    auto s(QString("Copying: %1 of %2 items copied, %3 skipped, %4 failured").arg(iu.itemsTransferredSuccessfully).arg(na.totalNumberOfItems).arg(iu.itemsTransferredSkipped).arg(iu.itemsTransferredFailures));
-	ui.status->setText(s);
+    QString s;
+    for (const auto& device : devices) {
+        const auto& progress = device.workThread->GetProgress();
+        const auto numbers = progress.GetNumbers();
+        const auto items = device.finished ? device.items : progress.GetItems();
+        const uint64_t bytesDone = items.bytesRead + items.bytesSkipped + (device.finished ? 0 : progress.bytesInProgress.load(std::memory_order_relaxed));
+        const auto percentage = numbers.totalNumberOfBytes > 0 ? 100 * bytesDone / numbers.totalNumberOfBytes : 0;
+        if (!s.isEmpty()) s += "\n";
+        s += QString("%1: %2 of %3%4 items, %5%%6")
+            .arg(device.name)
+            .arg(items.itemsTransferredSuccessfully + items.itemsTransferredSkipped + items.itemsTransferredFailures)
+            .arg(numbers.totalNumberOfItems)
+            .arg(progress.scanComplete ? "" : "+")
+            .arg(percentage)
+            .arg(device.finished ? ", done" : "");
+    }
+    ui.deviceStatus->setText(s);
 }
 
-void WorkingDialog::OnFinished(const ItemsUpdate& iu, const std::vector<FailedItem>& failedItems)
+void WorkingDialog::OnFinished(size_t index, const ItemsUpdate& iu, const std::vector<FailedItem>& deviceFailedItems)
 {
+    auto& device = devices[index];
+    device.finished = true;
+    device.items = iu;
+    device.failedItems = deviceFailedItems;
+    if (!std::all_of(devices.begin(), devices.end(), [](const auto& d) { return d.finished; })) return;
+
+    progressTimer.stop();
+    if (devices.size() > 1) UpdateDeviceStatus();
+
+    ItemsUpdate total;
+    std::vector<FailedItem> failedItems;
+    QString details;
+    for (const auto& d : devices) {
+        total.itemsTransferredSuccessfully += d.items.itemsTransferredSuccessfully;
+        total.itemsTransferredSkipped += d.items.itemsTransferredSkipped;
+        failedItems.insert(failedItems.end(), d.failedItems.begin(), d.failedItems.end());
+        if (devices.size() > 1) details += d.name + "\n";
+        details += QString::fromStdString(d.workThread->GetStatistics().GetSummary());
+    }
+    for (const auto& item : failedItems) {
+        details += QString("\n%1: %2 (%3)").arg(QString::fromStdString(item.destPath),
+            mtp::GetErrorClassName(item.errorClass), QString::fromStdString(item.error));
+    }
+
+    QMessageBox box(this);
     if (!failedItems.empty()) {
-		QMessageBox::warning(this, "Warning", QString("Unable to transfer %1 item(s)").arg(failedItems.size()));
+        box.setIcon(QMessageBox::Warning);
+        box.setWindowTitle("Warning");
+        box.setText(QString("Unable to transfer %1 item(s)").arg(failedItems.size()));
+    } else {
+        box.setIcon(QMessageBox::Information);
+        box.setWindowTitle("Backup complete");
+        box.setText(QString("%1 item(s) copied, %2 skipped").arg(total.itemsTransferredSuccessfully).arg(total.itemsTransferredSkipped));
     }
+    // Lets users compare devices, cables and drivers
+    box.setDetailedText(details);
+    box.exec();
     accept();
 }
@@ -7,6 +7,8 @@
 #pragma once
 
 #include <QtWidgets/QWidget>
+#include <QTimer>
+#include <chrono>
 #include "ui_Working.h"
 #include "MTP.h"
 #include "WorkThread.h"
@@ -14,23 +16,50 @@
 struct NumbersAvailable;
 struct Configuration;
 
+// The backup of a single device
+struct BackupJob
+{
+    QString name;
+    mtp::SessionPtr device;
+    BackupLocations locations;
+};
+
 class WorkingDialog : public QDialog
 {
     Q_OBJECT
 
 public:
+    static constexpr int PROGRESS_INTERVAL_MS = 250;
+    // Time constant of the averaged transfer rates
+    static constexpr double RATE_SMOOTHING_SECONDS = 3.0;
 
 private:
+    struct DeviceState
+    {
+        QString name;
+        mtp::SessionPtr device;
+        std::unique_ptr<WorkThread> workThread;
+        bool finished{};
+        ItemsUpdate items;
+        std::vector<FailedItem> failedItems;
+    };
+
     Ui::Working ui;
-    CComPtr<IPortableDevice> activeDevice;
-    std::unique_ptr<WorkThread> workThread;
+    // Every device is backed up by a thread of its own
+    std::vector<DeviceState> devices;
+    QTimer progressTimer;
+    // Used to determine the transfer rates between samples
+    std::chrono::steady_clock::time_point lastSample;
+    uint64_t lastBytesTransferred{};
+    unsigned int lastItemsDone{};
+    double bytesPerSecond{};
+    double itemsPerSecond{};
 
-    void OnNumbersUpdated(const NumbersAvailable&);
-    void OnNumbersComplete(const NumbersAvailable&);
-    void OnItemsUpdated(const NumbersAvailable&, const ItemsUpdate&);
-    void OnFinished(const ItemsUpdate& iu, const std::vector<FailedItem>& failedItems);
+    void UpdateProgress();
+    void UpdateDeviceStatus();
+    void OnFinished(size_t device, const ItemsUpdate& iu, const std::vector<FailedItem>& failedItems);
 
 public:
-    WorkingDialog(QWidget* parent, CComPtr<IPortableDevice>& activeDevice, BackupLocations);
+    WorkingDialog(QWidget* parent, std::vector<BackupJob> jobs, BackupOptions);
     virtual ~WorkingDialog();
 };
@@ -0,0 +1,54 @@
+/*-
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Copyright (c) 2022 Rink Springer <rink@rink.nu>
+ * For conditions of distribution and use, see LICENSE file
+ */
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+
+// Limits the number of disk writes that are in progress at the same time,
+// shared by the backups of all devices. A disk does best with a few writes
+// queued, but many files written at once make it seek back and forth
+class WriteBudget
+{
+	const size_t maxWriters;
+	std::mutex mutex;
+	std::condition_variable available;
+	size_t numWriters{};
+
+public:
+	static constexpr size_t DEFAULT_MAX_WRITERS = 2;
+
+	explicit WriteBudget(size_t maxWriters = DEFAULT_MAX_WRITERS) : maxWriters(maxWriters) { }
+
+	void Acquire()
+	{
+		std::unique_lock lock(mutex);
+		available.wait(lock, [&] { return numWriters < maxWriters; });
+		++numWriters;
+	}
+
+	void Release()
+	{
+		{
+			std::lock_guard lock(mutex);
+			--numWriters;
+		}
+		available.notify_one();
+	}
+
+	class Slot
+	{
+		WriteBudget& budget;
+
+	public:
+		explicit Slot(WriteBudget& budget) : budget(budget) { budget.Acquire(); }
+		~Slot() { budget.Release(); }
+		Slot(const Slot&) = delete;
+		Slot& operator=(const Slot&) = delete;
+	};
+};